@@ -23,17 +23,25 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #endif
 #include "archive.h"
 
+#include "checksum.h"
 #include "extractcallback.h"
 #include "inputstream.h"
 #include "opencallback.h"
 #include "propertyvariant.h"
 #include "library.h"
+#include "sequentialstream.h"
+#include "storedentries.h"
+#include "verifycallback.h"
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
 #include <map>
 #include <stddef.h>
 #include <string>
+#include <future>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <iostream> // UNUSED
@@ -92,13 +100,70 @@ public:
     // Wrap the callback so that we do not have to check if it is set everywhere:
     m_LogCallback = logCallback ? logCallback : DefaultLogCallback;
   }
+  virtual void setOutputEngine(OutputEngine engine) override {
+    m_ExtractSettings.Engine = engine;
+  }
+  virtual void setCacheBypassThreshold(uint64_t threshold) override {
+    m_ExtractSettings.CacheBypassThreshold = threshold;
+  }
+  virtual void setDirectoryCreation(DirectoryCreation creation) override {
+    m_ExtractSettings.DirectoryCreation = creation;
+  }
+  virtual void setOverwritePolicy(OverwritePolicy policy) override {
+    m_ExtractSettings.OverwritePolicy = policy;
+  }
+  virtual void setCloseThreads(std::size_t threads) override {
+    m_ExtractSettings.CloseThreads = threads;
+  }
+  virtual void setDurability(Durability durability) override {
+    m_ExtractSettings.Durability = durability;
+  }
+  virtual void setSmallFileThreshold(uint64_t threshold) override {
+    m_ExtractSettings.SmallFileThreshold = threshold;
+  }
+  virtual void setInputEngine(InputEngine engine) override {
+    m_InputEngine = engine;
+  }
+  virtual void setZeroCopy(ZeroCopy zeroCopy) override {
+    m_ExtractSettings.ZeroCopy = zeroCopy;
+  }
+  virtual void setSparseThreshold(uint64_t threshold) override {
+    m_ExtractSettings.SparseThreshold = threshold;
+  }
+  virtual void setLinkPolicy(LinkPolicy policy) override {
+    m_ExtractSettings.LinkPolicy = policy;
+  }
+  virtual void setSpaceReservation(SpaceReservation reservation) override {
+    m_ExtractSettings.SpaceReservation = reservation;
+  }
+  virtual void setNestedArchives(NestedArchives nested) override {
+    m_NestedArchives = nested;
+  }
+  virtual void setArchiveHashing(bool hash) override {
+    m_ArchiveHashing = hash;
+  }
+  virtual std::string getArchiveDigest() override;
+  virtual void setEntryHashing(HashAlgorithm algorithm, DigestCallback callback) override {
+    m_ExtractSettings.EntryHashing = callback ? algorithm : HashAlgorithm::NONE;
+    m_ExtractSettings.DigestCallback = callback;
+  }
+  virtual void setCrcVerification(CrcVerification verification, EntryResultCallback callback) override {
+    m_ExtractSettings.CrcVerification = verification;
+    m_ExtractSettings.EntryResultCallback = callback;
+  }
+  virtual bool fingerprint(PathStr const& archivePath, Fingerprint& fingerprint) const override;
+  virtual bool fingerprint(Fingerprint& fingerprint) override;
 
   virtual bool open(PathStr const &archiveName, PasswordCallback passwordCallback) override;
+  virtual bool open(std::span<const std::byte> data, PathStr const& nameHint, PasswordCallback passwordCallback) override;
+  virtual bool openSequential(ReadCallback reader, PathStr const& nameHint, PasswordCallback passwordCallback) override;
   virtual void close() override;
   const std::vector<FileData*>& getFileList() const override { return m_FileList; }
   virtual bool extract(PathStr const& outputDirectory, ProgressCallback progressCallback,
                        FileChangeCallback fileChangeCallback, ErrorCallback errorCallback) override;
 
+  virtual bool verify(std::vector<EntryResult>& results, std::size_t threads) override;
+
   virtual void cancel() override;
 
 private:
@@ -108,6 +173,43 @@ private:
 
   HRESULT loadFormats();
 
+  // Detect the format of the given archive stream and open it, filepath is only used for
+  // its extension and in messages:
+  bool openStream(IInStream* file, std::filesystem::path const& filepath, CArchiveOpenCallback* openCallbackPtr);
+
+  // Compute the Size and Content fields of a fingerprint from the given archive stream, its
+  // position is preserved:
+  static HRESULT sampleContent(IInStream* stream, Fingerprint& fingerprint);
+
+  // Wrap the given archive stream to hash it if enabled, see setArchiveHashing():
+  CMyComPtr<IInStream> hashInput(IInStream* file);
+
+  // Open the archive wrapped by the current one instead, if any and according to
+  // m_NestedArchives, the current archive is kept otherwise:
+  void openNested(CArchiveOpenCallback* openCallbackPtr, std::filesystem::path const& filepath);
+
+  // Create a handler for the given format and open the given stream with it sequentially,
+  // the handler is released on failure:
+  struct ArchiveFormatInfo;
+  bool openSequentialStream(ISequentialInStream* stream, ArchiveFormatInfo const& format, CMyComPtr<IInArchive>& archive);
+
+  // Extract all the entries of a sequential archive, see openSequential():
+  HRESULT extractSequential();
+
+  // Open another handler on the archive file, with the format of the current one, for the
+  // verification threads:
+  HRESULT reopenArchive(CMyComPtr<IInArchive>& archive) const;
+
+  // Split the given entries between at most the given number of threads, balancing their
+  // size, the entries of a solid block are kept together:
+  std::vector<std::vector<UInt32>> partitionEntries(std::vector<UInt32> const& indices, std::size_t threads) const;
+
+#ifndef _WIN32
+  // Extract the stored entries among the given ones by copying their data directly, the
+  // indices of these entries are removed:
+  HRESULT copyStoredEntries(std::vector<UInt32>& indices);
+#endif
+
 private:
 
   typedef UINT32 (WINAPI *CreateObjectFunc)(const GUID *clsID, const GUID *interfaceID, void **outObject);
@@ -127,9 +229,44 @@ private:
 
   ALibrary  m_Library;
   PathStr m_ArchiveName; //TBH I don't think this is required
+  PathStr m_FormatName;
   CMyComPtr<IInArchive> m_ArchivePtr;
   CArchiveExtractCallback *m_ExtractCallback;
 
+  // Sequential archives (see openSequential()), for compressed tarballs the decompressor
+  // writes to m_Pipe in the background (m_Decompression), and m_ArchivePtr reads it:
+  bool m_Sequential;
+  CMyComPtr<IInArchive> m_OuterArchivePtr;
+  std::shared_ptr<StreamPipe> m_Pipe;
+  std::future<HRESULT> m_Decompression;
+  PathStr m_DefaultName;
+
+  // Stop of the reader of the sequential archive, requested by cancel() and close():
+  std::stop_source m_ReadStop;
+
+  ExtractSettings m_ExtractSettings;
+  InputEngine m_InputEngine;
+  NestedArchives m_NestedArchives;
+
+  // Set by cancel() to abort verify():
+  std::atomic<bool> m_VerifyCanceled;
+
+  // Cost of an entry when partitioning the entries to verify, in addition to its size:
+  static constexpr UInt64 kVerifyEntryCost = 4096;
+
+  bool m_ArchiveHashing;
+  CMyComPtr<HashingInputStream> m_HashingStream;
+
+  // Stream of the opened archive file (or data), for fingerprint():
+  CMyComPtr<IInStream> m_InputStream;
+
+  // Fingerprints sample blocks of this size, evenly spaced over the archive:
+  static constexpr UInt32 kFingerprintBlockSize = 64 << 10;
+  static constexpr UInt64 kFingerprintSamples = 16;
+
+  // Maximum size of the nested archives decoded into memory:
+  static constexpr UInt64 kMaxNestedBufferSize = UInt64(256) << 20;
+
   LogCallback m_LogCallback;
   PasswordCallback m_PasswordCallback;
 
@@ -162,6 +299,10 @@ private:
   SignatureMap m_SignatureMap;
 
   std::size_t m_MaxSignatureLen = 0;
+
+  // Largest offset + length of the signatures, i.e. how much of the start of an archive
+  // is needed to check all of them:
+  std::size_t m_MaxSignatureEnd = 0;
 };
 
 Archive::LogCallback ArchiveImpl::DefaultLogCallback([](LogLevel, PathStr const&) {});
@@ -219,12 +360,17 @@ HRESULT ArchiveImpl::loadFormats()
     //need to support this at all, so I'm storing it but ignoring it.
     item.m_AdditionalExtensions = readHandlerProperty<PathStr>(i, PropID::kAddExtension);
 
+    // The offset is read first so that the entries of the signature map have it:
+    UInt32 offset = readHandlerProperty<UInt32>(i, PropID::kSignatureOffset);
+    item.m_SignatureOffset = offset;
+
     std::string signature = readHandlerProperty<std::string>(i, PropID::kSignature);
     if (!signature.empty()) {
       item.m_Signatures.push_back(signature);
       if (m_MaxSignatureLen < signature.size()) {
         m_MaxSignatureLen = signature.size();
       }
+      m_MaxSignatureEnd = std::max(m_MaxSignatureEnd, offset + signature.size());
       m_SignatureMap[signature] = item;
     }
 
@@ -242,12 +388,10 @@ HRESULT ArchiveImpl::loadFormats()
       if (m_MaxSignatureLen < sig.size()) {
         m_MaxSignatureLen = sig.size();
       }
+      m_MaxSignatureEnd = std::max(m_MaxSignatureEnd, offset + sig.size());
       m_SignatureMap[sig] = item;
     }
 
-    UInt32 offset = readHandlerProperty<UInt32>(i, PropID::kSignatureOffset);
-    item.m_SignatureOffset = offset;
-
     //Now split the extension up from the space separated string and create
     //a map from each extension to the possible formats
     //We could make these pointers but it's not a massive overhead and nobody
@@ -272,6 +416,12 @@ ArchiveImpl::ArchiveImpl()
 #else
   , m_Library("/usr/lib/p7zip/7z.so")
 #endif
+  , m_ExtractCallback(nullptr)
+  , m_Sequential(false)
+  , m_InputEngine(InputEngine::STREAM)
+  , m_NestedArchives(NestedArchives::DISABLED)
+  , m_VerifyCanceled(false)
+  , m_ArchiveHashing(false)
   , m_PasswordCallback{}
 {
   std::cerr << "FIXME: 7z.so search path" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
@@ -318,10 +468,11 @@ ArchiveImpl::~ArchiveImpl()
 bool ArchiveImpl::open(PathStr const& archiveName, PasswordCallback passwordCallback)
 {
   std::cerr << "FIXME: ArchiveImpl::open: '" + archiveName + "'" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
+  if (m_Sequential) {
+    close();
+  }
   m_ArchiveName = archiveName; //Just for debugging, not actually used...
 
-  Formats formatList = m_Formats;
-
   // Convert to long path if it's not already:
   std::filesystem::path filepath = IO::make_path(archiveName);
 
@@ -336,21 +487,281 @@ bool ArchiveImpl::open(PathStr const& archiveName, PasswordCallback passwordCall
   // to the callback for now
   m_PasswordCallback = passwordCallback;
 
-  CMyComPtr<InputStream> file(new InputStream);
+  CMyComPtr<CArchiveOpenCallback> openCallbackPtr;
+  try {
+    openCallbackPtr = new CArchiveOpenCallback(passwordCallback, m_LogCallback, filepath, m_InputEngine);
+  }
+  catch (std::runtime_error const& ex) {
+    m_LastError = Error::ERROR_FAILED_TO_OPEN_ARCHIVE;
+    return false;
+  }
 
-  if (!file->Open(filepath)) {
+  // Opened through the callback, so the handler gets the same stream if it asks for the
+  // first volume of a multi-volume archive:
+  CMyComPtr<IInStream> file;
+  if (openCallbackPtr->OpenVolume(filepath, &file) != S_OK) {
     m_LastError = Error::ERROR_FAILED_TO_OPEN_ARCHIVE;
     return false;
   }
+  m_InputStream = file;
 
-  CMyComPtr<CArchiveOpenCallback> openCallbackPtr;
-  try {
-    openCallbackPtr = new CArchiveOpenCallback(passwordCallback, m_LogCallback, filepath);
+  if (!openStream(hashInput(file), filepath, openCallbackPtr)) {
+    return false;
   }
-  catch (std::runtime_error const& ex) {
+  openNested(openCallbackPtr, filepath);
+  return true;
+}
+
+bool ArchiveImpl::open(std::span<const std::byte> data, PathStr const& nameHint, PasswordCallback passwordCallback)
+{
+  if (m_Sequential) {
+    close();
+  }
+
+  // There is no archive file, so nothing can be read from it directly:
+  m_ArchiveName.clear();
+  m_PasswordCallback = passwordCallback;
+
+  const std::filesystem::path filepath(nameHint);
+  CMyComPtr<IInStream> file(new MemoryInputStream(data.data(), data.size()));
+  m_InputStream = file;
+  CMyComPtr<CArchiveOpenCallback> openCallbackPtr(
+    new CArchiveOpenCallback(passwordCallback, m_LogCallback, filepath, m_InputEngine, true));
+
+  if (!openStream(hashInput(file), filepath, openCallbackPtr)) {
+    return false;
+  }
+  openNested(openCallbackPtr, filepath);
+  return true;
+}
+
+bool ArchiveImpl::openSequential(ReadCallback reader, PathStr const& nameHint, PasswordCallback passwordCallback)
+{
+  close();
+
+  // There is no archive file, so nothing can be read from it directly:
+  m_ArchiveName.clear();
+  m_PasswordCallback = passwordCallback;
+
+  const std::filesystem::path filepath(nameHint);
+  const PathStr extension = filepath.has_extension()
+    ? ArchiveStrings::towlower(filepath.extension().native().substr(1)) : PathStr();
+
+  // The input cannot be rewound to try several formats, so the format is chosen upfront,
+  // by signature, then by extension:
+  m_ReadStop = std::stop_source();
+  CMyComPtr<SequentialInputStream> input(new SequentialInputStream(std::move(reader), m_ReadStop.get_token()));
+  // Signatures are not all at the start (e.g. "ustar" for tar), and the longest match is the
+  // most specific one:
+  const std::string head = input->Peek(m_MaxSignatureEnd);
+  ArchiveFormatInfo const* format = nullptr;
+  std::size_t matchLength = 0;
+  for (auto const& [signature, info] : m_SignatureMap) {
+    const std::size_t offset = info.m_SignatureOffset;
+    if (signature.size() > matchLength && head.size() >= offset + signature.size()
+        && head.compare(offset, signature.size(), signature) == 0) {
+      format = &info;
+      matchLength = signature.size();
+    }
+  }
+  if (format == nullptr) {
+    FormatMap::const_iterator iter = m_FormatMap.find(extension);
+    if (iter != m_FormatMap.end() && !iter->second.empty()) {
+      format = &iter->second.front();
+    }
+  }
+  if (format == nullptr) {
+    m_LogCallback(LogLevel::Warning, ALOGSTR"Trying to open a sequential archive but could not recognize the extension or signature.");
+    m_LastError = Error::ERROR_INVALID_ARCHIVE_FORMAT;
+    return false;
+  }
+
+  CMyComPtr<IInArchive> archive;
+  if (!openSequentialStream(input, *format, archive)) {
+    return false;
+  }
+
+  // Compressors list the extensions of compressed tarballs (e.g. tgz) with a ".tar" additional
+  // extension, see loadFormats():
+  bool compressor = false;
+  bool tarball = ArchiveStrings::towlower(filepath.stem().extension().native()) == ALOGSTR".tar";
+  {
+    PathStrIStream extensions(format->m_Extensions);
+    PathStrIStream additionalExtensions(format->m_AdditionalExtensions);
+    PathStr ext, additional;
+    while (extensions >> ext && additionalExtensions >> additional) {
+      if (additional == ALOGSTR".tar") {
+        compressor = true;
+        tarball = tarball || ext == extension;
+      }
+    }
+  }
+
+  m_FormatName = format->m_Name;
+  if (compressor && tarball) {
+    auto tar = std::find_if(m_Formats.begin(), m_Formats.end(), [](ArchiveFormatInfo const& info) {
+      return ArchiveStrings::towlower(info.m_Name) == ALOGSTR"tar"; });
+    if (tar == m_Formats.end()) {
+      m_LastError = Error::ERROR_LIBRARY_ERROR;
+      return false;
+    }
+
+    // The tar handler may read its first header when opened, so the decompression starts now:
+    m_Pipe = std::make_shared<StreamPipe>();
+    m_OuterArchivePtr = archive;
+    m_Decompression = std::async(std::launch::async, [pipe = m_Pipe, archive] { return pipe->Fill(archive); });
+
+    archive.Release();
+    if (!openSequentialStream(m_Pipe->Reader(), *tar, archive)) {
+      close();
+      return false;
+    }
+    m_FormatName = tar->m_Name;
+  }
+
+  m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Opened {} sequentially using {}{}.",
+    filepath, m_FormatName, m_OuterArchivePtr ? fmt::format(ALOGSTR" over {}", format->m_Name) : PathStr()));
+
+  m_ArchivePtr = archive;
+  m_Sequential = true;
+  m_DefaultName = filepath.stem().native();
+  m_LastError = Error::ERROR_NONE;
+  return true;
+}
+
+bool ArchiveImpl::openSequentialStream(ISequentialInStream* stream, ArchiveFormatInfo const& format, CMyComPtr<IInArchive>& archive)
+{
+  if (m_CreateObjectFunc(&format.m_ClassID, &IID_IInArchive, (void**)&archive) != S_OK) {
+    m_LastError = Error::ERROR_LIBRARY_ERROR;
+    return false;
+  }
+
+  CMyComPtr<IArchiveOpenSeq> openSeq;
+  if (archive.QueryInterface(IID_IArchiveOpenSeq, &openSeq) != S_OK || !openSeq) {
+    m_LogCallback(LogLevel::Error, fmt::format(ALOGSTR"The {} format cannot be read sequentially.", format.m_Name));
+    archive.Release();
+    m_LastError = Error::ERROR_INVALID_ARCHIVE_FORMAT;
+    return false;
+  }
+
+  if (openSeq->OpenSeq(stream) != S_OK) {
+    m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Failed to open the sequential archive using {}.", format.m_Name));
+    archive.Release();
     m_LastError = Error::ERROR_FAILED_TO_OPEN_ARCHIVE;
     return false;
   }
+  return true;
+}
+
+CMyComPtr<IInStream> ArchiveImpl::hashInput(IInStream* file)
+{
+  m_HashingStream.Release();
+  if (!m_ArchiveHashing) {
+    return file;
+  }
+  m_HashingStream = new HashingInputStream(file);
+  return CMyComPtr<IInStream>(m_HashingStream);
+}
+
+std::string ArchiveImpl::getArchiveDigest()
+{
+  if (!m_HashingStream) {
+    return {};
+  }
+
+  Checksum::Sha256::Digest digest;
+  if (m_HashingStream->Digest(digest) != S_OK) {
+    m_LogCallback(LogLevel::Error, ALOGSTR"Failed to read the archive to complete its digest.");
+    return {};
+  }
+  m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Archive hashed, {} bytes read again to complete the digest.",
+    m_HashingStream->FilledSize()));
+  return Checksum::to_hex(digest.data(), digest.size());
+}
+
+HRESULT ArchiveImpl::sampleContent(IInStream* stream, Fingerprint& fingerprint)
+{
+  UInt64 position = 0;
+  UInt64 size = 0;
+  RINOK(stream->Seek(0, STREAM_SEEK_CUR, &position));
+  RINOK(stream->Seek(0, STREAM_SEEK_END, &size));
+
+  std::vector<unsigned char> block(kFingerprintBlockSize);
+  UInt64 hash = 0;
+  auto sample = [&](UInt64 offset) -> HRESULT {
+    RINOK(stream->Seek(offset, STREAM_SEEK_SET, nullptr));
+    UInt32 filled = 0;
+    UInt32 read = 0;
+    do {
+      RINOK(stream->Read(block.data() + filled, kFingerprintBlockSize - filled, &read));
+      filled += read;
+    } while (read > 0 && filled < kFingerprintBlockSize);
+    hash = Checksum::xxh64(block.data(), filled, hash);
+    return S_OK;
+  };
+
+  // The start and the end hold the headers of most formats, and small archives are
+  // hashed entirely:
+  const UInt64 stride = std::max<UInt64>(kFingerprintBlockSize, size / kFingerprintSamples);
+  for (UInt64 offset = 0; offset < size; offset += stride) {
+    RINOK(sample(offset));
+  }
+  if (size > kFingerprintBlockSize) {
+    RINOK(sample(size - kFingerprintBlockSize));
+  }
+  RINOK(stream->Seek(position, STREAM_SEEK_SET, nullptr));
+
+  fingerprint.Size = size;
+  fingerprint.Content = hash;
+  fingerprint.Listing = 0;
+  return S_OK;
+}
+
+bool ArchiveImpl::fingerprint(PathStr const& archivePath, Fingerprint& fingerprint) const
+{
+  const std::filesystem::path filepath = IO::make_path(archivePath);
+  CMyComPtr<IInStream> file = openInputStream(filepath, InputEngine::STREAM);
+  if (!file) {
+    m_LogCallback(LogLevel::Error, fmt::format(ALOGSTR"Cannot open {} to compute its fingerprint: {}.",
+      filepath, IO::last_error()));
+    return false;
+  }
+  return sampleContent(file, fingerprint) == S_OK;
+}
+
+bool ArchiveImpl::fingerprint(Fingerprint& fingerprint)
+{
+  if (!m_InputStream || sampleContent(m_InputStream, fingerprint) != S_OK) {
+    return false;
+  }
+
+  // Fixed-size little-endian fields and UTF-8 paths, so the fingerprint does not depend
+  // on the platform:
+  std::string listing;
+  auto append = [&listing](UInt64 value) {
+    for (int i = 0; i < 8; ++i) {
+      listing.push_back(static_cast<char>(value >> (8 * i)));
+    }
+  };
+  for (FileData const* fileData : m_FileList) {
+    const auto path = std::filesystem::path(fileData->getArchiveFilePath()).u8string();
+    listing.append(reinterpret_cast<const char*>(path.data()), path.size());
+    listing.push_back('\0');
+    append(fileData->getSize());
+    append(fileData->getCRC());
+    listing.push_back(fileData->isDirectory() ? 1 : 0);
+  }
+  fingerprint.Listing = Checksum::xxh64(listing.data(), listing.size());
+  return true;
+}
+
+bool ArchiveImpl::openStream(IInStream* file, std::filesystem::path const& filepath, CArchiveOpenCallback* openCallbackPtr)
+{
+  Formats formatList = m_Formats;
+
+  // Extension of the archive, without the dot, used as a hint for the format:
+  const PathStr extension = filepath.has_extension()
+    ? ArchiveStrings::towlower(filepath.extension().native().substr(1)) : PathStr();
 
   // Try to open the archive
 
@@ -375,20 +786,19 @@ bool ArchiveImpl::open(PathStr const& archiveName, PasswordCallback passwordCall
 
         if (m_ArchivePtr->Open(file, 0, openCallbackPtr) != S_OK) {
           m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Failed to open {} using {} (from signature.",
-            archiveName, signatureInfo.second.m_Name));
+            filepath, signatureInfo.second.m_Name));
           m_ArchivePtr.Release();
         }
         else {
           m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Opened {} using {} (from signature).",
-            archiveName, signatureInfo.second.m_Name));
+            filepath, signatureInfo.second.m_Name));
+          m_FormatName = signatureInfo.second.m_Name;
 
-          // Retrieve the extension (warning: .extension() contains the dot):
-          PathStr ext = ArchiveStrings::towlower(filepath.extension().native().substr(1));
           PathStrIStream s(signatureInfo.second.m_Extensions);
           PathStr t;
           bool found = false;
           while (s >> t) {
-            if (t == ext) {
+            if (t == extension) {
               found = true;
               break;
             }
@@ -412,8 +822,7 @@ bool ArchiveImpl::open(PathStr const& archiveName, PasswordCallback passwordCall
   {
     // determine archive type based on extension
     Formats const *formats = nullptr;
-    PathStr ext = ArchiveStrings::towlower(filepath.extension().native().substr(1));
-    FormatMap::const_iterator map_iter = m_FormatMap.find(ext);
+    FormatMap::const_iterator map_iter = m_FormatMap.find(extension);
     if (map_iter != m_FormatMap.end()) {
       formats = &map_iter->second;
       if (formats != nullptr) {
@@ -428,12 +837,13 @@ bool ArchiveImpl::open(PathStr const& archiveName, PasswordCallback passwordCall
 
             if (m_ArchivePtr->Open(file, 0, openCallbackPtr) != S_OK) {
               m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Failed to open {} using {} (from signature).",
-                archiveName, format.m_Name));
+                filepath, format.m_Name));
               m_ArchivePtr.Release();
             }
             else {
               m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Opened {} using {} (from signature).",
-                archiveName, format.m_Name));
+                filepath, format.m_Name));
+              m_FormatName = format.m_Name;
               break;
             }
 
@@ -462,8 +872,9 @@ bool ArchiveImpl::open(PathStr const& archiveName, PasswordCallback passwordCall
       }
       if (m_ArchivePtr->Open(file, 0, openCallbackPtr) == S_OK) {
         m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Opened {} using {} (from signature).",
-          archiveName, format.m_Name));
+          filepath, format.m_Name));
         m_LogCallback(LogLevel::Warning, ALOGSTR"This archive likely has an incorrect extension.");
+        m_FormatName = format.m_Name;
         break;
       } else
         m_ArchivePtr.Release();
@@ -476,44 +887,202 @@ bool ArchiveImpl::open(PathStr const& archiveName, PasswordCallback passwordCall
   }
 
   m_Password = openCallbackPtr->GetPassword();
-/*
-  UInt32 subFile = ULONG_MAX;
+
+  m_LastError = Error::ERROR_NONE;
+
+  resetFileList();
+  std::cerr << "FIXME: open done, list done" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
+  return true;
+}
+
+void ArchiveImpl::openNested(CArchiveOpenCallback* openCallbackPtr, std::filesystem::path const& filepath)
+{
+  namespace fs = std::filesystem;
+
+  if (m_NestedArchives == NestedArchives::DISABLED) {
+    return;
+  }
+
+  // The wrapped archive is the main subfile of the archive if any, or its only entry:
+  UInt32 numItems = 0;
+  m_ArchivePtr->GetNumberOfItems(&numItems);
+  UInt32 subfile = numItems == 1 ? 0 : static_cast<UInt32>(-1);
   {
-    NCOM::CPropVariant prop;
-    if (m_ArchivePtr->GetArchiveProperty(kpidMainSubfile, &prop) != S_OK) {
-      throw std::runtime_error("failed to get property kpidMainSubfile");
+    PropertyVariant prop;
+    if (m_ArchivePtr->GetArchiveProperty(kpidMainSubfile, &prop) == S_OK && prop.vt == VT_UI4) {
+      subfile = prop.ulVal;
     }
+  }
+  if (subfile >= numItems || readProperty<bool>(subfile, kpidIsDir)) {
+    return;
+  }
 
-    if (prop.vt == VT_UI4) {
-      subFile = prop.ulVal;
+  // Compressors list a ".tar" additional extension, see loadFormats():
+  bool compressed = false;
+  auto outerFormat = std::find_if(m_Formats.begin(), m_Formats.end(), [this](ArchiveFormatInfo const& info) {
+    return info.m_Name == m_FormatName; });
+  if (outerFormat != m_Formats.end()) {
+    PathStrIStream additionalExtensions(outerFormat->m_AdditionalExtensions);
+    PathStr additional;
+    while (additionalExtensions >> additional) {
+      compressed = compressed || additional == ALOGSTR".tar";
     }
   }
+  if (!compressed && m_NestedArchives != NestedArchives::ALL) {
+    return;
+  }
 
-  if (subFile != ULONG_MAX) {
-    std::wstring subPath = GetArchiveItemPath(m_ArchivePtr, subFile);
+  // Compressors may not know the name of their content (e.g. gzip without name):
+  std::wstring subName = readProperty<std::wstring>(subfile, kpidPath);
+  const fs::path subPath = subName.empty() ? filepath.stem() : fs::path(subName);
+  if (subName.empty()) {
+    subName = subPath.wstring();
+  }
 
-    CMyComPtr<IArchiveOpenSetSubArchiveName> setSubArchiveName;
-    openCallbackPtr.QueryInterface(IID_IArchiveOpenSetSubArchiveName, (void **)&setSubArchiveName);
-    if (setSubArchiveName) {
-      setSubArchiveName->SetSubArchiveName(subPath.c_str());
+  // Only entries that look like archives, a single document or executable is not opened:
+  const PathStr extension = subPath.has_extension()
+    ? ArchiveStrings::towlower(subPath.extension().native().substr(1)) : PathStr();
+  FormatMap::const_iterator formats = m_FormatMap.find(extension);
+  if (formats == m_FormatMap.end() || formats->second.empty()) {
+    return;
+  }
+
+  // Read the entry directly from the handler if it can, otherwise decode it in the
+  // background (compressors have a single entry):
+  CMyComPtr<ISequentialInStream> stream;
+  std::shared_ptr<StreamPipe> pipe;
+  std::future<HRESULT> decompression;
+  CMyComPtr<IInArchiveGetStream> getStream;
+  if (m_ArchivePtr.QueryInterface(IID_IInArchiveGetStream, &getStream) == S_OK && getStream) {
+    getStream->GetStream(subfile, &stream);
+  }
+  if (!stream && numItems == 1) {
+    pipe = std::make_shared<StreamPipe>();
+    decompression = std::async(std::launch::async, [pipe, archive = m_ArchivePtr] { return pipe->Fill(archive); });
+    stream = pipe->Reader();
+  }
+  if (!stream) {
+    return;
+  }
+
+  // Stops the decompression, if any, when the nested archive cannot be opened:
+  auto abandon = [&](PathStr const& reason) {
+    if (pipe) {
+      pipe->CloseReader();
+      decompression.wait();
     }
-  }*/
+    m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Not opening nested archive {}: {}.", subPath, reason));
+  };
 
-  m_LastError = Error::ERROR_NONE;
+  UInt64 size = 0;
+  bool sizeDefined = false;
+  {
+    PropertyVariant prop;
+    if (m_ArchivePtr->GetProperty(subfile, kpidSize, &prop) == S_OK && !prop.is_empty()) {
+      size = static_cast<UInt64>(prop);
+      sizeDefined = true;
+    }
+  }
 
-  resetFileList();
-  std::cerr << "FIXME: open done, list done" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
-  return true;
-}
+  CMyComPtr<IInStream> inStream;
+  stream.QueryInterface(IID_IInStream, &inStream);
+  if (!inStream && (!sizeDefined || size <= kMaxNestedBufferSize)) {
+    // Formats that need to seek are decoded into memory:
+    auto buffer = std::make_shared<std::vector<unsigned char>>();
+    buffer->reserve(sizeDefined ? static_cast<std::size_t>(size) : std::size_t(1) << 20);
+    constexpr UInt32 kChunkSize = 1 << 20;
+    for (;;) {
+      const std::size_t offset = buffer->size();
+      buffer->resize(offset + kChunkSize);
+      UInt32 read = 0;
+      const HRESULT result = stream->Read(buffer->data() + offset, kChunkSize, &read);
+      buffer->resize(offset + read);
+      if (result != S_OK) {
+        abandon(ALOGSTR"failed to decode it");
+        return;
+      }
+      if (read == 0) {
+        break;
+      }
+      if (buffer->size() > kMaxNestedBufferSize) {
+        abandon(ALOGSTR"too large to be decoded into memory");
+        return;
+      }
+    }
+    if (pipe && decompression.get() != S_OK) {
+      m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Not opening nested archive {}: failed to decode it.", subPath));
+      return;
+    }
+    pipe.reset();
+    stream.Release();
+    inStream = new MemoryInputStream(buffer->data(), buffer->size(), buffer);
+  }
+
+  CMyComPtr<IInArchive> outer = m_ArchivePtr;
+  const PathStr outerFormatName = m_FormatName;
+  m_ArchivePtr.Release();
+  openCallbackPtr->SetSubArchiveName(subName.c_str());
+
+  bool opened = false;
+  if (inStream) {
+    opened = openStream(inStream, subPath, openCallbackPtr);
+  }
+  else {
+    // Too large for memory, only formats that can be read sequentially are possible:
+    CMyComPtr<IInArchive> archive;
+    opened = openSequentialStream(stream, formats->second.front(), archive);
+    if (opened) {
+      m_ArchivePtr = archive;
+      m_FormatName = formats->second.front().m_Name;
+      m_Sequential = true;
+      m_Pipe = pipe;
+      m_Decompression = std::move(decompression);
+      m_DefaultName = subPath.stem().native();
+      clearFileList();
+    }
+  }
 
+  if (!opened) {
+    abandon(ALOGSTR"unknown format");
+    m_ArchivePtr = outer;
+    m_FormatName = outerFormatName;
+    m_LastError = Error::ERROR_NONE;
+    return;
+  }
+
+  m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Opened nested archive {} using {}.", subPath, m_FormatName));
+
+  // The entries are not in the archive file anymore:
+  m_OuterArchivePtr = outer;
+  m_ArchiveName.clear();
+}
 
 void ArchiveImpl::close()
 {
+  // Unblock the reader of a sequential archive, if it is waiting for data:
+  m_ReadStop.request_stop();
   if (m_ArchivePtr != nullptr) {
     m_ArchivePtr->Close();
   }
+  if (m_Pipe) {
+    // Unblock the decompression if the archive was not extracted:
+    m_Pipe->CloseReader();
+    if (m_Decompression.valid()) {
+      m_Decompression.wait();
+    }
+  }
+  if (m_OuterArchivePtr != nullptr) {
+    m_OuterArchivePtr->Close();
+  }
   clearFileList();
   m_ArchivePtr.Release();
+  m_OuterArchivePtr.Release();
+  m_Pipe.reset();
+  m_Decompression = {};
+  m_HashingStream.Release();
+  m_InputStream.Release();
+  m_Sequential = false;
+  m_FormatName.clear();
   m_PasswordCallback = {};
 }
 
@@ -541,6 +1110,61 @@ void ArchiveImpl::resetFileList()
   }
 }
 
+#ifndef _WIN32
+HRESULT ArchiveImpl::copyStoredEntries(std::vector<UInt32>& indices)
+{
+  const PathStr format = ArchiveStrings::towlower(m_FormatName);
+  if (m_ArchiveName.empty() || (format != ALOGSTR"zip" && format != ALOGSTR"tar")) {
+    return S_OK;
+  }
+
+  IO::FileIn source;
+  if (!source.Open(IO::make_path(m_ArchiveName))) {
+    m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Cannot open {} to copy stored entries: {}.",
+      m_ArchiveName, IO::last_error()));
+    return S_OK;
+  }
+
+  auto locations = format == ALOGSTR"zip"
+    ? StoredEntries::locateZip(m_ArchivePtr, source, indices)
+    : StoredEntries::locateTar(m_ArchivePtr, source, indices);
+  if (locations.empty()) {
+    return S_OK;
+  }
+
+  // Tar has no checksum to verify, and the data is already verified while it is written with
+  // CrcVerification::WRITE_PATH:
+  const bool verify = m_ExtractSettings.ZeroCopy == ZeroCopy::VERIFIED && format == ALOGSTR"zip"
+    && m_ExtractSettings.CrcVerification == CrcVerification::DEFAULT;
+
+  IO::CopyState state;
+  state.Clone = m_ExtractSettings.ZeroCopy == ZeroCopy::CLONE;
+
+  std::vector<UInt32> remaining;
+  std::size_t copied = 0;
+  for (UInt32 index : indices) {
+    auto it = locations.find(index);
+    if (it == locations.end()) {
+      remaining.push_back(index);
+      continue;
+    }
+    auto const& location = it->second;
+    if (verify && StoredEntries::crc32(source, location) != m_FileList[index]->getCRC()) {
+      m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"CRC mismatch for stored entry {}, extracting it normally.", index));
+      remaining.push_back(index);
+      continue;
+    }
+    RINOK(m_ExtractCallback->CopyStoredEntry(index, source, location.Offset, location.Size, state));
+    ++copied;
+  }
+  indices.swap(remaining);
+
+  m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Copied {} stored entries directly from the archive ({} bytes cloned, {} bytes copied).",
+    copied, state.Cloned, state.Copied));
+  return S_OK;
+}
+#endif
+
 bool ArchiveImpl::extract(PathStr const& outputDirectory, ProgressCallback progressCallback,
                           FileChangeCallback fileChangeCallback, ErrorCallback errorCallback)
 
@@ -556,6 +1180,12 @@ bool ArchiveImpl::extract(PathStr const& outputDirectory, ProgressCallback progr
     }
   }
 
+  if (m_Sequential && m_ArchivePtr == nullptr) {
+    m_LogCallback(LogLevel::Error, ALOGSTR"Sequential archives can only be extracted once.");
+    m_LastError = Error::ERROR_ARCHIVE_INVALID;
+    return false;
+  }
+
   m_ExtractCallback = new CArchiveExtractCallback(progressCallback,
                                                   fileChangeCallback,
                                                   errorCallback,
@@ -563,13 +1193,44 @@ bool ArchiveImpl::extract(PathStr const& outputDirectory, ProgressCallback progr
                                                   m_LogCallback,
                                                   m_ArchivePtr,
                                                   outputDirectory,
-                                                  &m_FileList[0],
+                                                  m_FileList.data(),
                                                   m_FileList.size(),
                                                   totalSize,
-                                                  &m_Password);
-  HRESULT result = m_ArchivePtr->Extract(indices.data(), static_cast<UInt32>(indices.size()), false, m_ExtractCallback);
+                                                  &m_Password,
+                                                  m_ExtractSettings);
+
+  // Keep a reference so the callback outlives Extract(), pending output operations
+  // are completed by Finalize():
+  CMyComPtr<CArchiveExtractCallback> extractCallback(m_ExtractCallback);
+
+  HRESULT result = S_OK;
+  if (m_Sequential) {
+    result = extractSequential();
+  }
+  else if (m_ExtractSettings.DirectoryCreation != DirectoryCreation::ON_DEMAND) {
+    result = m_ExtractCallback->PrecreateDirectories(
+      m_ExtractSettings.DirectoryCreation == DirectoryCreation::UPFRONT_PARALLEL);
+  }
+  if (result == S_OK && !m_Sequential && m_ExtractSettings.SpaceReservation != SpaceReservation::NONE) {
+    result = m_ExtractCallback->ReserveSpace(
+      m_ExtractSettings.SpaceReservation != SpaceReservation::CHECK,
+      m_ExtractSettings.SpaceReservation == SpaceReservation::PREALLOCATE_PARALLEL);
+  }
+#ifndef _WIN32
+  if (result == S_OK && m_ExtractSettings.ZeroCopy != ZeroCopy::DISABLED) {
+    result = copyStoredEntries(indices);
+  }
+#endif
+  if (result == S_OK && !m_Sequential && !indices.empty()) {
+    result = m_ArchivePtr->Extract(indices.data(), static_cast<UInt32>(indices.size()), false, m_ExtractCallback);
+  }
   std::cerr << "FIXME: Extract result '" + std::to_string(result) + "'" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
-  //Note: m_ExtractCallBack is deleted by Extract
+  HRESULT finalizeResult = extractCallback->Finalize();
+  if (result == S_OK) {
+    result = finalizeResult;
+  }
+  m_ExtractCallback = nullptr;
+
   switch (result) {
     case S_OK: {
       //nop
@@ -580,6 +1241,9 @@ bool ArchiveImpl::extract(PathStr const& outputDirectory, ProgressCallback progr
     case E_OUTOFMEMORY: {
       m_LastError = Error::ERROR_OUT_OF_MEMORY;
     } break;
+    case CArchiveExtractCallback::kDiskFull: {
+      m_LastError = Error::ERROR_NOT_ENOUGH_SPACE;
+    } break;
     default: {
       m_LastError = Error::ERROR_LIBRARY_ERROR;
     } break;
@@ -589,9 +1253,217 @@ bool ArchiveImpl::extract(PathStr const& outputDirectory, ProgressCallback progr
 }
 
 
+HRESULT ArchiveImpl::extractSequential()
+{
+  m_ExtractCallback->SetSequential(std::filesystem::path(m_DefaultName).wstring());
+
+  HRESULT result = m_ArchivePtr->Extract(nullptr, static_cast<UInt32>(-1), false, m_ExtractCallback);
+
+  if (m_Pipe) {
+    // The tar handler may stop before the end of the decompressed data (padding), or on
+    // error, the decompression is then aborted:
+    m_Pipe->CloseReader();
+    const HRESULT decompressionResult = m_Decompression.get();
+    if (decompressionResult != S_OK && decompressionResult != E_ABORT) {
+      m_LogCallback(LogLevel::Error, fmt::format(ALOGSTR"Failed to decompress the {} archive.", m_FormatName));
+      result = decompressionResult;
+    }
+  }
+
+  // The input is consumed:
+  m_ArchivePtr->Close();
+  m_ArchivePtr.Release();
+  return result;
+}
+
+
+HRESULT ArchiveImpl::reopenArchive(CMyComPtr<IInArchive>& archive) const
+{
+  auto format = std::find_if(m_Formats.begin(), m_Formats.end(), [this](ArchiveFormatInfo const& info) {
+    return info.m_Name == m_FormatName; });
+  if (format == m_Formats.end()) {
+    return E_FAIL;
+  }
+
+  // The password is already known if the headers are encrypted:
+  const std::filesystem::path filepath = IO::make_path(m_ArchiveName);
+  CMyComPtr<CArchiveOpenCallback> openCallbackPtr;
+  try {
+    openCallbackPtr = new CArchiveOpenCallback([password = m_Password] { return password; },
+      m_LogCallback, filepath, m_InputEngine);
+  }
+  catch (std::runtime_error const&) {
+    return E_FAIL;
+  }
+
+  CMyComPtr<IInStream> file;
+  RINOK(openCallbackPtr->OpenVolume(filepath, &file));
+  if (m_CreateObjectFunc(&format->m_ClassID, &IID_IInArchive, (void**)&archive) != S_OK) {
+    return E_FAIL;
+  }
+  RINOK(archive->Open(file, 0, openCallbackPtr));
+
+  // The indices are shared with the current handler:
+  UInt32 numItems;
+  RINOK(archive->GetNumberOfItems(&numItems));
+  return numItems == m_FileList.size() ? S_OK : E_FAIL;
+}
+
+std::vector<std::vector<UInt32>> ArchiveImpl::partitionEntries(std::vector<UInt32> const& indices, std::size_t threads) const
+{
+  // Entries are grouped by solid block, solid archives that do not give the block of their
+  // entries are a single block:
+  PropertyVariant solid;
+  const bool isSolid = m_ArchivePtr->GetArchiveProperty(kpidSolid, &solid) == S_OK
+    && solid.vt == VT_BOOL && static_cast<bool>(solid);
+
+  struct Group {
+    std::vector<UInt32> Indices;
+    UInt64 Cost = 0;
+  };
+  std::vector<Group> groups;
+  std::unordered_map<UInt64, std::size_t> blocks;
+  constexpr UInt64 kSolidBlock = std::numeric_limits<UInt64>::max();
+  for (UInt32 index : indices) {
+    PropertyVariant block;
+    std::size_t group = groups.size();
+    if (m_ArchivePtr->GetProperty(index, kpidBlock, &block) == S_OK && (block.vt == VT_UI4 || block.vt == VT_UI8)) {
+      group = blocks.try_emplace(static_cast<uint64_t>(block), groups.size()).first->second;
+    }
+    else if (isSolid) {
+      group = blocks.try_emplace(kSolidBlock, groups.size()).first->second;
+    }
+    if (group == groups.size()) {
+      groups.emplace_back();
+    }
+    groups[group].Indices.push_back(index);
+    groups[group].Cost += m_FileList[index]->getSize() + kVerifyEntryCost;
+  }
+
+  // Largest groups first, each to the least loaded thread:
+  std::sort(groups.begin(), groups.end(), [](Group const& lhs, Group const& rhs) { return lhs.Cost > rhs.Cost; });
+  std::vector<std::vector<UInt32>> partitions(std::max<std::size_t>(1, std::min(threads, groups.size())));
+  std::vector<UInt64> loads(partitions.size(), 0);
+  for (auto const& group : groups) {
+    const std::size_t thread = std::min_element(loads.begin(), loads.end()) - loads.begin();
+    partitions[thread].insert(partitions[thread].end(), group.Indices.begin(), group.Indices.end());
+    loads[thread] += group.Cost;
+  }
+
+  // Handlers expect the indices in order:
+  for (auto& partition : partitions) {
+    std::sort(partition.begin(), partition.end());
+  }
+  return partitions;
+}
+
+bool ArchiveImpl::verify(std::vector<EntryResult>& results, std::size_t threads)
+{
+  results.clear();
+  m_VerifyCanceled = false;
+
+  if (m_ArchivePtr == nullptr) {
+    m_LastError = Error::ERROR_ARCHIVE_INVALID;
+    return false;
+  }
+  if (m_Sequential) {
+    m_LogCallback(LogLevel::Error, ALOGSTR"Sequential archives cannot be verified.");
+    m_LastError = Error::ERROR_ARCHIVE_INVALID;
+    return false;
+  }
+
+  std::vector<UInt32> indices;
+  for (std::size_t i = 0; i < m_FileList.size(); ++i) {
+    if (!m_FileList[i]->isDirectory()) {
+      indices.push_back(static_cast<UInt32>(i));
+    }
+  }
+
+  // Results by index, for the callbacks:
+  results.resize(indices.size());
+  std::vector<EntryResult*> entryResults(m_FileList.size(), nullptr);
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    results[i].Path = m_FileList[indices[i]]->getArchiveFilePath();
+    results[i].Status = EntryStatus::OTHER_ERROR;
+    entryResults[indices[i]] = &results[i];
+  }
+  if (indices.empty()) {
+    return true;
+  }
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  auto partitions = partitionEntries(indices, threads);
+
+  // Only archive files can be opened again by the other threads:
+  std::vector<CMyComPtr<IInArchive>> archives{ m_ArchivePtr };
+  if (partitions.size() > 1 && !m_ArchiveName.empty() && !m_OuterArchivePtr) {
+    while (archives.size() < partitions.size()) {
+      CMyComPtr<IInArchive> archive;
+      if (reopenArchive(archive) != S_OK) {
+        m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Cannot open {} again to verify it in parallel.", m_ArchiveName));
+        break;
+      }
+      archives.push_back(archive);
+    }
+  }
+  if (archives.size() < partitions.size()) {
+    partitions = partitionEntries(indices, archives.size());
+  }
+
+  CArchiveVerifyCallback::Password password{ {}, &m_Password, m_PasswordCallback };
+  std::vector<HRESULT> partitionResults(partitions.size(), S_OK);
+  auto verifyPartition = [&](std::size_t i) {
+    CMyComPtr<CArchiveVerifyCallback> callback(new CArchiveVerifyCallback(entryResults.data(), password, m_VerifyCanceled));
+    partitionResults[i] = archives[i]->Extract(partitions[i].data(), static_cast<UInt32>(partitions[i].size()), 1, callback);
+  };
+  {
+    std::vector<std::jthread> workers;
+    for (std::size_t i = 1; i < partitions.size(); ++i) {
+      workers.emplace_back(verifyPartition, i);
+    }
+    verifyPartition(0);
+  }
+
+  HRESULT result = S_OK;
+  for (HRESULT partitionResult : partitionResults) {
+    if (partitionResult != S_OK) {
+      result = partitionResult;
+      break;
+    }
+  }
+
+  const auto failed = std::count_if(results.begin(), results.end(), [](EntryResult const& entry) {
+    return entry.Status != EntryStatus::OK; });
+  m_LogCallback(LogLevel::Debug, fmt::format(ALOGSTR"Verified {} entries with {} thread(s), {} failed.",
+    results.size(), partitions.size(), failed));
+
+  switch (result) {
+    case S_OK: {
+      //nop
+    } break;
+    case E_ABORT: {
+      m_LastError = Error::ERROR_EXTRACT_CANCELLED;
+    } break;
+    case E_OUTOFMEMORY: {
+      m_LastError = Error::ERROR_OUT_OF_MEMORY;
+    } break;
+    default: {
+      m_LastError = Error::ERROR_LIBRARY_ERROR;
+    } break;
+  }
+
+  return result == S_OK;
+}
+
 void ArchiveImpl::cancel()
 {
-  m_ExtractCallback->SetCanceled(true);
+  m_ReadStop.request_stop();
+  m_VerifyCanceled = true;
+  if (m_ExtractCallback) {
+    m_ExtractCallback->SetCanceled(true);
+  }
 }
 
 
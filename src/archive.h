@@ -21,9 +21,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #ifndef ARCHIVE_H
 #define ARCHIVE_H
 
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <span>
+#include <stop_token>
 #include <string>
 
 #include "pathstr.h"
@@ -116,6 +120,185 @@ public: // Declarations
     EXTRACTION_END
   };
 
+  enum class OutputEngine {
+
+    // Write extracted files using plain blocking system calls.
+    SYNCHRONOUS,
+
+    // Batch writes and closes of extracted files through io_uring (Linux only). If the running
+    // kernel does not support it, SYNCHRONOUS is used instead.
+    IO_URING
+  };
+
+  enum class InputEngine {
+
+    // Read the archive through regular file reads.
+    STREAM,
+
+    // Read the archive at explicit offsets (pread) through an adaptive readahead buffer, which
+    // avoids a system call for each small read and each seek of the handlers.
+    POSITIONAL,
+
+    // Map the archive in memory (Linux and macOS only), so reads are plain copies and seeks
+    // are free. Archives that cannot be mapped are read with STREAM.
+    MEMORY_MAP
+  };
+
+  enum class DirectoryCreation {
+
+    // Create directories when the first entry that needs them is extracted.
+    ON_DEMAND,
+
+    // Create all the directories needed by the extraction before extracting any entry.
+    UPFRONT,
+
+    // Same as UPFRONT, but using multiple threads.
+    UPFRONT_PARALLEL
+  };
+
+  enum class OverwritePolicy {
+
+    // Remove existing files before extracting to them.
+    REPLACE,
+
+    // Overwrite existing files in place, without checking if they exist first. Other links to
+    // existing files see the new content.
+    TRUNCATE,
+
+    // Do not extract to files that already exist.
+    SKIP_EXISTING,
+
+    // Extract to temporary files that atomically replace the target files once their entry has
+    // been extracted successfully, so a failed extraction never leaves partial files behind.
+    ATOMIC_REPLACE,
+
+    // Assume the output directory does not contain any of the extracted files, skipping all the
+    // existence checks. Extracting to an existing file is an error.
+    FRESH_DIRECTORY
+  };
+
+  enum class Durability {
+
+    // Do not sync anything, the data reaches the disk whenever the system decides to.
+    NONE,
+
+    // Start writeback while files are written, and sync the whole filesystem once at the end
+    // of the extraction. On platforms other than Linux, this is the same as STRICT.
+    BATCHED,
+
+    // Sync each file before it is closed, and the output directories at the end of the
+    // extraction.
+    STRICT
+  };
+
+  enum class ZeroCopy {
+
+    // Extract all the entries through the decoder.
+    DISABLED,
+
+    // Copy the data of entries stored without compression (zip entries using the Store method,
+    // tar members) directly from the archive file to the output files (Linux only).
+    ENABLED,
+
+    // Same as ENABLED, but check the CRC of the data before copying it when the archive provides
+    // one. Entries that fail the check go through the decoder, which reports the error.
+    VERIFIED,
+
+    // Same as ENABLED, but clone the data that starts on a filesystem block boundary
+    // (FICLONERANGE) instead of copying it, when the archive and the output directory are on
+    // the same filesystem and it supports reflinks (e.g. btrfs or XFS). This is mostly useful
+    // for tar archives. Data that cannot be cloned is copied.
+    CLONE
+  };
+
+  enum class LinkPolicy {
+
+    // Extract symbolic and hard links as regular files, containing whatever data the archive
+    // stores for them (usually the target of symbolic links, and nothing for hard links).
+    AS_FILES,
+
+    // Create symbolic and hard links (Linux and macOS only), except symbolic links whose target
+    // is absolute or outside of the output directory, which are skipped with a warning.
+    CONFINED,
+
+    // Same as CONFINED, but links pointing outside of the output directory are errors.
+    CONFINED_STRICT,
+
+    // Create all the symbolic and hard links as stored in the archive.
+    UNRESTRICTED
+  };
+
+  enum class SpaceReservation {
+
+    // Do not look at the free space before extracting.
+    NONE,
+
+    // Check that the filesystem of the output directory has room for all the extracted files
+    // (rounded up to its block size) before extracting anything, and fail early otherwise.
+    CHECK,
+
+    // Same as CHECK, then create and allocate (fallocate) all the output files before
+    // extracting, so their blocks are contiguous and writing never waits on allocation
+    // (Linux only, otherwise the same as CHECK). Ignored with OverwritePolicy::ATOMIC_REPLACE.
+    PREALLOCATE,
+
+    // Same as PREALLOCATE, but using multiple threads.
+    PREALLOCATE_PARALLEL
+  };
+
+  enum class NestedArchives {
+    // Archives are opened as they are, e.g. a .tar.gz holds a single .tar file.
+    DISABLED,
+
+    // Compressed archives (.tar.gz, .tar.xz, etc.) are opened as the archive they compress.
+    COMPRESSED,
+
+    // Same as COMPRESSED, and archives holding a single archive (e.g. a zip in a zip) are
+    // opened as that archive.
+    ALL
+  };
+
+  enum class HashAlgorithm {
+    // Extracted files are not hashed.
+    NONE,
+
+    // XXH64, a fast non-cryptographic hash, the digest is in its canonical (big-endian)
+    // representation.
+    XXH64,
+
+    // SHA-256.
+    SHA256
+  };
+
+  enum class CrcVerification {
+
+    // Rely on the handlers, which check the CRC of the entries they decode. Entries copied
+    // directly from the archive (see ZeroCopy) are only checked with ZeroCopy::VERIFIED.
+    DEFAULT,
+
+    // Also compute the CRC32 of each entry while it is written and compare it with the CRC
+    // stored in the archive, including the entries copied directly from the archive (which are
+    // then read instead of being copied by the kernel, and not read beforehand by
+    // ZeroCopy::VERIFIED). Entries that do not match are reported as CRC errors.
+    WRITE_PATH,
+
+    // Trust the archive and skip the checks done by this library (ZeroCopy::VERIFIED is the
+    // same as ZeroCopy::ENABLED). The handlers still check the entries they decode.
+    TRUSTED
+  };
+
+  enum class EntryStatus {
+    OK,
+    CRC_ERROR,
+    DATA_ERROR,
+    WRONG_PASSWORD,
+    UNSUPPORTED_METHOD,
+    UNEXPECTED_END,
+
+    // Any other error reported by the handler (e.g. missing volume).
+    OTHER_ERROR
+  };
+
   static constexpr int MAX_PASSWORD_LENGTH = 256;
 
   /**
@@ -127,6 +310,20 @@ public: // Declarations
   using FileChangeCallback = std::function<void(FileChangeType, std::wstring const&)>;
   using ErrorCallback = std::function<void(PathStr const&)>;
 
+  /**
+   * Callback receiving the digest (in lowercase hexadecimal) of an extracted entry, given by
+   * its path in the archive, see setEntryHashing().
+   */
+  using DigestCallback = std::function<void(std::wstring const& path, std::string const& digest)>;
+
+  /**
+   * Callback reading the next bytes of a sequential archive (see openSequential()), blocking
+   * until some are available. read must be set to the number of bytes read, 0 at the end of
+   * the input. Returns false on error. Stop is requested by cancel() and close(), a reader
+   * waiting for data must then return false.
+   */
+  using ReadCallback = std::function<bool(std::byte* buffer, std::size_t size, std::size_t& read, std::stop_token stop)>;
+
   /**
    *
    */
@@ -140,9 +337,46 @@ public: // Declarations
     ERROR_INVALID_ARCHIVE_FORMAT,
     ERROR_LIBRARY_ERROR,
     ERROR_ARCHIVE_INVALID,
-    ERROR_OUT_OF_MEMORY
+    ERROR_OUT_OF_MEMORY,
+    ERROR_NOT_ENOUGH_SPACE
   };
 
+  /**
+   * Identity of an archive, see fingerprint(). Two archives with the same fingerprint are
+   * almost certainly identical, but only part of the content is hashed.
+   */
+  struct Fingerprint {
+    // Size of the archive file:
+    uint64_t Size = 0;
+
+    // Hash (XXH64) of blocks sampled from the start, the end, and evenly spaced in between:
+    uint64_t Content = 0;
+
+    // Hash (XXH64) of the paths, sizes and CRCs of the entries, or 0 if the archive was not
+    // open when the fingerprint was computed:
+    uint64_t Listing = 0;
+
+    bool operator==(Fingerprint const&) const = default;
+  };
+
+  /**
+   * Result of the extraction or verification of an entry, see setCrcVerification() and
+   * verify().
+   */
+  struct EntryResult {
+    // Path of the entry in the archive:
+    std::wstring Path;
+
+    EntryStatus Status = EntryStatus::OK;
+
+    // CRC stored in the archive and CRC of the extracted data, when both are known (see
+    // CrcVerification::WRITE_PATH):
+    std::optional<uint32_t> ExpectedCRC;
+    std::optional<uint32_t> ActualCRC;
+  };
+
+  using EntryResultCallback = std::function<void(EntryResult const&)>;
+
 public: // Special member functions:
 
   virtual ~Archive() {}
@@ -174,6 +408,203 @@ public:
    */
   virtual void setLogCallback(LogCallback logCallback) = 0;
 
+  /**
+   * @brief Set the engine used to write extracted files.
+   *
+   * The engine is used by subsequent calls to extract(). The default is OutputEngine::SYNCHRONOUS.
+   *
+   * @param engine The engine to use.
+   */
+  virtual void setOutputEngine(OutputEngine engine) = 0;
+
+  /**
+   * @brief Keep large extracted files out of the page cache.
+   *
+   * Files at least as large as the given threshold are flushed to disk progressively while they
+   * are written, and their pages are dropped from the cache behind the write position, so that
+   * extracting huge entries does not evict the cache of other processes. This only has an effect
+   * on Linux.
+   *
+   * @param threshold Minimum size (in bytes) of the files to extract without caching, or 0 to
+   *   disable this (default).
+   */
+  virtual void setCacheBypassThreshold(uint64_t threshold) = 0;
+
+  /**
+   * @brief Set when the directories needed by an extraction are created.
+   *
+   * The default is DirectoryCreation::ON_DEMAND. In all cases, each directory is only created
+   * (and checked) once per extraction.
+   *
+   * @param creation The directory creation mode.
+   */
+  virtual void setDirectoryCreation(DirectoryCreation creation) = 0;
+
+  /**
+   * @brief Set how existing files in the output directory are handled.
+   *
+   * The default is OverwritePolicy::REPLACE.
+   *
+   * @param policy The policy to use.
+   */
+  virtual void setOverwritePolicy(OverwritePolicy policy) = 0;
+
+  /**
+   * @brief Set the number of threads used to close extracted files in the background.
+   *
+   * Closing files can be slow on some filesystems (e.g. network or overlay filesystems). With
+   * background threads, the extraction moves on to the next entry immediately and extract() only
+   * returns once all the files have been closed. This has no effect with OutputEngine::IO_URING,
+   * which already closes files asynchronously.
+   *
+   * @param threads Number of threads, or 0 to close files synchronously (default).
+   */
+  virtual void setCloseThreads(std::size_t threads) = 0;
+
+  /**
+   * @brief Set how extracted files are made durable, i.e. safe from a power loss once extract()
+   *   returns.
+   *
+   * The default is Durability::NONE. The time spent syncing is logged at the end of each
+   * extraction (LogLevel::Debug).
+   *
+   * @param durability The durability level.
+   */
+  virtual void setDurability(Durability durability) = 0;
+
+  /**
+   * @brief Write small extracted files in one go.
+   *
+   * Entries up to the given size are kept in memory while they are extracted, and written
+   * together with their metadata when complete, which saves most of the per-write system
+   * calls. With OutputEngine::IO_URING or close threads (see setCloseThreads()), these writes
+   * are batched in the background with the closes.
+   *
+   * @param threshold Maximum size (in bytes) of the files to buffer, or 0 to disable this
+   *   (default). A typical value is 64 KiB.
+   */
+  virtual void setSmallFileThreshold(uint64_t threshold) = 0;
+
+  /**
+   * @brief Set how archives are read, this applies to the next call to open().
+   *
+   * The default is InputEngine::STREAM.
+   *
+   * @param engine The input engine.
+   */
+  virtual void setInputEngine(InputEngine engine) = 0;
+
+  /**
+   * @brief Set if stored entries are copied directly from the archive file.
+   *
+   * The default is ZeroCopy::DISABLED. This only applies to zip and tar archives, and is
+   * ignored on Windows.
+   *
+   * @param zeroCopy The zero-copy mode.
+   */
+  virtual void setZeroCopy(ZeroCopy zeroCopy) = 0;
+
+  /**
+   * @brief Leave holes in the extracted files instead of writing long runs of zeros.
+   *
+   * Extracted data is scanned for aligned zero blocks, runs of at least the given size are
+   * skipped instead of written, which saves both the writes and the disk space for disk
+   * images and other mostly-empty files. On Windows, the zeros are skipped but the files are
+   * not sparse. This does not apply to buffered small files (see setSmallFileThreshold()) or
+   * with OutputEngine::IO_URING.
+   *
+   * @param threshold Minimum size (in bytes) of the zero runs to skip, or 0 to disable this
+   *   (default). A typical value is 64 KiB.
+   */
+  virtual void setSparseThreshold(uint64_t threshold) = 0;
+
+  /**
+   * @brief Set how symbolic and hard links stored in the archive (tar, or 7z and zip
+   *   archives created on Unix systems) are extracted.
+   *
+   * The default is LinkPolicy::AS_FILES. Hard links are created to the file extracted for
+   * their target, which must be extracted before them (always the case with tar archives),
+   * so their data is never decoded. This is ignored on Windows.
+   *
+   * @param policy The link policy.
+   */
+  virtual void setLinkPolicy(LinkPolicy policy) = 0;
+
+  /**
+   * @brief Set if the space needed by the extraction is checked, or reserved, before
+   *   extracting.
+   *
+   * The default is SpaceReservation::NONE. When there is not enough space, extract() fails
+   * with Error::ERROR_NOT_ENOUGH_SPACE without writing anything.
+   *
+   * @param reservation The space reservation mode.
+   */
+  virtual void setSpaceReservation(SpaceReservation reservation) = 0;
+
+  /**
+   * @brief Set if archives wrapping a single archive are opened as the inner archive, this
+   *   applies to the next call to open().
+   *
+   * The inner archive is then listed and extracted as if it had been opened directly, without
+   * being extracted to a temporary file first: it is read from the outer archive (if possible)
+   * or decoded into memory. Large compressed tarballs that do not fit in memory are read
+   * sequentially, see openSequential() for the limitations. The default is
+   * NestedArchives::DISABLED.
+   *
+   * @param nested The nested archives mode.
+   */
+  virtual void setNestedArchives(NestedArchives nested) = 0;
+
+  /**
+   * @brief Compute the SHA-256 of the archive while it is read, this applies to the next
+   *   call to open().
+   *
+   * The data is hashed as the handler reads it, so the digest (see getArchiveDigest()) costs
+   * almost no additional reads once the archive has been extracted. For multi-volume archives,
+   * only the first volume is hashed. The default is false.
+   *
+   * @param hash true to hash the archive.
+   */
+  virtual void setArchiveHashing(bool hash) = 0;
+
+  /**
+   * @brief Retrieve the SHA-256 of the currently opened archive, see setArchiveHashing().
+   *
+   * The parts of the archive that were not read in order by open() and extract() are read
+   * by this call.
+   *
+   * @return the digest in lowercase hexadecimal, or an empty string if the archive was not
+   *   hashed or could not be read.
+   */
+  virtual std::string getArchiveDigest() = 0;
+
+  /**
+   * @brief Hash the content of the extracted files while it is written, this applies to the
+   *   next calls to extract().
+   *
+   * Each entry is hashed once, as it is decoded, whatever the number of output files, so the
+   * files do not need to be read again after the extraction. The callback is called from the
+   * extraction, once the entry has been extracted successfully. Entries written out of order
+   * by their handler and links are not hashed. Hashing disables the kernel copies of
+   * ZeroCopy, the data is read instead. The default is HashAlgorithm::NONE.
+   *
+   * @param algorithm The hash algorithm.
+   * @param callback Callback receiving the digests.
+   */
+  virtual void setEntryHashing(HashAlgorithm algorithm, DigestCallback callback) = 0;
+
+  /**
+   * @brief Set how the extracted data is checked, this applies to the next calls to extract().
+   *
+   * The callback is called from the extraction for each entry that could not be extracted
+   * correctly, whether the error was detected by the handler or by the CRC computed while
+   * writing the data. The default is CrcVerification::DEFAULT, without callback.
+   *
+   * @param verification The verification mode.
+   * @param callback Callback receiving the failed entries, may be empty.
+   */
+  virtual void setCrcVerification(CrcVerification verification, EntryResultCallback callback) = 0;
+
   /**
    * @brief Open the given archive.
    *
@@ -186,6 +617,66 @@ public:
    */
   virtual bool open(PathStr const &archivePath, PasswordCallback passwordCallback) = 0;
 
+  /**
+   * @brief Open an archive held in memory, e.g. a downloaded archive or one extracted from
+   *   another archive.
+   *
+   * The format is detected as for files. The data is not copied, it must remain valid until the
+   * archive is closed or another one is opened. Multi-volume archives cannot be opened this way.
+   *
+   * @param data Content of the archive.
+   * @param nameHint Name of the archive (can be empty), its extension is used as a hint for the
+   *   format, as for files.
+   * @param passwordCallback Callback to use to ask user for password, see the other overload.
+   *
+   * @return true if the archive was open properly, false otherwise.
+   */
+  virtual bool open(std::span<const std::byte> data, PathStr const& nameHint, PasswordCallback passwordCallback) = 0;
+
+  /**
+   * @brief Open an archive that can only be read once from start to end, e.g. a pipe or a
+   *   download in progress (see CreateGrowingFileReader()).
+   *
+   * Only formats that can be decoded sequentially are supported (tar, compressed tarballs,
+   * zip, etc.). The entries are not known before extraction, so getFileList() is empty and
+   * extract() extracts all the entries to their path in the archive, entries whose path
+   * leaves the output directory are skipped. The archive can only be extracted once.
+   *
+   * @param reader Callback reading the archive, must remain valid until the archive is closed.
+   * @param nameHint Name of the archive (can be empty), its extension is used as a hint for the
+   *   format and to detect compressed tarballs (.tar.gz, .tgz, etc.).
+   * @param passwordCallback Callback to use to ask user for password, see open().
+   *
+   * @return true if the archive was open properly, false otherwise.
+   */
+  virtual bool openSequential(ReadCallback reader, PathStr const& nameHint, PasswordCallback passwordCallback) = 0;
+
+  /**
+   * @brief Compute the fingerprint of the given archive file, without opening it.
+   *
+   * Only a few blocks of the file are read (about 1 MiB), so this is cheap enough to key
+   * caches or detect duplicates before deciding to open an archive. The Listing field is 0.
+   *
+   * @param archivePath Path to the archive.
+   * @param fingerprint The fingerprint.
+   *
+   * @return true if the fingerprint was computed, false otherwise.
+   */
+  virtual bool fingerprint(PathStr const& archivePath, Fingerprint& fingerprint) const = 0;
+
+  /**
+   * @brief Compute the fingerprint of the currently opened archive (file or in memory).
+   *
+   * The Size and Content fields are the same as the ones computed before opening the archive,
+   * the Listing field is computed from the list of files, so no other data is read for it.
+   * Archives open with openSequential() have no fingerprint.
+   *
+   * @param fingerprint The fingerprint.
+   *
+   * @return true if the fingerprint was computed, false otherwise.
+   */
+  virtual bool fingerprint(Fingerprint& fingerprint) = 0;
+
   /**
    * @brief Close the currently opened archive.
    */
@@ -204,7 +695,7 @@ public:
    * one or two callbacks are also provided.
    *
    * @param outputDirectory Path to the directory where the archive should be extracted. If not empty,
-   *   conflicting files will be replaced by the extracted ones.
+   *   conflicting files are handled according to the overwrite policy (see setOverwritePolicy()).
    * @param progressCallback Function called to notify extraction progress.
    * @param fileChangeCallback Function called when the file currently being extracted changes.
    * @param errorCallback Function called when an error occurs.
@@ -217,7 +708,26 @@ public:
     ErrorCallback errorCallback) = 0;
 
   /**
-   * @brief Cancel the current extraction process.
+   * @brief Check the integrity of the entries of the currently opened archive, without writing
+   *   anything.
+   *
+   * The entries are decoded by the handler in test mode, which checks their data (and CRC)
+   * without any output stream. The entries are split between the given number of threads, each
+   * with its own handler, keeping the entries of a solid block together so no block is decoded
+   * twice. Only archive files are verified in parallel, archives held in memory and nested
+   * archives are verified on the calling thread. Sequential archives cannot be verified.
+   *
+   * @param results Receives the result of each file (directories excluded), in the order of
+   *   getFileList(). Entries the handler did not get to are reported as EntryStatus::OTHER_ERROR.
+   * @param threads Maximum number of threads, or 0 for one per core.
+   *
+   * @return true if the archive was verified (some entries may still have failed), false
+   *   otherwise.
+   */
+  virtual bool verify(std::vector<EntryResult>& results, std::size_t threads) = 0;
+
+  /**
+   * @brief Cancel the current extraction (or verification) process.
    */
   virtual void cancel() = 0;
 
@@ -256,5 +766,19 @@ public:
  */
 DLLEXPORT std::unique_ptr<Archive> CreateArchive();
 
+/**
+ * @brief Create a reader for Archive::openSequential() following a file that is still being
+ *   written, e.g. a download in progress.
+ *
+ * At the end of the data written so far, the reader waits for more data until complete()
+ * returns true, or until the archive is canceled or closed.
+ *
+ * @param path Path to the file.
+ * @param complete Function returning true once the file is complete.
+ *
+ * @return the reader, or an empty callback if the file could not be opened.
+ */
+DLLEXPORT Archive::ReadCallback CreateGrowingFileReader(PathStr const& path, std::function<bool()> complete);
+
 
 #endif // ARCHIVE_H
@@ -0,0 +1,61 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "bufferpool.h"
+
+namespace IO {
+
+  BufferPool::Buffer BufferPool::Acquire()
+  {
+    {
+      std::scoped_lock lock(m_Mutex);
+      if (!m_Free.empty()) {
+        Buffer buffer = std::move(m_Free.back());
+        m_Free.pop_back();
+        return buffer;
+      }
+    }
+    Buffer buffer;
+    buffer.reserve(m_Capacity);
+    return buffer;
+  }
+
+  void BufferPool::Release(Buffer&& buffer)
+  {
+    // Buffers that grew far beyond the usual capacity are not worth keeping:
+    if (buffer.capacity() == 0 || buffer.capacity() > 2 * m_Capacity) {
+      return;
+    }
+    buffer.clear();
+    std::scoped_lock lock(m_Mutex);
+    if (m_Free.size() < m_MaxFree) {
+      m_Free.push_back(std::move(buffer));
+    }
+  }
+
+  std::shared_ptr<const BufferPool::Buffer> BufferPool::Share(Buffer&& buffer)
+  {
+    return std::shared_ptr<const Buffer>(new Buffer(std::move(buffer)), [this](const Buffer* shared) {
+      Release(std::move(*const_cast<Buffer*>(shared)));
+      delete shared;
+    });
+  }
+
+}
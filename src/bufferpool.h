@@ -0,0 +1,80 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ARCHIVE_BUFFERPOOL_H
+#define ARCHIVE_BUFFERPOOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace IO {
+
+  /**
+   * Thread-safe pool of reusable byte buffers, used to hold whole entries in memory
+   * without allocating for each of them.
+   */
+  class BufferPool {
+  public:
+
+    using Buffer = std::vector<unsigned char>;
+
+    /**
+     * @param capacity Capacity reserved for new buffers.
+     * @param maxFree Maximum number of buffers kept around for reuse.
+     */
+    BufferPool(std::size_t capacity, std::size_t maxFree) noexcept :
+      m_Capacity{ capacity }, m_MaxFree{ maxFree } { }
+
+    BufferPool(BufferPool const&) = delete;
+    BufferPool& operator=(BufferPool const&) = delete;
+
+    /**
+     * @return an empty buffer, reused if possible.
+     */
+    Buffer Acquire();
+
+    /**
+     * @brief Give a buffer back to the pool.
+     */
+    void Release(Buffer&& buffer);
+
+    /**
+     * @brief Wrap the given buffer in a shared pointer that gives it back to this pool
+     *   once the last reference is gone.
+     *
+     * The pool must outlive the returned pointer.
+     */
+    std::shared_ptr<const Buffer> Share(Buffer&& buffer);
+
+  private:
+
+    std::size_t m_Capacity;
+    std::size_t m_MaxFree;
+
+    std::mutex m_Mutex;
+    std::vector<Buffer> m_Free;
+
+  };
+
+}
+
+#endif
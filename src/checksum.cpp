@@ -0,0 +1,312 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "checksum.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace Checksum {
+
+  namespace {
+
+    constexpr UInt32 kPolynomial = 0xEDB88320;
+
+    // Slicing-by-16 tables: table k gives the CRC of a byte followed by k zero bytes, so
+    // 16 bytes are processed with independent lookups instead of a dependency chain:
+    constexpr std::size_t kSlices = 16;
+
+    constexpr std::array<std::array<UInt32, 256>, kSlices> makeTables() {
+      std::array<std::array<UInt32, 256>, kSlices> tables{};
+      for (UInt32 i = 0; i < 256; ++i) {
+        UInt32 r = i;
+        for (int j = 0; j < 8; ++j) {
+          r = (r >> 1) ^ (kPolynomial & (0 - (r & 1)));
+        }
+        tables[0][i] = r;
+      }
+      for (std::size_t k = 1; k < kSlices; ++k) {
+        for (UInt32 i = 0; i < 256; ++i) {
+          tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+        }
+      }
+      return tables;
+    }
+
+    constexpr auto kTables = makeTables();
+
+    constexpr std::array<UInt32, 64> kSha256Constants = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    constexpr UInt32 rotr(UInt32 x, int n) {
+      return (x >> n) | (x << (32 - n));
+    }
+
+    constexpr UInt64 kPrime64_1 = 0x9E3779B185EBCA87ULL;
+    constexpr UInt64 kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr UInt64 kPrime64_3 = 0x165667B19E3779F9ULL;
+    constexpr UInt64 kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr UInt64 kPrime64_5 = 0x27D4EB2F165667C5ULL;
+
+    constexpr UInt64 rotl64(UInt64 x, int n) {
+      return (x << n) | (x >> (64 - n));
+    }
+
+    // Little-endian loads, whatever the platform:
+    inline UInt64 read64(const unsigned char* p) {
+      UInt64 v = 0;
+      for (int i = 7; i >= 0; --i) {
+        v = (v << 8) | p[i];
+      }
+      return v;
+    }
+
+    inline UInt32 read32(const unsigned char* p) {
+      return (UInt32)p[0] | (UInt32)p[1] << 8 | (UInt32)p[2] << 16 | (UInt32)p[3] << 24;
+    }
+
+    inline UInt64 xxh64Round(UInt64 acc, UInt64 input) {
+      acc += input * kPrime64_2;
+      acc = rotl64(acc, 31);
+      return acc * kPrime64_1;
+    }
+
+    inline UInt64 xxh64Merge(UInt64 acc, UInt64 value) {
+      acc ^= xxh64Round(0, value);
+      return acc * kPrime64_1 + kPrime64_4;
+    }
+
+  }
+
+  UInt32 crc32(UInt32 crc, const void* data, std::size_t size) noexcept {
+    auto bytes = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    for (; size >= kSlices; bytes += kSlices, size -= kSlices) {
+      const UInt32 first = crc ^ read32(bytes);
+      crc = kTables[15][first & 0xFF] ^ kTables[14][(first >> 8) & 0xFF]
+        ^ kTables[13][(first >> 16) & 0xFF] ^ kTables[12][first >> 24];
+      for (std::size_t i = 4; i < kSlices; ++i) {
+        crc ^= kTables[kSlices - 1 - i][bytes[i]];
+      }
+    }
+    for (; size > 0; ++bytes, --size) {
+      crc = kTables[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+  UInt64 xxh64(const void* data, std::size_t size, UInt64 seed) noexcept {
+    Xxh64 hash(seed);
+    hash.Update(data, size);
+    return hash.Final();
+  }
+
+  Xxh64::Xxh64(UInt64 seed) noexcept
+    : m_Seed(seed)
+    , m_Lanes{ seed + kPrime64_1 + kPrime64_2, seed + kPrime64_2, seed, seed - kPrime64_1 }
+    , m_Block{}
+    , m_BlockSize(0)
+    , m_Length(0) { }
+
+  void Xxh64::Update(const void* data, std::size_t size) noexcept {
+    auto bytes = static_cast<const unsigned char*>(data);
+    m_Length += size;
+
+    if (m_BlockSize > 0) {
+      const std::size_t count = std::min(size, m_Block.size() - m_BlockSize);
+      std::memcpy(m_Block.data() + m_BlockSize, bytes, count);
+      m_BlockSize += count;
+      bytes += count;
+      size -= count;
+      if (m_BlockSize < m_Block.size()) {
+        return;
+      }
+      consume(m_Block.data());
+      m_BlockSize = 0;
+    }
+
+    // Full stripes are hashed in place:
+    for (; size >= m_Block.size(); bytes += m_Block.size(), size -= m_Block.size()) {
+      consume(bytes);
+    }
+
+    std::memcpy(m_Block.data(), bytes, size);
+    m_BlockSize = size;
+  }
+
+  UInt64 Xxh64::Final() const noexcept {
+    UInt64 h;
+    if (m_Length >= m_Block.size()) {
+      h = rotl64(m_Lanes[0], 1) + rotl64(m_Lanes[1], 7) + rotl64(m_Lanes[2], 12) + rotl64(m_Lanes[3], 18);
+      for (UInt64 lane : m_Lanes) {
+        h = xxh64Merge(h, lane);
+      }
+    }
+    else {
+      h = m_Seed + kPrime64_5;
+    }
+    h += m_Length;
+
+    const unsigned char* p = m_Block.data();
+    const unsigned char* const end = p + m_BlockSize;
+    for (; end - p >= 8; p += 8) {
+      h ^= xxh64Round(0, read64(p));
+      h = rotl64(h, 27) * kPrime64_1 + kPrime64_4;
+    }
+    if (end - p >= 4) {
+      h ^= read32(p) * kPrime64_1;
+      h = rotl64(h, 23) * kPrime64_2 + kPrime64_3;
+      p += 4;
+    }
+    for (; p < end; ++p) {
+      h ^= *p * kPrime64_5;
+      h = rotl64(h, 11) * kPrime64_1;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime64_2;
+    h ^= h >> 29;
+    h *= kPrime64_3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  void Xxh64::consume(const unsigned char* stripe) noexcept {
+    m_Lanes[0] = xxh64Round(m_Lanes[0], read64(stripe));
+    m_Lanes[1] = xxh64Round(m_Lanes[1], read64(stripe + 8));
+    m_Lanes[2] = xxh64Round(m_Lanes[2], read64(stripe + 16));
+    m_Lanes[3] = xxh64Round(m_Lanes[3], read64(stripe + 24));
+  }
+
+  Sha256::Sha256() noexcept
+    : m_State{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 }
+    , m_Block{}
+    , m_BlockSize(0)
+    , m_Length(0) { }
+
+  void Sha256::Update(const void* data, std::size_t size) noexcept {
+    auto bytes = static_cast<const unsigned char*>(data);
+    m_Length += size;
+
+    if (m_BlockSize > 0) {
+      const std::size_t count = std::min(size, m_Block.size() - m_BlockSize);
+      std::memcpy(m_Block.data() + m_BlockSize, bytes, count);
+      m_BlockSize += count;
+      bytes += count;
+      size -= count;
+      if (m_BlockSize < m_Block.size()) {
+        return;
+      }
+      transform(m_Block.data());
+      m_BlockSize = 0;
+    }
+
+    // Full blocks are hashed in place:
+    for (; size >= m_Block.size(); bytes += m_Block.size(), size -= m_Block.size()) {
+      transform(bytes);
+    }
+
+    std::memcpy(m_Block.data(), bytes, size);
+    m_BlockSize = size;
+  }
+
+  Sha256::Digest Sha256::Final() noexcept {
+    const UInt64 bits = m_Length * 8;
+
+    // Padding: a 1 bit, zeros, and the length in bits (big-endian) at the end of a block:
+    m_Block[m_BlockSize++] = 0x80;
+    if (m_BlockSize > m_Block.size() - 8) {
+      std::fill(m_Block.begin() + m_BlockSize, m_Block.end(), 0);
+      transform(m_Block.data());
+      m_BlockSize = 0;
+    }
+    std::fill(m_Block.begin() + m_BlockSize, m_Block.end() - 8, 0);
+    for (int i = 0; i < 8; ++i) {
+      m_Block[63 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    }
+    transform(m_Block.data());
+
+    Digest digest;
+    for (std::size_t i = 0; i < m_State.size(); ++i) {
+      digest[4 * i] = static_cast<unsigned char>(m_State[i] >> 24);
+      digest[4 * i + 1] = static_cast<unsigned char>(m_State[i] >> 16);
+      digest[4 * i + 2] = static_cast<unsigned char>(m_State[i] >> 8);
+      digest[4 * i + 3] = static_cast<unsigned char>(m_State[i]);
+    }
+    return digest;
+  }
+
+  void Sha256::transform(const unsigned char* block) noexcept {
+    UInt32 w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = (UInt32)block[4 * i] << 24 | (UInt32)block[4 * i + 1] << 16
+        | (UInt32)block[4 * i + 2] << 8 | (UInt32)block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+      const UInt32 s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const UInt32 s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    UInt32 a = m_State[0], b = m_State[1], c = m_State[2], d = m_State[3];
+    UInt32 e = m_State[4], f = m_State[5], g = m_State[6], h = m_State[7];
+    for (int i = 0; i < 64; ++i) {
+      const UInt32 t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kSha256Constants[i] + w[i];
+      const UInt32 t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    m_State[0] += a;
+    m_State[1] += b;
+    m_State[2] += c;
+    m_State[3] += d;
+    m_State[4] += e;
+    m_State[5] += f;
+    m_State[6] += g;
+    m_State[7] += h;
+  }
+
+  std::string to_hex(const unsigned char* data, std::size_t size) {
+    static constexpr char kDigits[] = "0123456789abcdef";
+    std::string hex(2 * size, '0');
+    for (std::size_t i = 0; i < size; ++i) {
+      hex[2 * i] = kDigits[data[i] >> 4];
+      hex[2 * i + 1] = kDigits[data[i] & 0xF];
+    }
+    return hex;
+  }
+
+}
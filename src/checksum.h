@@ -0,0 +1,104 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ARCHIVE_CHECKSUM_H
+#define ARCHIVE_CHECKSUM_H
+
+#include <array>
+#include <cstddef>
+#include <string>
+
+#include "7zip/Archive/IArchive.h"
+
+namespace Checksum {
+
+  /**
+   * @brief Update a CRC32 (as used by zip and 7z) with the given data.
+   *
+   * @param crc CRC of the previous data, 0 for the first call.
+   *
+   * @return the CRC of the previous data followed by the given data.
+   */
+  UInt32 crc32(UInt32 crc, const void* data, std::size_t size) noexcept;
+
+  /**
+   * @brief Compute the XXH64 hash of the given data, a fast non-cryptographic hash.
+   *
+   * @param seed Seed of the hash, e.g. the hash of the previous data to chain hashes.
+   */
+  UInt64 xxh64(const void* data, std::size_t size, UInt64 seed = 0) noexcept;
+
+  /**
+   * @brief Incremental XXH64, gives the same result as xxh64() on the concatenated data.
+   */
+  class Xxh64 {
+  public:
+    explicit Xxh64(UInt64 seed = 0) noexcept;
+
+    void Update(const void* data, std::size_t size) noexcept;
+
+    /**
+     * @return the hash of all the data so far, the hash can still be updated afterwards.
+     */
+    UInt64 Final() const noexcept;
+
+  private:
+    void consume(const unsigned char* stripe) noexcept;
+
+    UInt64 m_Seed;
+    std::array<UInt64, 4> m_Lanes;
+    std::array<unsigned char, 32> m_Block;
+    std::size_t m_BlockSize;
+    UInt64 m_Length;
+  };
+
+  /**
+   * @brief Incremental SHA-256.
+   */
+  class Sha256 {
+  public:
+    using Digest = std::array<unsigned char, 32>;
+
+    Sha256() noexcept;
+
+    void Update(const void* data, std::size_t size) noexcept;
+
+    /**
+     * @return the digest of all the data, the hash cannot be updated afterwards.
+     */
+    Digest Final() noexcept;
+
+  private:
+    void transform(const unsigned char* block) noexcept;
+
+    std::array<UInt32, 8> m_State;
+    std::array<unsigned char, 64> m_Block;
+    std::size_t m_BlockSize;
+    UInt64 m_Length;
+  };
+
+  /**
+   * @return the given bytes in lowercase hexadecimal.
+   */
+  std::string to_hex(const unsigned char* data, std::size_t size);
+
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "closequeue.h"
+
+#include <algorithm>
+
+namespace IO {
+
+  CloseQueue::CloseQueue(std::size_t threads, std::size_t capacity) :
+    m_Capacity(std::max<std::size_t>(capacity, 1)), m_Active(0)
+  {
+    threads = std::max<std::size_t>(threads, 1);
+    m_Threads.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i) {
+      m_Threads.emplace_back([this](std::stop_token token) { run(token); });
+    }
+  }
+
+  CloseQueue::~CloseQueue()
+  {
+    Drain();
+  }
+
+  void CloseQueue::Close(FileOut&& file, Finalizer finalizer)
+  {
+    {
+      std::unique_lock lock(m_Mutex);
+      m_NotFull.wait(lock, [this] { return m_Jobs.size() < m_Capacity; });
+      m_Jobs.push_back({ std::move(file), std::move(finalizer) });
+    }
+    m_NotEmpty.notify_one();
+  }
+
+  std::vector<CloseQueue::Failure> CloseQueue::Drain()
+  {
+    std::vector<Failure> failures;
+    std::unique_lock lock(m_Mutex);
+    m_Idle.wait(lock, [this] { return m_Jobs.empty() && m_Active == 0; });
+    failures.swap(m_Failures);
+    return failures;
+  }
+
+  void CloseQueue::run(std::stop_token token)
+  {
+    std::unique_lock lock(m_Mutex);
+    while (m_NotEmpty.wait(lock, token, [this] { return !m_Jobs.empty(); })) {
+      Job job = std::move(m_Jobs.front());
+      m_Jobs.pop_front();
+      ++m_Active;
+      lock.unlock();
+      m_NotFull.notify_one();
+
+      // Keep the path since a finalizer may detach the descriptor:
+      const std::filesystem::path path = job.File.Path();
+      std::error_code error;
+      if (job.Finalize && !job.Finalize(job.File)) {
+        error = last_error();
+      }
+      if (!job.File.Close() && !error) {
+        error = last_error();
+      }
+
+      lock.lock();
+      if (error) {
+        m_Failures.push_back({ path, error });
+      }
+      if (--m_Active == 0 && m_Jobs.empty()) {
+        m_Idle.notify_all();
+      }
+    }
+  }
+
+}
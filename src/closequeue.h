@@ -0,0 +1,115 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ARCHIVE_CLOSEQUEUE_H
+#define ARCHIVE_CLOSEQUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "fileio.h"
+
+namespace IO {
+
+  /**
+   * Pool of background threads closing files.
+   *
+   * Closing a file can be slow on some filesystems (network, overlay, ...), so this lets the
+   * caller move on while the files are closed in the background. The queue is bounded: Close()
+   * blocks when too many files are waiting to be closed.
+   *
+   * Errors are not reported by Close() but collected and returned by Drain().
+   */
+  class CloseQueue {
+  public:
+
+    // Finalizers return false on failure, with the error in errno (or GetLastError()).
+    using Finalizer = std::function<bool(FileOut&)>;
+
+    struct Failure {
+      std::filesystem::path Path;
+      std::error_code Error;
+    };
+
+    /**
+     * @param threads Number of closing threads, at least one is started.
+     * @param capacity Maximum number of files waiting to be closed.
+     */
+    CloseQueue(std::size_t threads, std::size_t capacity);
+
+    /**
+     * Waits for all the queued files to be closed.
+     */
+    ~CloseQueue();
+
+    CloseQueue(CloseQueue const&) = delete;
+    CloseQueue& operator=(CloseQueue const&) = delete;
+
+    /**
+     * @brief Take ownership of the given file and close it in the background.
+     *
+     * @param file The file to close.
+     * @param finalizer Function called on the file right before it is closed. Failures of the
+     *   finalizer are reported by Drain().
+     */
+    void Close(FileOut&& file, Finalizer finalizer = {});
+
+    /**
+     * @brief Wait for all the queued files to be closed.
+     *
+     * @return the list of failures since the last call to Drain().
+     */
+    std::vector<Failure> Drain();
+
+  private:
+
+    struct Job {
+      FileOut File;
+      Finalizer Finalize;
+    };
+
+    void run(std::stop_token token);
+
+    std::size_t m_Capacity;
+
+    std::mutex m_Mutex;
+    std::condition_variable_any m_NotEmpty;
+    std::condition_variable m_NotFull;
+    std::condition_variable m_Idle;
+
+    std::deque<Job> m_Jobs;
+    std::size_t m_Active;
+    std::vector<Failure> m_Failures;
+
+    // Last member, so the threads are stopped before the rest is destroyed:
+    std::vector<std::jthread> m_Threads;
+
+  };
+
+}
+
+#endif
@@ -26,9 +26,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "archive.h"
 #include "propertyvariant.h"
 
+#include <algorithm>
 #include <filesystem>
 #include <string>
 #include <stdexcept>
+#include <thread>
 #include <iostream> // UNUSED
 
 PathStr operationResultToString(Int32 operationResult)
@@ -72,6 +74,75 @@ PathStr operationResultToString(Int32 operationResult)
   }
 }
 
+Archive::EntryStatus operationResultToStatus(Int32 operationResult)
+{
+  namespace R = NArchive::NExtract::NOperationResult;
+
+  switch(operationResult)
+  {
+    case R::kOK:
+      return Archive::EntryStatus::OK;
+
+    case R::kUnsupportedMethod:
+      return Archive::EntryStatus::UNSUPPORTED_METHOD;
+
+    case R::kDataError:
+      return Archive::EntryStatus::DATA_ERROR;
+
+    case R::kCRCError:
+      return Archive::EntryStatus::CRC_ERROR;
+
+    case R::kUnexpectedEnd:
+      return Archive::EntryStatus::UNEXPECTED_END;
+
+    case R::kWrongPassword:
+      return Archive::EntryStatus::WRONG_PASSWORD;
+
+    default:
+      return Archive::EntryStatus::OTHER_ERROR;
+  }
+}
+
+#ifndef _WIN32
+namespace {
+
+// Collects the data of an entry, for symbolic links whose target is stored as their data:
+class StringOutStream : public ISequentialOutStream
+{
+
+  UNKNOWN_1_INTERFACE(ISequentialOutStream);
+
+public:
+
+  // Data beyond maxSize + 1 bytes is dropped, so the caller can detect oversized entries:
+  StringOutStream(std::string& data, std::size_t maxSize) : m_Data(data), m_MaxSize(maxSize) { }
+
+  STDMETHOD(Write)(const void* data, UInt32 size, UInt32* processedSize)
+  {
+    if (m_Data.size() <= m_MaxSize) {
+      m_Data.append(static_cast<const char*>(data), std::min<std::size_t>(size, m_MaxSize + 1 - m_Data.size()));
+    }
+    if (processedSize != nullptr) {
+      *processedSize = size;
+    }
+    return S_OK;
+  }
+
+private:
+  std::string& m_Data;
+  std::size_t m_MaxSize;
+};
+
+// Key of an entry in the extracted files, so hard link targets match regardless of how
+// the handler normalizes paths:
+PathStr entryKey(std::wstring const& archivePath)
+{
+  return std::filesystem::path(archivePath).lexically_normal().native();
+}
+
+}
+#endif
+
 CArchiveExtractCallback::CArchiveExtractCallback(
   Archive::ProgressCallback progressCallback,
   Archive::FileChangeCallback fileChangeCallback,
@@ -83,7 +154,8 @@ CArchiveExtractCallback::CArchiveExtractCallback(
   FileData* const *fileData,
   std::size_t nbFiles,
   UInt64 totalFileSize,
-  std::wstring *password)
+  std::wstring *password,
+  ExtractSettings const& settings)
   : m_ArchiveHandler(archiveHandler)
   , m_Total(0)
   , m_DirectoryPath()
@@ -94,6 +166,8 @@ CArchiveExtractCallback::CArchiveExtractCallback(
   , m_OutputFileStream{}
   , m_OutFileStreamCom{}
   , m_FileData(fileData)
+  , m_Index(0)
+  , m_Sequential(false)
   , m_NbFiles(nbFiles)
   , m_TotalFileSize(totalFileSize)
   , m_ExtractedFileSize(0)
@@ -103,9 +177,54 @@ CArchiveExtractCallback::CArchiveExtractCallback(
   , m_ErrorCallback(errorCallback)
   , m_PasswordCallback(passwordCallback)
   , m_LogCallback(logCallback)
+  , m_DigestCallback(settings.DigestCallback)
+  , m_EntryResultCallback(settings.EntryResultCallback)
   , m_Password(password)
 {
   m_DirectoryPath = IO::make_path(directoryPath);
+  m_CacheBypassThreshold = settings.CacheBypassThreshold;
+  m_SparseThreshold = settings.SparseThreshold;
+  m_EntryHashing = settings.EntryHashing;
+  m_CrcVerification = settings.CrcVerification;
+#ifndef _WIN32
+  m_LinkPolicy = settings.LinkPolicy;
+  m_Umask = IO::current_umask();
+  if (m_LinkPolicy == Archive::LinkPolicy::CONFINED || m_LinkPolicy == Archive::LinkPolicy::CONFINED_STRICT) {
+    std::error_code ec;
+    m_CanonicalDirectoryPath = std::filesystem::weakly_canonical(m_DirectoryPath, ec);
+    if (ec) {
+      m_CanonicalDirectoryPath = m_DirectoryPath.lexically_normal();
+    }
+  }
+#endif
+  m_OverwritePolicy = settings.OverwritePolicy;
+  m_Durability = settings.Durability;
+  m_SmallFileThreshold = settings.SmallFileThreshold;
+  if (m_SmallFileThreshold > 0) {
+    m_BufferPool = std::make_unique<IO::BufferPool>(m_SmallFileThreshold, kMaxPooledBuffers);
+  }
+
+#ifndef __linux__
+  if (m_Durability == Archive::Durability::BATCHED) {
+    m_LogCallback(Archive::LogLevel::Debug, ALOGSTR"batched durability is not available, syncing each file instead.");
+    m_Durability = Archive::Durability::STRICT;
+  }
+#endif
+
+  if (settings.Engine == Archive::OutputEngine::IO_URING) {
+    if (IO::UringQueue::IsSupported()) {
+      m_Uring = std::make_unique<IO::UringQueue>();
+    }
+    if (!m_Uring || !m_Uring->IsOpen()) {
+      m_LogCallback(Archive::LogLevel::Debug, ALOGSTR"io_uring is not available, falling back to synchronous output.");
+      m_Uring.reset();
+    }
+  }
+
+  if (!m_Uring && settings.CloseThreads > 0) {
+    m_CloseQueue = std::make_unique<IO::CloseQueue>(
+      settings.CloseThreads, settings.CloseThreads * kPendingClosesPerThread);
+  }
 }
 
 CArchiveExtractCallback::~CArchiveExtractCallback()
@@ -116,6 +235,7 @@ CArchiveExtractCallback::~CArchiveExtractCallback()
   m_LogCallback(Archive::LogLevel::Debug, m_Timers.SetOperationResult.Close.toString(L"SetOperationResult.Close"));
   m_LogCallback(Archive::LogLevel::Debug, m_Timers.SetOperationResult.Release.toString(L"SetOperationResult.Release"));
   m_LogCallback(Archive::LogLevel::Debug, m_Timers.SetOperationResult.SetFileAttributesW.toString(L"SetOperationResult.SetFileAttributesW"));
+  m_LogCallback(Archive::LogLevel::Debug, m_Timers.DirectoryMetadata.toString(L"DirectoryMetadata"));
 #endif
 }
 
@@ -166,6 +286,11 @@ STDMETHODIMP CArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStre
 
   *outStream = nullptr;
   m_OutFileStreamCom.Release();
+  m_Index = index;
+#ifndef _WIN32
+  m_LinkTargetStream.Release();
+  m_LinkNames.clear();
+#endif
 
   m_FullProcessedPaths.clear();
   m_Extracting = false;
@@ -174,8 +299,18 @@ STDMETHODIMP CArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStre
     return S_OK;
   }
 
-  std::vector<std::wstring> filenames = m_FileData[index]->getOutputFilePaths();
-  m_FileData[index]->clearOutputFilePaths();
+  std::vector<std::wstring> filenames;
+  if (m_Sequential) {
+    m_EntryPath.clear();
+    std::wstring filename;
+    if (sequentialOutputPath(index, filename)) {
+      filenames.push_back(filename);
+    }
+  }
+  else {
+    filenames = m_FileData[index]->getOutputFilePaths();
+    m_FileData[index]->clearOutputFilePaths();
+  }
   if (filenames.empty()) {
     return S_OK;
   }
@@ -192,40 +327,71 @@ STDMETHODIMP CArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStre
     //and accessed times (kpidATime, kpidCTime) as well?
     m_ProcessedFileInfo.MTimeDefined = getOptionalProperty(index, kpidMTime, &m_ProcessedFileInfo.MTime);
 
-    if (m_ProcessedFileInfo.isDir) {
+#ifndef _WIN32
+    bool isLink = false;
+    if (m_LinkPolicy != Archive::LinkPolicy::AS_FILES && !m_ProcessedFileInfo.isDir) {
+      RINOK(extractLink(index, filenames, outStream, isLink));
+    }
+#else
+    const bool isLink = false;
+#endif
+
+    if (isLink) {
+      // Handled by extractLink(), nothing is written by the handler.
+    } else if (m_ProcessedFileInfo.isDir) {
       for (auto const& filename : filenames) {
         auto fullpath = m_DirectoryPath / fs::path(filename).make_preferred();
         std::error_code ec;
-        std::filesystem::create_directories(fullpath, ec);
-        if (ec) {
+        if (!createDirectories(fullpath, ec)) {
           reportError(ALOGSTR"cannot created directory '{}': {}", fullpath, ec);
           return E_ABORT;
         }
         m_FullProcessedPaths.push_back(fullpath);
       }
     } else {
+#ifndef _WIN32
+      // Output files are created relative to their directory:
+      std::vector<std::shared_ptr<IO::Directory>> directories;
+      std::vector<fs::path> preallocated;
+#endif
       for (auto const& filename : filenames) {
         auto fullProcessedPath = m_DirectoryPath / fs::path(filename).make_preferred();
         //If the filename contains a '/' we want to make the directory
         auto directoryPath = fullProcessedPath.parent_path();
-        if (!fs::exists(directoryPath)) {
-          //Make the containing directory
-          std::error_code ec;
-          std::filesystem::create_directories(directoryPath, ec);
-          if (ec) {
-            reportError(ALOGSTR"cannot created directory '{}': {}", directoryPath, ec);
-            return E_ABORT;
-          }
-          //m_DirectoryPath.mkpath(filename.left(slashPos));
+        std::error_code ec;
+#ifndef _WIN32
+        auto directory = openDirectory(directoryPath, ec);
+        if (!directory) {
+          reportError(ALOGSTR"cannot created directory '{}': {}", directoryPath, ec);
+          return E_ABORT;
+        }
+        // Files allocated upfront are written in place:
+        if (m_Preallocated.erase(fullProcessedPath.native()) > 0) {
+          preallocated.push_back(fullProcessedPath);
+        }
+        //If the file already exists, delete it (the other policies do not need to
+        //look at the existing file beforehand)
+        else if (m_OverwritePolicy == Archive::OverwritePolicy::REPLACE
+            && !directory->Remove(fullProcessedPath.filename()) && errno != ENOENT) {
+          reportError(ALOGSTR"cannot delete output file '{}': {}", fullProcessedPath, IO::last_error());
+          return E_ABORT;
         }
-        //If the file already exists, delete it
-        if (fs::exists(fullProcessedPath)) {
+        directories.push_back(std::move(directory));
+#else
+        if (!createDirectories(directoryPath, ec)) {
+          reportError(ALOGSTR"cannot created directory '{}': {}", directoryPath, ec);
+          return E_ABORT;
+        }
+        //If the file already exists, delete it (the other policies do not need to
+        //look at the existing file beforehand)
+        if (m_OverwritePolicy == Archive::OverwritePolicy::REPLACE && fs::exists(fullProcessedPath)) {
           std::error_code ec;
           if (!fs::remove(fullProcessedPath, ec)) {
             reportError(ALOGSTR"cannot delete output file '{}': {}", fullProcessedPath, ec);
             return E_ABORT;
           }
         }
+#endif
         m_FullProcessedPaths.push_back(fullProcessedPath);
       }
 
@@ -234,20 +400,87 @@ STDMETHODIMP CArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStre
         if (m_ProgressCallback) {
           m_ProgressCallback(Archive::ProgressType::EXTRACTION, m_ExtractedFileSize, m_TotalFileSize);
         }
-      });
+      }, m_Uring.get(), m_CloseQueue.get());
       CMyComPtr<MultiOutputStream> outStreamCom(m_OutputFileStream);
 
-      if (!m_OutputFileStream->Open(m_FullProcessedPaths)) {
-//        reportError(L"cannot open output file '{}': {}", m_FullProcessedPaths[0], ::GetLastError());
-        std::cerr << "FIXME: Not implemented" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n"; assert(false && "Not implemented");
+      auto openMode = MultiOutputStream::OpenMode::TRUNCATE;
+      switch (m_OverwritePolicy) {
+      case Archive::OverwritePolicy::SKIP_EXISTING:
+        openMode = MultiOutputStream::OpenMode::CREATE_NEW_OR_SKIP;
+        break;
+      case Archive::OverwritePolicy::ATOMIC_REPLACE:
+        openMode = MultiOutputStream::OpenMode::TEMPORARY;
+        break;
+      case Archive::OverwritePolicy::FRESH_DIRECTORY:
+        openMode = MultiOutputStream::OpenMode::CREATE_NEW;
+        break;
+      default:
+        break;
+      }
+#ifndef _WIN32
+      if (!preallocated.empty() && preallocated.size() == m_FullProcessedPaths.size()) {
+        openMode = MultiOutputStream::OpenMode::PREALLOCATED;
+      }
+      else if (openMode == MultiOutputStream::OpenMode::CREATE_NEW
+               || openMode == MultiOutputStream::OpenMode::CREATE_NEW_OR_SKIP) {
+        // Some outputs could not be allocated, the allocated ones are created again with
+        // the others:
+        for (auto const& path : preallocated) {
+          std::error_code ec;
+          fs::remove(path, ec);
+        }
+      }
+#endif
+
+      std::vector<fs::path> skipped;
+#ifndef _WIN32
+      std::vector<IO::Directory const*> outputDirectories;
+      for (auto const& directory : directories) {
+        outputDirectories.push_back(directory.get());
+      }
+      const bool opened = m_OutputFileStream->Open(m_FullProcessedPaths, outputDirectories, openMode, &skipped);
+#else
+      const bool opened = m_OutputFileStream->Open(m_FullProcessedPaths, openMode, &skipped);
+#endif
+      if (!opened) {
+        reportError(ALOGSTR"cannot open output file '{}': {}", m_FullProcessedPaths[0], IO::last_error());
         return E_ABORT;
       }
 
+      if (!skipped.empty()) {
+        for (auto const& path : skipped) {
+          m_LogCallback(Archive::LogLevel::Debug, fmt::format(ALOGSTR"Skipping existing file {}.", path));
+          std::erase(m_FullProcessedPaths, path);
+        }
+        if (m_FullProcessedPaths.empty()) {
+          return S_OK;
+        }
+      }
+
       UInt64 fileSize;
       auto fileSizeFound = getOptionalProperty(index, kpidSize, &fileSize);
+      if (fileSizeFound && m_BufferPool && fileSize <= m_SmallFileThreshold) {
+        m_OutputFileStream->SetBuffered(m_BufferPool.get());
+      }
       if (fileSizeFound && m_OutputFileStream->SetSize(fileSize) != S_OK) {
         m_LogCallback(Archive::LogLevel::Error, fmt::format(ALOGSTR"SetSize() failed on {}.", m_FullProcessedPaths[0]));
       }
+      if (fileSizeFound && m_CacheBypassThreshold > 0 && fileSize >= m_CacheBypassThreshold) {
+        m_OutputFileStream->SetCacheBypass(true);
+      }
+      if (m_Durability != Archive::Durability::NONE) {
+        m_OutputFileStream->SetDurability(m_Durability, &m_SyncTimes);
+      }
+      if (m_SparseThreshold > 0) {
+        m_OutputFileStream->SetSparse(m_SparseThreshold);
+      }
+      if (m_EntryHashing != Archive::HashAlgorithm::NONE) {
+        m_OutputFileStream->SetHash(m_EntryHashing);
+      }
+      UInt32 crc;
+      if (m_CrcVerification == Archive::CrcVerification::WRITE_PATH && getOptionalProperty(index, kpidCRC, &crc)) {
+        m_OutputFileStream->SetCRC(true);
+      }
 
       //This is messy but I can't find another way of doing it. A simple
       //assignment of m_outFileStream to *outStream doesn't increase the
@@ -269,6 +502,37 @@ STDMETHODIMP CArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStre
   return E_FAIL;
 }
 
+#ifndef _WIN32
+HRESULT CArchiveExtractCallback::CopyStoredEntry(UInt32 index, IO::FileIn& source, UInt64 offset, UInt64 size, IO::CopyState& state)
+{
+  CMyComPtr<ISequentialOutStream> outStream;
+  RINOK(GetStream(index, &outStream, NArchive::NExtract::NAskMode::kExtract));
+  RINOK(PrepareOperation(NArchive::NExtract::NAskMode::kExtract));
+
+  // No stream if all the outputs were skipped:
+  if (outStream && m_OutFileStreamCom && m_OutputFileStream->CopyFrom(source, offset, size, &state) != S_OK) {
+    reportError(ALOGSTR"cannot copy data to '{}': {}", m_FullProcessedPaths[0], IO::last_error());
+    SetOperationResult(NArchive::NExtract::NOperationResult::kDataError);
+    return E_FAIL;
+  }
+
+  // Symbolic link stored as data, the target is small so a plain read will do:
+  if (outStream && m_LinkTargetStream) {
+    std::vector<char> target(std::min<UInt64>(size, kMaxLinkTargetLength + 1));
+    UInt64 position;
+    UInt32 read;
+    if (!source.Seek(offset, position) || !source.Read(target.data(), static_cast<UInt32>(target.size()), read)
+        || m_LinkTargetStream->Write(target.data(), read, nullptr) != S_OK) {
+      reportError(ALOGSTR"cannot read the target of symbolic link '{}': {}", std::filesystem::path(m_LinkNames[0]), IO::last_error());
+      SetOperationResult(NArchive::NExtract::NOperationResult::kDataError);
+      return E_FAIL;
+    }
+  }
+
+  return SetOperationResult(NArchive::NExtract::NOperationResult::kOK);
+}
+#endif
+
 STDMETHODIMP CArchiveExtractCallback::PrepareOperation(Int32 askExtractMode)
 {
   if (m_Canceled) {
@@ -280,8 +544,26 @@ STDMETHODIMP CArchiveExtractCallback::PrepareOperation(Int32 askExtractMode)
 
 STDMETHODIMP CArchiveExtractCallback::SetOperationResult(Int32 operationResult)
 {
+  // Check the data written against the CRC of the archive, if both are known:
+  std::optional<UInt32> expectedCRC;
+  std::optional<UInt32> actualCRC;
+  UInt32 crc;
+  if (m_OutFileStreamCom && m_CrcVerification == Archive::CrcVerification::WRITE_PATH
+      && getOptionalProperty(m_Index, kpidCRC, &crc)) {
+    actualCRC = m_OutputFileStream->CRC();
+    if (actualCRC) {
+      expectedCRC = crc;
+      if (operationResult == NArchive::NExtract::NOperationResult::kOK && *actualCRC != crc) {
+        operationResult = NArchive::NExtract::NOperationResult::kCRCError;
+      }
+    }
+  }
+
   if (operationResult != NArchive::NExtract::NOperationResult::kOK) {
     reportError(operationResultToString(operationResult));
+    if (m_EntryResultCallback) {
+      m_EntryResultCallback({ entryPath(m_Index), operationResultToStatus(operationResult), expectedCRC, actualCRC });
+    }
   }
 
   if (m_OutFileStreamCom) {
@@ -289,9 +571,48 @@ STDMETHODIMP CArchiveExtractCallback::SetOperationResult(Int32 operationResult)
       auto guard = m_Timers.SetOperationResult.SetMTime.instrument();
       m_OutputFileStream->SetMTime(&m_ProcessedFileInfo.MTime);
     }
+#ifndef _WIN32
+    // Set on the open descriptors, before the files are published:
+    if (m_ProcessedFileInfo.AttribDefined) {
+      auto guard = m_Timers.SetOperationResult.SetFileAttributesW.instrument();
+      if (!m_OutputFileStream->SetAttributes(m_ProcessedFileInfo.Attrib, m_Umask)) {
+        m_LogCallback(Archive::LogLevel::Warning, fmt::format(ALOGSTR"cannot set permissions of '{}': {}",
+          m_FullProcessedPaths[0], IO::last_error()));
+      }
+    }
+#endif
     auto guard = m_Timers.SetOperationResult.Close.instrument();
-    RINOK(m_OutputFileStream->Close())
+    const bool success = operationResult == NArchive::NExtract::NOperationResult::kOK;
+    if (m_OutputFileStream->Close(success) != S_OK) {
+      reportError(ALOGSTR"cannot close output file '{}': {}", m_FullProcessedPaths[0], IO::last_error());
+      return E_FAIL;
+    }
+#ifndef _WIN32
+    if (success && m_LinkPolicy != Archive::LinkPolicy::AS_FILES) {
+      m_ExtractedFiles[entryKey(entryPath(m_Index))] = m_FullProcessedPaths[0];
+    }
+#endif
+    if (success && m_EntryHashing != Archive::HashAlgorithm::NONE) {
+      const std::string digest = m_OutputFileStream->Digest();
+      if (!digest.empty()) {
+        m_DigestCallback(entryPath(m_Index), digest);
+      }
+    }
+  }
+
+#ifndef _WIN32
+  if (m_LinkTargetStream) {
+    m_LinkTargetStream.Release();
+    if (operationResult == NArchive::NExtract::NOperationResult::kOK) {
+      if (m_LinkTarget.size() > kMaxLinkTargetLength) {
+        reportError(ALOGSTR"target of symbolic link '{}' is too long", std::filesystem::path(m_LinkNames[0]));
+        return E_FAIL;
+      }
+      RINOK(createSymlinks(m_LinkNames, m_LinkTarget));
+    }
+    m_LinkNames.clear();
   }
+#endif
 
   {
     auto guard = m_Timers.SetOperationResult.Release.instrument();
@@ -314,11 +635,26 @@ STDMETHODIMP CArchiveExtractCallback::SetOperationResult(Int32 operationResult)
       //Should probably log any errors here somehow
       ::SetFileAttributesW(fn.c_str(), m_ProcessedFileInfo.Attrib);
     }
-#else
-    std::cerr << "FIXME: Not implemented m_ProcessedFileInfo.Attrib: '" + std::to_string(m_ProcessedFileInfo.Attrib) + "'" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
 #endif
   }
 
+#ifndef _WIN32
+  // Files are handled above, directories once everything has been extracted:
+  if (m_Extracting && m_ProcessedFileInfo.isDir
+      && (m_ProcessedFileInfo.MTimeDefined || m_ProcessedFileInfo.AttribDefined)) {
+    for (auto &path : m_FullProcessedPaths) {
+      DirectoryMetadata metadata{ path, {}, {} };
+      if (m_ProcessedFileInfo.MTimeDefined) {
+        metadata.MTime = m_ProcessedFileInfo.MTime;
+      }
+      if (m_ProcessedFileInfo.AttribDefined) {
+        metadata.Attrib = m_ProcessedFileInfo.Attrib;
+      }
+      m_DirectoryMetadata.push_back(std::move(metadata));
+    }
+  }
+#endif
+
   return S_OK;
 }
 
@@ -335,12 +671,586 @@ STDMETHODIMP CArchiveExtractCallback::CryptoGetTextPassword(BSTR *passwordOut)
 }
 
 
+void CArchiveExtractCallback::SetSequential(std::wstring const& defaultName)
+{
+  m_Sequential = true;
+  m_DefaultName = defaultName;
+}
+
+bool CArchiveExtractCallback::sequentialOutputPath(UInt32 index, std::wstring& path)
+{
+  namespace fs = std::filesystem;
+
+  if (!getOptionalProperty(index, kpidPath, &m_EntryPath) || m_EntryPath.empty()) {
+    m_EntryPath = m_DefaultName;
+  }
+
+  // Nothing is extracted outside of the output directory, whatever the archive says:
+  const fs::path relative = fs::path(m_EntryPath).lexically_normal().relative_path();
+  if (relative.empty() || *relative.begin() == "..") {
+    m_LogCallback(Archive::LogLevel::Warning, fmt::format(ALOGSTR"Skipping entry {} outside of the output directory: {}.",
+      index, fs::path(m_EntryPath)));
+    return false;
+  }
+  path = relative.wstring();
+  return true;
+}
+
+std::wstring CArchiveExtractCallback::entryPath(UInt32 index) const
+{
+  return m_Sequential ? m_EntryPath : m_FileData[index]->getArchiveFilePath();
+}
+
 void CArchiveExtractCallback::SetCanceled(bool aCanceled)
 {
   m_Canceled = aCanceled;
 }
 
 
+bool CArchiveExtractCallback::createDirectories(std::filesystem::path const& path, std::error_code& ec)
+{
+#ifndef _WIN32
+  return openDirectory(path, ec) != nullptr;
+#else
+  if (m_CreatedDirectories.contains(path.native())) {
+    return true;
+  }
+
+  std::filesystem::create_directories(path, ec);
+  if (ec) {
+    return false;
+  }
+
+  // All the parents exist now, stop as soon as we reach one that was already known:
+  for (auto p = path; p != m_DirectoryPath && p.has_relative_path(); p = p.parent_path()) {
+    if (!m_CreatedDirectories.insert(p.native()).second) {
+      break;
+    }
+  }
+  return true;
+#endif
+}
+
+#ifndef _WIN32
+std::shared_ptr<IO::Directory> CArchiveExtractCallback::openDirectory(std::filesystem::path const& path, std::error_code& ec)
+{
+  auto it = m_DirectoryIndex.find(path.native());
+  if (it != m_DirectoryIndex.end()) {
+    m_Directories.splice(m_Directories.begin(), m_Directories, it->second);
+    return it->second->second;
+  }
+
+  auto directory = std::make_shared<IO::Directory>();
+  const bool known = m_CreatedDirectories.contains(path.native());
+
+  // The output directory itself (or anything above it) is opened by its full path:
+  if (path.native().size() <= m_DirectoryPath.native().size()) {
+    if (!known) {
+      std::filesystem::create_directories(path, ec);
+      if (ec) {
+        return nullptr;
+      }
+    }
+    if (!directory->Open(path)) {
+      ec = IO::last_error();
+      return nullptr;
+    }
+  }
+  else {
+    auto parent = openDirectory(path.parent_path(), ec);
+    if (!parent) {
+      return nullptr;
+    }
+    if (!directory->Open(*parent, path.filename(), !known)) {
+      ec = IO::last_error();
+      return nullptr;
+    }
+  }
+
+  // The least recently used directory is closed, unless the caller still uses it, in which
+  // case it remains open until released:
+  if (m_Directories.size() >= kMaxOpenDirectories) {
+    m_DirectoryIndex.erase(m_Directories.back().first);
+    m_Directories.pop_back();
+  }
+  m_Directories.emplace_front(path.native(), directory);
+  m_DirectoryIndex.emplace(path.native(), m_Directories.begin());
+  m_CreatedDirectories.insert(path.native());
+  return directory;
+}
+
+HRESULT CArchiveExtractCallback::extractLink(UInt32 index, std::vector<std::wstring> const& filenames,
+                                             ISequentialOutStream** outStream, bool& isLink)
+{
+  namespace fs = std::filesystem;
+
+  std::wstring target;
+  if (getOptionalProperty(index, kpidHardLink, &target) && !target.empty()) {
+    isLink = true;
+
+    // Link to the file extracted for the target if any, otherwise to where it would be:
+    auto it = m_ExtractedFiles.find(entryKey(target));
+    const fs::path existing = it != m_ExtractedFiles.end() ? it->second : m_DirectoryPath / fs::path(target);
+    for (auto const& filename : filenames) {
+      auto link = m_DirectoryPath / fs::path(filename).make_preferred();
+      const HRESULT check = checkLinkTarget(link, existing);
+      if (check == S_FALSE) {
+        continue;
+      }
+      RINOK(check);
+
+      std::error_code ec;
+      if (!createDirectories(link.parent_path(), ec)) {
+        reportError(ALOGSTR"cannot created directory '{}': {}", link.parent_path(), ec);
+        return E_ABORT;
+      }
+      m_HardLinks.push_back({ link, existing });
+      m_FullProcessedPaths.push_back(link);
+    }
+    if (!m_FullProcessedPaths.empty()) {
+      m_ExtractedFiles[entryKey(entryPath(index))] = m_FullProcessedPaths[0];
+    }
+    return S_OK;
+  }
+
+  if (getOptionalProperty(index, kpidSymLink, &target) && !target.empty()) {
+    isLink = true;
+    return createSymlinks(filenames, fs::path(target));
+  }
+
+  // Archives created on Unix systems (7z, zip) store symbolic links as entries whose data
+  // is the target, with the file type in the upper half of the attributes:
+  if (m_ProcessedFileInfo.AttribDefined && (m_ProcessedFileInfo.Attrib & 0x8000)
+      && S_ISLNK(m_ProcessedFileInfo.Attrib >> 16)) {
+    isLink = true;
+    m_LinkNames = filenames;
+    m_LinkTarget.clear();
+    CMyComPtr<ISequentialOutStream> stream(new StringOutStream(m_LinkTarget, kMaxLinkTargetLength));
+    m_LinkTargetStream = stream;
+    *outStream = stream.Detach();
+  }
+  return S_OK;
+}
+
+HRESULT CArchiveExtractCallback::createSymlinks(std::vector<std::wstring> const& filenames, std::filesystem::path const& target)
+{
+  namespace fs = std::filesystem;
+
+  for (auto const& filename : filenames) {
+    auto link = m_DirectoryPath / fs::path(filename).make_preferred();
+    const HRESULT check = checkLinkTarget(link, link.parent_path() / target);
+    if (check == S_FALSE) {
+      continue;
+    }
+    RINOK(check);
+
+    std::error_code ec;
+    auto directory = openDirectory(link.parent_path(), ec);
+    if (!directory) {
+      reportError(ALOGSTR"cannot created directory '{}': {}", link.parent_path(), ec);
+      return E_ABORT;
+    }
+
+    // Existing entries are replaced, unless the policy says otherwise:
+    auto name = link.filename();
+    if (m_OverwritePolicy != Archive::OverwritePolicy::SKIP_EXISTING
+        && m_OverwritePolicy != Archive::OverwritePolicy::FRESH_DIRECTORY
+        && !directory->Remove(name) && errno != ENOENT) {
+      reportError(ALOGSTR"cannot delete output file '{}': {}", link, IO::last_error());
+      return E_ABORT;
+    }
+    if (!directory->Symlink(target, name)) {
+      if (errno == EEXIST && m_OverwritePolicy == Archive::OverwritePolicy::SKIP_EXISTING) {
+        m_LogCallback(Archive::LogLevel::Debug, fmt::format(ALOGSTR"Skipping existing file {}.", link));
+        continue;
+      }
+      reportError(ALOGSTR"cannot create symbolic link '{}': {}", link, IO::last_error());
+      return E_FAIL;
+    }
+    if (m_ProcessedFileInfo.MTimeDefined && !directory->SetTime(name, &m_ProcessedFileInfo.MTime)) {
+      m_LogCallback(Archive::LogLevel::Warning, fmt::format(ALOGSTR"cannot set modification time of '{}': {}",
+        link, IO::last_error()));
+    }
+    m_ExtractedFiles.try_emplace(entryKey(entryPath(m_Index)), link);
+  }
+  return S_OK;
+}
+
+HRESULT CArchiveExtractCallback::checkLinkTarget(std::filesystem::path const& link, std::filesystem::path const& target)
+{
+  if (m_LinkPolicy == Archive::LinkPolicy::UNRESTRICTED) {
+    return S_OK;
+  }
+
+  // Links already extracted are followed, so chaining links does not escape either:
+  std::error_code ec;
+  auto resolved = std::filesystem::weakly_canonical(target, ec);
+  if (!ec) {
+    auto relative = resolved.lexically_relative(m_CanonicalDirectoryPath);
+    if (!relative.empty() && *relative.begin() != "..") {
+      return S_OK;
+    }
+  }
+
+  if (m_LinkPolicy == Archive::LinkPolicy::CONFINED_STRICT) {
+    reportError(ALOGSTR"link '{}' points outside of the output directory ('{}')", link, target);
+    return E_FAIL;
+  }
+  m_LogCallback(Archive::LogLevel::Warning, fmt::format(ALOGSTR"Skipping link '{}' pointing outside of the output directory ('{}').",
+    link, target));
+  return S_FALSE;
+}
+#endif
+
+
+HRESULT CArchiveExtractCallback::PrecreateDirectories(bool parallel)
+{
+  namespace fs = std::filesystem;
+
+  std::vector<fs::path> directories;
+  for (std::size_t i = 0; i < m_NbFiles; ++i) {
+    for (auto const& filename : m_FileData[i]->getOutputFilePaths()) {
+      auto fullpath = m_DirectoryPath / fs::path(filename).make_preferred();
+      directories.push_back(m_FileData[i]->isDirectory() ? fullpath : fullpath.parent_path());
+    }
+  }
+
+  // Once sorted, a directory is immediately followed by its sub-directories (if any), so only
+  // the leaves need to be created, the others come for free:
+  std::sort(directories.begin(), directories.end());
+  directories.erase(std::unique(directories.begin(), directories.end()), directories.end());
+
+  std::vector<fs::path> leaves;
+  for (std::size_t i = 0; i < directories.size(); ++i) {
+    if (i + 1 < directories.size()) {
+      auto const& next = directories[i + 1];
+      auto mismatch = std::mismatch(directories[i].begin(), directories[i].end(), next.begin(), next.end());
+      if (mismatch.first == directories[i].end()) {
+        continue;
+      }
+    }
+    leaves.push_back(directories[i]);
+  }
+
+  // create_directories() handles directories created concurrently by other threads, so
+  // leaves can be split between workers even if they share parents:
+  std::size_t nThreads = 1;
+  if (parallel && leaves.size() >= kMinLeavesPerThread * 2) {
+    nThreads = std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, kMaxDirectoryThreads);
+    nThreads = std::min(nThreads, leaves.size() / kMinLeavesPerThread);
+  }
+
+  std::vector<std::error_code> errors(leaves.size());
+  auto work = [&](std::size_t first) {
+    for (std::size_t i = first; i < leaves.size(); i += nThreads) {
+      fs::create_directories(leaves[i], errors[i]);
+    }
+  };
+
+  {
+    std::vector<std::jthread> workers;
+    for (std::size_t t = 1; t < nThreads; ++t) {
+      workers.emplace_back(work, t);
+    }
+    work(0);
+  }
+
+  for (std::size_t i = 0; i < leaves.size(); ++i) {
+    if (errors[i]) {
+      reportError(ALOGSTR"cannot created directory '{}': {}", leaves[i], errors[i]);
+      return E_FAIL;
+    }
+  }
+
+  for (auto const& directory : directories) {
+    m_CreatedDirectories.insert(directory.native());
+  }
+
+  return S_OK;
+}
+
+
+HRESULT CArchiveExtractCallback::ReserveSpace(bool preallocate, bool parallel)
+{
+  namespace fs = std::filesystem;
+
+  // The output directory may not exist yet, its closest existing parent is on the same
+  // filesystem:
+  auto existing = m_DirectoryPath;
+  std::error_code ec;
+  while (!fs::exists(existing, ec) && existing.has_relative_path()) {
+    existing = existing.parent_path();
+  }
+
+  UInt64 available, blockSize;
+  if (!IO::disk_space(existing, available, blockSize)) {
+    reportError(ALOGSTR"cannot retrieve the free space of '{}': {}", existing, IO::last_error());
+    return E_FAIL;
+  }
+  blockSize = std::max<UInt64>(blockSize, 1);
+  auto blocks = [blockSize](UInt64 size) {
+    return (size + blockSize - 1) / blockSize * blockSize;
+  };
+
+  // Files that are overwritten give their space back:
+  const bool overwrites = m_OverwritePolicy == Archive::OverwritePolicy::REPLACE
+    || m_OverwritePolicy == Archive::OverwritePolicy::TRUNCATE;
+
+  struct Output {
+    fs::path Path;
+    UInt64 Size;
+    std::size_t Index;
+  };
+  std::vector<Output> outputs;
+  UInt64 needed = 0;
+  UInt64 freed = 0;
+  for (std::size_t i = 0; i < m_NbFiles; ++i) {
+    const bool isDirectory = m_FileData[i]->isDirectory();
+    const UInt64 size = isDirectory ? 0 : m_FileData[i]->getSize();
+    for (auto const& filename : m_FileData[i]->getOutputFilePaths()) {
+      auto path = m_DirectoryPath / fs::path(filename).make_preferred();
+      needed += blocks(size) + blockSize;
+      if (overwrites && !isDirectory) {
+        const auto existingSize = fs::file_size(path, ec);
+        if (!ec) {
+          freed += blocks(existingSize);
+        }
+      }
+      if (size > 0) {
+        outputs.push_back({ std::move(path), size, i });
+      }
+    }
+  }
+
+  m_LogCallback(Archive::LogLevel::Debug, fmt::format(ALOGSTR"Extraction needs {} bytes ({} bytes overwritten), {} bytes available.",
+    needed, freed, available));
+  if (needed > available + freed) {
+    reportError(ALOGSTR"not enough space in '{}': {} bytes needed, {} bytes available",
+      m_DirectoryPath, needed - freed, available);
+    return kDiskFull;
+  }
+
+#ifdef __linux__
+  if (!preallocate) {
+    return S_OK;
+  }
+  if (m_OverwritePolicy == Archive::OverwritePolicy::ATOMIC_REPLACE) {
+    m_LogCallback(Archive::LogLevel::Debug, ALOGSTR"Files are extracted to temporaries, not preallocating them.");
+    return S_OK;
+  }
+
+  // Symbolic links stored as data do not become files:
+  if (m_LinkPolicy != Archive::LinkPolicy::AS_FILES) {
+    std::erase_if(outputs, [this](Output const& output) {
+      UInt32 attrib;
+      return getOptionalProperty(static_cast<UInt32>(output.Index), kpidAttrib, &attrib)
+        && (attrib & 0x8000) && S_ISLNK(attrib >> 16);
+    });
+  }
+
+  // Parents are created beforehand since the directory cache is not thread-safe:
+  for (auto const& output : outputs) {
+    if (!createDirectories(output.Path.parent_path(), ec)) {
+      reportError(ALOGSTR"cannot created directory '{}': {}", output.Path.parent_path(), ec);
+      return E_FAIL;
+    }
+  }
+
+  std::size_t nThreads = 1;
+  if (parallel && outputs.size() >= kMinFilesPerThread * 2) {
+    nThreads = std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, kMaxPreallocationThreads);
+    nThreads = std::min(nThreads, outputs.size() / kMinFilesPerThread);
+  }
+
+  std::vector<std::error_code> errors(outputs.size());
+  std::vector<char> allocated(outputs.size(), false);
+  std::atomic<bool> unsupported{ false };
+  auto work = [&](std::size_t first) {
+    for (std::size_t i = first; i < outputs.size() && !unsupported; i += nThreads) {
+      auto const& path = outputs[i].Path;
+
+      // Only new files are preallocated, existing ones are left to the extraction, which
+      // overwrites, skips or reports them according to the policy:
+      IO::FileOut file;
+      if (!file.OpenNew(path)) {
+        if (IO::last_error() != std::errc::file_exists) {
+          errors[i] = IO::last_error();
+        }
+        continue;
+      }
+      if (!file.Allocate(outputs[i].Size)) {
+        const auto error = IO::last_error();
+        file.Close();
+        std::error_code ignored;
+        fs::remove(path, ignored);
+        if (error == std::errc::operation_not_supported) {
+          unsupported = true;
+        } else {
+          errors[i] = error;
+        }
+        continue;
+      }
+      allocated[i] = true;
+    }
+  };
+
+  {
+    std::vector<std::jthread> workers;
+    for (std::size_t t = 1; t < nThreads; ++t) {
+      workers.emplace_back(work, t);
+    }
+    work(0);
+  }
+
+  // Even on failure, so Finalize() removes them (they did not exist before):
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < outputs.size(); ++i) {
+    if (allocated[i]) {
+      m_Preallocated.insert(outputs[i].Path.native());
+      ++count;
+    }
+  }
+
+  for (std::size_t i = 0; i < outputs.size(); ++i) {
+    if (errors[i]) {
+      reportError(ALOGSTR"cannot allocate '{}': {}", outputs[i].Path, errors[i]);
+      return errors[i] == std::errc::no_space_on_device ? kDiskFull : E_FAIL;
+    }
+  }
+
+  if (unsupported) {
+    m_LogCallback(Archive::LogLevel::Debug, fmt::format(ALOGSTR"Preallocation is not supported in {}.", m_DirectoryPath));
+  }
+  m_LogCallback(Archive::LogLevel::Debug, fmt::format(ALOGSTR"Preallocated {} files.", count));
+#endif
+
+  return S_OK;
+}
+
+
+HRESULT CArchiveExtractCallback::Finalize()
+{
+  // Release the last stream in case the handler did not call SetOperationResult:
+  m_OutFileStreamCom.Release();
+#ifndef _WIN32
+  m_DirectoryIndex.clear();
+  m_Directories.clear();
+#endif
+
+  HRESULT result = S_OK;
+#ifndef _WIN32
+  m_LinkTargetStream.Release();
+#endif
+  if (m_Uring) {
+    for (auto const& failure : m_Uring->Drain()) {
+      reportError(ALOGSTR"failed to write '{}': {}", failure.Path, failure.Error);
+      result = E_FAIL;
+    }
+  }
+  if (m_CloseQueue) {
+    for (auto const& failure : m_CloseQueue->Drain()) {
+      reportError(ALOGSTR"failed to close '{}': {}", failure.Path, failure.Error);
+      result = E_FAIL;
+    }
+  }
+
+#ifndef _WIN32
+  // Files allocated for entries that were never extracted (failed or cancelled extraction):
+  for (auto const& path : m_Preallocated) {
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+  }
+  m_Preallocated.clear();
+
+  // The targets of the hard links are all closed (and published) now:
+  for (auto const& link : m_HardLinks) {
+    std::error_code ec;
+    if (m_OverwritePolicy != Archive::OverwritePolicy::SKIP_EXISTING
+        && m_OverwritePolicy != Archive::OverwritePolicy::FRESH_DIRECTORY && link.Link != link.Target) {
+      std::filesystem::remove(link.Link, ec);
+    }
+    std::filesystem::create_hard_link(link.Target, link.Link, ec);
+    if (ec == std::errc::file_exists && m_OverwritePolicy == Archive::OverwritePolicy::SKIP_EXISTING) {
+      m_LogCallback(Archive::LogLevel::Debug, fmt::format(ALOGSTR"Skipping existing file {}.", link.Link));
+    }
+    else if (ec) {
+      reportError(ALOGSTR"cannot create hard link '{}' to '{}': {}", link.Link, link.Target, ec);
+      result = E_FAIL;
+    }
+  }
+  m_HardLinks.clear();
+
+  {
+    auto guard = m_Timers.DirectoryMetadata.instrument();
+
+    // Children sort after their parent, so this goes bottom-up and setting the metadata of
+    // a directory does not alter its parent, and permissions that forbid writing into a
+    // directory are only set once its content is done:
+    std::sort(m_DirectoryMetadata.begin(), m_DirectoryMetadata.end(), [](auto const& lhs, auto const& rhs) {
+      return lhs.Path.native() > rhs.Path.native();
+    });
+    for (auto const& metadata : m_DirectoryMetadata) {
+      if (metadata.MTime && !IO::set_mtime(metadata.Path, &*metadata.MTime)) {
+        m_LogCallback(Archive::LogLevel::Warning, fmt::format(ALOGSTR"cannot set modification time of '{}': {}",
+          metadata.Path, IO::last_error()));
+      }
+      if (metadata.Attrib && !IO::set_attributes(metadata.Path, *metadata.Attrib, m_Umask)) {
+        m_LogCallback(Archive::LogLevel::Warning, fmt::format(ALOGSTR"cannot set permissions of '{}': {}",
+          metadata.Path, IO::last_error()));
+      }
+    }
+    m_DirectoryMetadata.clear();
+  }
+#endif
+
+  if (m_Durability != Archive::Durability::NONE && !syncOutput()) {
+    result = E_FAIL;
+  }
+
+  return result;
+}
+
+
+bool CArchiveExtractCallback::syncOutput()
+{
+  const auto start = std::chrono::steady_clock::now();
+
+  bool result = true;
+#ifdef __linux__
+  if (m_Durability == Archive::Durability::BATCHED) {
+    // A single syncfs() flushes every extracted file and directory entry:
+    if (!IO::sync_filesystem(m_DirectoryPath)) {
+      reportError(ALOGSTR"failed to sync the filesystem of '{}': {}", m_DirectoryPath, IO::last_error());
+      result = false;
+    }
+  }
+  else
+#endif
+  {
+    // The files themselves have been synced before being closed, but not their entries:
+    std::vector<std::filesystem::path> directories{ m_DirectoryPath };
+    for (auto const& directory : m_CreatedDirectories) {
+      directories.push_back(directory);
+    }
+    for (auto const& directory : directories) {
+      if (!IO::sync_directory(directory)) {
+        reportError(ALOGSTR"failed to sync directory '{}': {}", directory, IO::last_error());
+        result = false;
+      }
+    }
+  }
+
+  using ms = std::chrono::duration<double, std::milli>;
+  m_LogCallback(Archive::LogLevel::Debug, fmt::format(
+    ALOGSTR"Durability: {:.1f}ms starting writeback, {:.1f}ms syncing files, {:.1f}ms final sync.",
+    ms(std::chrono::nanoseconds(m_SyncTimes.Writeback)).count(),
+    ms(std::chrono::nanoseconds(m_SyncTimes.FileSync)).count(),
+    ms(std::chrono::steady_clock::now() - start).count()));
+
+  return result;
+}
+
+
 void CArchiveExtractCallback::reportError(PathStr const& message)
 {
   if (m_ErrorCallback) {
@@ -24,6 +24,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <atomic>
 #include <chrono>
 #include <filesystem>
+#include <list>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "7zip/Archive/IArchive.h"
 #include "7zip/IPassword.h"
@@ -34,14 +40,42 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <fmt/format.h>
 
 #include "archive.h"
+#include "closequeue.h"
 #include "formatter.h"
 #include "instrument.h"
 #include "multioutputstream.h"
 #include "unknown_impl.h"
+#include "uring.h"
 
 
 class FileData;
 
+/**
+ * Extraction settings, forwarded from the Archive to the extraction callback.
+ */
+struct ExtractSettings {
+  Archive::OutputEngine Engine = Archive::OutputEngine::SYNCHRONOUS;
+  UInt64 CacheBypassThreshold = 0;
+  Archive::DirectoryCreation DirectoryCreation = Archive::DirectoryCreation::ON_DEMAND;
+  Archive::OverwritePolicy OverwritePolicy = Archive::OverwritePolicy::REPLACE;
+  std::size_t CloseThreads = 0;
+  Archive::Durability Durability = Archive::Durability::NONE;
+  UInt64 SmallFileThreshold = 0;
+  Archive::ZeroCopy ZeroCopy = Archive::ZeroCopy::DISABLED;
+  UInt64 SparseThreshold = 0;
+  Archive::LinkPolicy LinkPolicy = Archive::LinkPolicy::AS_FILES;
+  Archive::SpaceReservation SpaceReservation = Archive::SpaceReservation::NONE;
+  Archive::HashAlgorithm EntryHashing = Archive::HashAlgorithm::NONE;
+  Archive::DigestCallback DigestCallback;
+  Archive::CrcVerification CrcVerification = Archive::CrcVerification::DEFAULT;
+  Archive::EntryResultCallback EntryResultCallback;
+};
+
+/**
+ * @return the status of an entry, from the result of its extraction by the handler.
+ */
+Archive::EntryStatus operationResultToStatus(Int32 operationResult);
+
 class CArchiveExtractCallback: public IArchiveExtractCallback,
                                public ICryptoGetTextPassword
 {
@@ -54,6 +88,10 @@ class CArchiveExtractCallback: public IArchiveExtractCallback,
 
 public:
 
+  // Returned when the output filesystem does not have enough space for the extraction
+  // (same value as HRESULT_FROM_WIN32(ERROR_DISK_FULL)):
+  static constexpr HRESULT kDiskFull = static_cast<HRESULT>(0x80070070L);
+
   CArchiveExtractCallback(
     Archive::ProgressCallback progressCallback,
     Archive::FileChangeCallback fileChangeCallback,
@@ -65,12 +103,75 @@ public:
     FileData * const *fileData,
     std::size_t nbFiles,
     UInt64 totalFileSize,
-    std::wstring *password);
+    std::wstring *password,
+    ExtractSettings const& settings);
 
   virtual ~CArchiveExtractCallback();
 
   void SetCanceled(bool aCanceled);
 
+  /**
+   * @brief Extract all the entries to their path in the archive, for sequential archives
+   *   whose entries are not known before extraction (see Archive::openSequential()).
+   *
+   * @param defaultName Name of the entries without a path (e.g. a single compressed file).
+   */
+  void SetSequential(std::wstring const& defaultName);
+
+  /**
+   * @brief Create all the directories needed for the extraction in one pass.
+   *
+   * @param parallel If true, the directories are created by multiple threads.
+   *
+   * @return S_OK if all the directories were created, an error otherwise.
+   */
+  HRESULT PrecreateDirectories(bool parallel);
+
+  /**
+   * @brief Check that the output filesystem has room for all the files to extract, and
+   *   optionally create and allocate them upfront.
+   *
+   * The estimate rounds each file up to the block size of the filesystem, adds a block per
+   * entry for its metadata, and deducts the existing files that will be overwritten.
+   *
+   * @param preallocate If true, the output files that do not exist yet are created and
+   *   allocated (Linux only).
+   * @param parallel If true, the files are allocated by multiple threads.
+   *
+   * @return S_OK if there is enough space (and the files were allocated), kDiskFull if there
+   *   is not, another error otherwise.
+   */
+  HRESULT ReserveSpace(bool preallocate, bool parallel);
+
+#ifndef _WIN32
+  /**
+   * @brief Extract an entry stored without compression by copying its data directly from
+   *   the archive file, instead of going through the handler.
+   *
+   * The entry goes through the same steps as when extracted by the handler (output files,
+   * metadata, etc.), only the data is copied differently.
+   *
+   * @param index Index of the entry.
+   * @param source The archive file.
+   * @param offset Offset of the data of the entry in the archive file.
+   * @param size Size of the entry.
+   * @param state Copy options and statistics, see IO::FileOut::CopyFrom().
+   *
+   * @return S_OK if the entry was extracted, an error otherwise.
+   */
+  HRESULT CopyStoredEntry(UInt32 index, IO::FileIn& source, UInt64 offset, UInt64 size, IO::CopyState& state);
+#endif
+
+  /**
+   * @brief Complete the pending output operations.
+   *
+   * This must be called once the archive handler is done with the extraction, even if the
+   * extraction failed, and reports the errors that were not reported during the extraction.
+   *
+   * @return S_OK if all the pending operations succeeded, an error otherwise.
+   */
+  HRESULT Finalize();
+
   INTERFACE_IArchiveExtractCallback(;)
 
   // ICryptoGetTextPassword
@@ -86,6 +187,74 @@ private:
     reportError(fmt::format(format, std::forward<Args>(args)...));
   }
 
+  /**
+   * @brief Create the given directory and its parents, unless it is already known to exist.
+   *
+   * @return true if the directory exists, false otherwise (ec is then set).
+   */
+  bool createDirectories(std::filesystem::path const& path, std::error_code& ec);
+
+  /**
+   * @brief Retrieve the output path of the given entry of a sequential archive, i.e. its
+   *   path in the archive, made relative.
+   *
+   * @return false if the entry must be skipped (its path leaves the output directory).
+   */
+  bool sequentialOutputPath(UInt32 index, std::wstring& path);
+
+  /**
+   * @return the path in the archive of the given entry, being extracted.
+   */
+  std::wstring entryPath(UInt32 index) const;
+
+#ifndef _WIN32
+  /**
+   * @brief Open the given directory, creating it and its parents if needed.
+   *
+   * Directories are opened relative to their (cached) parent, so the full path is not
+   * resolved again for each entry.
+   *
+   * @return the directory, or nullptr if it could not be created or opened (ec is then set).
+   */
+  std::shared_ptr<IO::Directory> openDirectory(std::filesystem::path const& path, std::error_code& ec);
+
+  /**
+   * @brief Handle the given entry if it is a link, see Archive::setLinkPolicy().
+   *
+   * Symbolic links are created directly, hard links once all the files are closed, and
+   * symbolic links stored as data get a stream collecting their target.
+   *
+   * @param isLink Set to true if the entry is a link.
+   *
+   * @return S_OK if the entry was handled (or is not a link), an error otherwise.
+   */
+  HRESULT extractLink(UInt32 index, std::vector<std::wstring> const& filenames,
+                      ISequentialOutStream** outStream, bool& isLink);
+
+  /**
+   * @brief Create symbolic links to the given target for the current entry.
+   */
+  HRESULT createSymlinks(std::vector<std::wstring> const& filenames, std::filesystem::path const& target);
+
+  /**
+   * @brief Check the target of a link against m_LinkPolicy.
+   *
+   * @param link Full path of the link.
+   * @param target Full path the link points to.
+   *
+   * @return S_OK if the link can be created, S_FALSE if it must be skipped, an error otherwise.
+   */
+  HRESULT checkLinkTarget(std::filesystem::path const& link, std::filesystem::path const& target);
+#endif
+
+  /**
+   * @brief Make the extracted files durable according to m_Durability, once they are all
+   *   closed, and log the time spent syncing.
+   *
+   * @return true if everything was synced, false otherwise (errors are reported).
+   */
+  bool syncOutput();
+
   template <typename T> bool getOptionalProperty(UInt32 index, int property, T *result) const;
   template <typename T> bool getProperty(UInt32 index, int property, T *result) const;
 
@@ -95,7 +264,35 @@ private:
 
   UInt64 m_Total;
 
+  static constexpr std::size_t kMinLeavesPerThread = 32;
+  static constexpr std::size_t kMaxDirectoryThreads = 8;
+
+  // Preallocation threads (see ReserveSpace()):
+  static constexpr std::size_t kMinFilesPerThread = 32;
+  static constexpr std::size_t kMaxPreallocationThreads = 8;
+
+  // Maximum number of output directories kept open:
+  static constexpr std::size_t kMaxOpenDirectories = 256;
+
+  // Maximum number of small-file buffers kept for reuse:
+  static constexpr std::size_t kMaxPooledBuffers = 64;
+
+  // Maximum number of files waiting to be closed, per closing thread:
+  static constexpr std::size_t kPendingClosesPerThread = 16;
+
+  // Maximum length of the target of symbolic links stored as data:
+  static constexpr std::size_t kMaxLinkTargetLength = 4096;
+
   std::filesystem::path m_DirectoryPath;
+
+  // Directories (full paths) known to exist under m_DirectoryPath:
+  std::unordered_set<PathStr> m_CreatedDirectories;
+
+#ifndef _WIN32
+  // Open output directories, most recently used first, and their position by full path:
+  std::list<std::pair<PathStr, std::shared_ptr<IO::Directory>>> m_Directories;
+  std::unordered_map<PathStr, decltype(m_Directories)::iterator> m_DirectoryIndex;
+#endif
   bool m_Extracting;
   std::atomic<bool> m_Canceled;
 
@@ -108,6 +305,7 @@ private:
       ArchiveTimers::Timer Release;
       ArchiveTimers::Timer SetFileAttributesW;
     } SetOperationResult;
+    ArchiveTimers::Timer DirectoryMetadata;
   } m_Timers;
 
   struct CProcessedFileInfo {
@@ -118,12 +316,78 @@ private:
     bool MTimeDefined;
   } m_ProcessedFileInfo;
 
+  // Buffers of the small files, must outlive the queues and the output streams:
+  UInt64 m_SmallFileThreshold;
+  std::unique_ptr<IO::BufferPool> m_BufferPool;
+
+  // Must be declared before the output streams since these hand their files
+  // to the queue on destruction:
+  std::unique_ptr<IO::UringQueue> m_Uring;
+  std::unique_ptr<IO::CloseQueue> m_CloseQueue;
+
+  UInt64 m_CacheBypassThreshold;
+  UInt64 m_SparseThreshold;
+  Archive::HashAlgorithm m_EntryHashing;
+  Archive::CrcVerification m_CrcVerification;
+  Archive::OverwritePolicy m_OverwritePolicy;
+  Archive::Durability m_Durability;
+  MultiOutputStream::SyncTimes m_SyncTimes;
+
   MultiOutputStream *m_OutputFileStream;
   CMyComPtr<MultiOutputStream> m_OutFileStreamCom;
 
   std::vector<std::filesystem::path> m_FullProcessedPaths;
 
+#ifndef _WIN32
+  // Metadata of the extracted directories, applied by Finalize() since extracting
+  // entries into a directory would otherwise reset its modification time:
+  struct DirectoryMetadata {
+    std::filesystem::path Path;
+    std::optional<FILETIME> MTime;
+    std::optional<UInt32> Attrib;
+  };
+  std::vector<DirectoryMetadata> m_DirectoryMetadata;
+
+  Archive::LinkPolicy m_LinkPolicy;
+
+  // Umask of the process, applied to the permissions of the archive:
+  mode_t m_Umask;
+
+  // Output directory with its symbolic links resolved, the targets of confined links must
+  // be under it:
+  std::filesystem::path m_CanonicalDirectoryPath;
+
+  // First output path of the files and links extracted so far, by (normalized) path in
+  // the archive, to create the hard links to them:
+  std::unordered_map<PathStr, std::filesystem::path> m_ExtractedFiles;
+
+  // Hard links to create once all the files are closed:
+  struct HardLink {
+    std::filesystem::path Link;
+    std::filesystem::path Target;
+  };
+  std::vector<HardLink> m_HardLinks;
+
+  // Symbolic link whose target is the data of the entry being extracted:
+  std::vector<std::wstring> m_LinkNames;
+  std::string m_LinkTarget;
+  CMyComPtr<ISequentialOutStream> m_LinkTargetStream;
+
+  // Output files created and allocated by ReserveSpace() that have not been opened yet,
+  // the ones left at the end are removed:
+  std::unordered_set<PathStr> m_Preallocated;
+#endif
+
   FileData* const *m_FileData;
+
+  // Index of the entry being extracted:
+  UInt32 m_Index;
+
+  // Sequential extraction (see SetSequential()), m_FileData is not used and the path of
+  // the entry being extracted is kept in m_EntryPath:
+  bool m_Sequential;
+  std::wstring m_DefaultName;
+  std::wstring m_EntryPath;
   std::size_t m_NbFiles;
   UInt64 m_TotalFileSize;
   UInt64 m_LastCallbackFileSize;
@@ -134,6 +398,8 @@ private:
   Archive::ErrorCallback m_ErrorCallback;
   Archive::PasswordCallback m_PasswordCallback;
   Archive::LogCallback m_LogCallback;
+  Archive::DigestCallback m_DigestCallback;
+  Archive::EntryResultCallback m_EntryResultCallback;
   std::wstring* m_Password;
 
 };
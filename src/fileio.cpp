@@ -20,6 +20,66 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "fileio.h"
 
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+namespace {
+
+  constexpr UInt32 kReadOnly = 0x1; // FILE_ATTRIBUTE_READONLY
+  constexpr UInt32 kUnixExtension = 0x8000; // FILE_ATTRIBUTE_UNIX_EXTENSION
+
+  // Number of 100ns intervals between 1601-01-01 (FILETIME) and 1970-01-01 (Unix epoch):
+  constexpr UInt64 kFileTimeUnixEpoch = 116444736000000000ULL;
+
+  timespec to_timespec(const FILETIME* fileTime) {
+    timespec ts{ 0, UTIME_OMIT };
+    if (fileTime) {
+      const UInt64 ticks = ((UInt64)fileTime->dwHighDateTime << 32) | fileTime->dwLowDateTime;
+      const Int64 unixTicks = (Int64)(ticks - kFileTimeUnixEpoch);
+      ts.tv_sec = unixTicks / 10000000;
+      ts.tv_nsec = (unixTicks % 10000000) * 100;
+      if (ts.tv_nsec < 0) {
+        ts.tv_sec -= 1;
+        ts.tv_nsec += 1000000000;
+      }
+    }
+    return ts;
+  }
+
+  FILETIME to_filetime(timespec const& ts) {
+    const UInt64 ticks = kFileTimeUnixEpoch + (Int64)ts.tv_sec * 10000000 + ts.tv_nsec / 100;
+    FILETIME fileTime;
+    fileTime.dwLowDateTime = (DWORD)ticks;
+    fileTime.dwHighDateTime = (DWORD)(ticks >> 32);
+    return fileTime;
+  }
+
+  // Only called with kUnixExtension set, or kReadOnly set and the current mode. Like tar
+  // for non-root users, the setuid, setgid and sticky bits of the archive are dropped and
+  // the umask applies:
+  mode_t to_mode(UInt32 attributes, mode_t current, mode_t umask) {
+    if (attributes & kUnixExtension) {
+      return (attributes >> 16) & 0777 & ~umask;
+    }
+    return current & 07777 & ~0222;
+  }
+
+}
+#endif
+
 inline bool BOOLToBool(BOOL v) { return (v != FALSE); }
 
 namespace IO {
@@ -35,12 +95,13 @@ namespace IO {
     m_Handle = INVALID_HANDLE_VALUE;
     return true;
 #else
-    if (!m_Stream.is_open())
+    if (m_Fd == -1)
       return true;
-    if (m_Stream.close(), m_Stream.fail())
-      return false;
-    m_Stream = std::fstream();
-    return true;
+    // The descriptor is released even if close() reports an error, so we must not
+    // retry on EINTR:
+    int res = ::close(m_Fd);
+    m_Fd = -1;
+    return res == 0;
 #endif
   }
 
@@ -48,13 +109,7 @@ namespace IO {
 #ifdef _WIN32
     return Seek(0, FILE_CURRENT, position);
 #else
-    if (!m_Stream.is_open() || !(m_OpenMode & (std::ios::in | std::ios::out)))
-      return false;
-    const auto pos = m_OpenMode & std::ios::in ? m_Stream.tellg() : m_Stream.tellp();
-    if (!m_Stream.good())
-      return false;
-    position = pos;
-    return true;
+    return Seek(0, FILE_CURRENT, position);
 #endif
   }
 
@@ -68,13 +123,10 @@ namespace IO {
     length = (((UInt64)sizeHigh) << 32) + sizeLow;
     return true;
 #else
-    if (!m_Stream.is_open() || !(m_OpenMode & (std::ios::in | std::ios::out)))
+    struct stat st;
+    if (::fstat(m_Fd, &st) != 0)
       return false;
-    std::fstream stream(m_Path, std::ios::ate | std::ios::binary);
-    const auto pos = m_OpenMode & std::ios::in ? m_Stream.tellg() : m_Stream.tellp();
-    if (!m_Stream.good())
-      return false;
-    length = pos;
+    length = st.st_size;
     return true;
 #endif
   }
@@ -89,15 +141,11 @@ namespace IO {
     newPosition = (((UInt64)(UInt32)high) << 32) + low;
     return true;
 #else
-    if (!m_Stream.is_open() || !(m_OpenMode & (std::ios::in | std::ios::out)) ||
-        (moveMethod != FILE_BEGIN && moveMethod != FILE_CURRENT && moveMethod != FILE_END))
+    if (moveMethod != FILE_BEGIN && moveMethod != FILE_CURRENT && moveMethod != FILE_END)
       return false;
-    const auto m = moveMethod == FILE_BEGIN ? std::ios::beg : moveMethod == FILE_CURRENT ? std::ios::cur : std::ios::end;
-    if (!m_Stream.good())
-      m_Stream.clear();
-    m_OpenMode & std::ios::in ? (void) m_Stream.seekg(distanceToMove, m) : (void) m_Stream.seekp(distanceToMove, m);
-    const auto pos = m_OpenMode & std::ios::in ? m_Stream.tellg() : m_Stream.tellp();
-    if (!m_Stream.good())
+    const int whence = moveMethod == FILE_BEGIN ? SEEK_SET : moveMethod == FILE_CURRENT ? SEEK_CUR : SEEK_END;
+    const off_t pos = ::lseek(m_Fd, distanceToMove, whence);
+    if (pos == (off_t)-1)
       return false;
     newPosition = pos;
     return true;
@@ -122,38 +170,71 @@ namespace IO {
       return false;
     }
 
+    m_Path = path;
     m_Handle = ::CreateFileW(path.c_str(), desiredAccess, shareMode,
       (LPSECURITY_ATTRIBUTES)NULL, creationDisposition, flagsAndAttributes, (HANDLE)NULL);
 
     return m_Handle != INVALID_HANDLE_VALUE;
   }
 #else
-  bool FileBase::Create(std::filesystem::path const& path, std::ios::openmode openMode) noexcept {
+  bool FileBase::Create(std::filesystem::path const& path, int flags, mode_t mode) noexcept {
+    return Create(AT_FDCWD, path, path, flags, mode);
+  }
+
+  bool FileBase::Create(int directory, std::filesystem::path const& name, std::filesystem::path const& fullPath,
+                        int flags, mode_t mode) noexcept {
     if (!Close()) {
       return false;
     }
 
-    m_Stream.open(m_Path = path, m_OpenMode = openMode | std::ios::binary);
-    std::cerr << "FIXME: FileBase::Create '" + path.string() + "'" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
-    return m_Stream.good();
+    m_Path = fullPath;
+    do {
+      m_Fd = ::openat(directory, name.c_str(), flags | O_CLOEXEC, mode);
+    } while (m_Fd == -1 && errno == EINTR);
+
+    return m_Fd != -1;
+  }
+#endif
+
+#ifndef _WIN32
+  UInt32 FileInfo::fileAttributes() const {
+    UInt32 attributes = kUnixExtension | (static_cast<UInt32>(m_FileInfo.st_mode) << 16);
+    if (S_ISDIR(m_FileInfo.st_mode)) {
+      attributes |= 0x10; // FILE_ATTRIBUTE_DIRECTORY
+    }
+    if (isReadOnly()) {
+      attributes |= kReadOnly;
+    }
+    return attributes;
   }
+
+  FILETIME FileInfo::creationTime() const { return to_filetime(m_FileInfo.st_ctim); }
+  FILETIME FileInfo::lastAccessTime() const { return to_filetime(m_FileInfo.st_atim); }
+  FILETIME FileInfo::lastWriteTime() const { return to_filetime(m_FileInfo.st_mtim); }
 #endif
 
   bool FileBase::GetFileInformation(std::filesystem::path const& path, FileInfo* info) noexcept {
-//    // Use FileBase to open/close the file:
-//    FileBase file;
-//    if (!file.Create(path, 0, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS))
-//      return false;
-//
-//    BY_HANDLE_FILE_INFORMATION finfo;
-//    if (!BOOLToBool(GetFileInformationByHandle(file.m_Handle, &finfo))) {
-//      return false;
-//    }
-//
-//    *info = FileInfo(path, finfo);
-//    return true;
-    std::cerr << "FIXME: Not implemented" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n"; assert(false && "Not implemented");
+#ifdef _WIN32
+    // Use FileBase to open/close the file:
+    FileBase file;
+    if (!file.Create(path, 0, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS))
+      return false;
+
+    BY_HANDLE_FILE_INFORMATION finfo;
+    if (!BOOLToBool(GetFileInformationByHandle(file.m_Handle, &finfo))) {
+      return false;
+    }
+
+    *info = FileInfo(path, finfo);
     return true;
+#else
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+      return false;
+    }
+    *info = FileInfo(path, st);
+    return true;
+#endif
   }
 
   // FileIn
@@ -171,7 +252,7 @@ namespace IO {
 #ifdef _WIN32
     return OpenShared(filepath, false);
 #else
-    return Create(filepath, std::ios::in);
+    return Create(filepath, O_RDONLY);
 #endif
   }
   bool FileIn::Read(void* data, UInt32 size, UInt32& processedSize) noexcept {
@@ -197,11 +278,12 @@ namespace IO {
     processedSize = (UInt32)processedLoc;
     return res;
 #else
-    if (!m_Stream.is_open() || !(m_OpenMode & std::ios::in))
-      return false;
-    m_Stream.read((char*)data, size);
-    processedSize = m_Stream.gcount();
-    return !m_Stream.bad();
+    ssize_t processedLoc;
+    do {
+      processedLoc = ::read(m_Fd, data, size);
+    } while (processedLoc == -1 && errno == EINTR);
+    processedSize = processedLoc > 0 ? (UInt32)processedLoc : 0;
+    return processedLoc != -1;
 #endif
   }
   bool FileIn::ReadPart(void* data, UInt32 size, UInt32& processedSize) noexcept {
@@ -210,6 +292,48 @@ namespace IO {
     return Read1(data, size, processedSize);
   }
 
+  bool FileIn::ReadAt(UInt64 offset, void* data, UInt32 size, UInt32& processedSize) const noexcept {
+    processedSize = 0;
+    while (size > 0) {
+      const UInt32 chunk = std::min(size, kChunkSizeMax);
+#ifdef _WIN32
+      // With an explicit offset, ReadFile() does not depend on the file pointer:
+      OVERLAPPED overlapped{};
+      overlapped.Offset = static_cast<DWORD>(offset);
+      overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      DWORD processedLoc = 0;
+      if (!::ReadFile(m_Handle, data, chunk, &processedLoc, &overlapped)) {
+        if (::GetLastError() == ERROR_HANDLE_EOF) {
+          return true;
+        }
+        return false;
+      }
+#else
+      ssize_t processedLoc;
+      do {
+        processedLoc = ::pread(m_Fd, data, chunk, static_cast<off_t>(offset));
+      } while (processedLoc == -1 && errno == EINTR);
+      if (processedLoc == -1) {
+        return false;
+      }
+#endif
+      if (processedLoc == 0) {
+        return true;
+      }
+      processedSize += static_cast<UInt32>(processedLoc);
+      offset += processedLoc;
+      data = static_cast<unsigned char*>(data) + processedLoc;
+      size -= static_cast<UInt32>(processedLoc);
+    }
+    return true;
+  }
+
+  void FileIn::AdviseSequential(bool sequential) const noexcept {
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(m_Fd, 0, 0, sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+#endif
+  }
+
   // FileOut
 
 #ifdef _WIN32
@@ -222,21 +346,388 @@ namespace IO {
 #ifdef _WIN32
     return Open(fileName, FILE_SHARE_READ, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL);
 #else
-    return Create(fileName, std::ios::out);
+    return Create(fileName, O_WRONLY | O_CREAT | O_TRUNC);
+#endif
+  }
+
+  bool FileOut::OpenNew(std::filesystem::path const& fileName) noexcept {
+#ifdef _WIN32
+    return Open(fileName, FILE_SHARE_READ, CREATE_NEW, FILE_ATTRIBUTE_NORMAL);
+#else
+    return Create(fileName, O_WRONLY | O_CREAT | O_EXCL);
+#endif
+  }
+
+  namespace {
+    std::filesystem::path temporary_path(std::filesystem::path const& fileName, unsigned attempt) {
+      static std::atomic<unsigned> counter{ 0 };
+      auto name = fileName.filename().native();
+#ifdef _WIN32
+      name = L"." + name + L".tmp" + std::to_wstring(::GetCurrentProcessId())
+        + L"-" + std::to_wstring(counter++) + L"-" + std::to_wstring(attempt);
+#else
+      name = "." + name + ".tmp" + std::to_string(::getpid())
+        + "-" + std::to_string(counter++) + "-" + std::to_string(attempt);
+#endif
+      return fileName.parent_path() / name;
+    }
+
+    bool last_error_is_exists() {
+#ifdef _WIN32
+      return ::GetLastError() == ERROR_FILE_EXISTS;
+#else
+      return errno == EEXIST;
+#endif
+    }
+
+#if defined(__linux__) && defined(O_TMPFILE)
+    // Anonymous files are published through /proc (see FileOut::Publish()), which is not
+    // mounted in some chroots and sandboxes:
+    bool proc_fd_available() {
+      static const bool available = ::access("/proc/self/fd", X_OK) == 0;
+      return available;
+    }
+#endif
+  }
+
+  bool FileOut::OpenTemporary(std::filesystem::path const& fileName) noexcept {
+#ifdef _WIN32
+    Discard();
+
+    constexpr unsigned maxAttempts = 16;
+    for (unsigned attempt = 0; attempt < maxAttempts; ++attempt) {
+      auto path = temporary_path(fileName, attempt);
+      if (OpenNew(path)) {
+        m_Target = fileName;
+        m_TemporaryPath = path;
+        m_Temporary = true;
+        return true;
+      }
+      if (!last_error_is_exists()) {
+        return false;
+      }
+    }
+    return false;
+#else
+    return OpenTemporary(AT_FDCWD, {}, fileName);
+#endif
+  }
+
+#ifndef _WIN32
+  bool FileOut::Open(Directory const& directory, std::filesystem::path const& fileName) noexcept {
+    return Create(directory.Descriptor(), fileName, directory.Path() / fileName, O_WRONLY | O_CREAT | O_TRUNC);
+  }
+
+  bool FileOut::OpenNew(Directory const& directory, std::filesystem::path const& fileName) noexcept {
+    return Create(directory.Descriptor(), fileName, directory.Path() / fileName, O_WRONLY | O_CREAT | O_EXCL);
+  }
+
+  bool FileOut::OpenTemporary(Directory const& directory, std::filesystem::path const& fileName) noexcept {
+    return OpenTemporary(directory.Descriptor(), directory.Path(), fileName);
+  }
+
+  bool FileOut::OpenExisting(Directory const& directory, std::filesystem::path const& fileName) noexcept {
+    return Create(directory.Descriptor(), fileName, directory.Path() / fileName, O_WRONLY);
+  }
+
+  bool FileOut::OpenTemporary(int directory, std::filesystem::path const& directoryPath,
+                              std::filesystem::path const& fileName) noexcept {
+    Discard();
+
+    // Publish() works on full paths since the directory may be closed by then:
+    const auto target = directoryPath / fileName;
+
+#if defined(__linux__) && defined(O_TMPFILE)
+    if (proc_fd_available()) {
+      const auto parent = fileName.has_parent_path() ? fileName.parent_path() : std::filesystem::path(".");
+      if (Create(directory, parent, target, O_WRONLY | O_TMPFILE)) {
+        m_Target = target;
+        m_TemporaryPath.clear();
+        m_Temporary = true;
+        return true;
+      }
+      // Not supported by the kernel or the filesystem, fall back to a named file:
+      if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+        return false;
+      }
+    }
+#endif
+
+    constexpr unsigned maxAttempts = 16;
+    for (unsigned attempt = 0; attempt < maxAttempts; ++attempt) {
+      auto path = temporary_path(fileName, attempt);
+      if (Create(directory, path, directoryPath / path, O_WRONLY | O_CREAT | O_EXCL)) {
+        m_Target = target;
+        m_TemporaryPath = directoryPath / path;
+        m_Temporary = true;
+        return true;
+      }
+      if (!last_error_is_exists()) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  // Directory
+
+  bool Directory::Open(std::filesystem::path const& path) noexcept {
+    if (!Close()) {
+      return false;
+    }
+    m_Path = path;
+    m_Fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return m_Fd != -1;
+  }
+
+  bool Directory::Open(Directory const& parent, std::filesystem::path const& name, bool create) noexcept {
+    if (!Close()) {
+      return false;
+    }
+    if (create && ::mkdirat(parent.m_Fd, name.c_str(), 0777) != 0 && errno != EEXIST) {
+      return false;
+    }
+    m_Path = parent.m_Path / name;
+    m_Fd = ::openat(parent.m_Fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return m_Fd != -1;
+  }
+
+  bool Directory::Close() noexcept {
+    if (m_Fd == -1)
+      return true;
+    int res = ::close(m_Fd);
+    m_Fd = -1;
+    return res == 0;
+  }
+
+  bool Directory::Stat(std::filesystem::path const& name, struct stat& st) const noexcept {
+    return ::fstatat(m_Fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+  }
+
+  bool Directory::Remove(std::filesystem::path const& name) const noexcept {
+    if (::unlinkat(m_Fd, name.c_str(), 0) == 0) {
+      return true;
+    }
+    if (errno != EISDIR && errno != EPERM) {
+      return false;
+    }
+    return ::unlinkat(m_Fd, name.c_str(), AT_REMOVEDIR) == 0;
+  }
+
+  bool Directory::Symlink(std::filesystem::path const& target, std::filesystem::path const& name) const noexcept {
+    return ::symlinkat(target.c_str(), m_Fd, name.c_str()) == 0;
+  }
+
+  bool Directory::SetTime(std::filesystem::path const& name, const FILETIME* mTime) const noexcept {
+    timespec times[2] = { to_timespec(nullptr), to_timespec(mTime) };
+    return ::utimensat(m_Fd, name.c_str(), times, AT_SYMLINK_NOFOLLOW) == 0;
+  }
+#endif
+
+  bool FileOut::Publish() noexcept {
+    if (!m_Temporary) {
+      return true;
+    }
+
+#ifdef _WIN32
+    if (!Close()) {
+      return false;
+    }
+    if (!::MoveFileExW(m_TemporaryPath.c_str(), m_Target.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+      return false;
+    }
+#else
+    if (m_TemporaryPath.empty()) {
+      // Anonymous file: give it a name through /proc. If the target already exists, the
+      // file is linked under a temporary name and renamed over the target instead.
+      const std::string procPath = "/proc/self/fd/" + std::to_string(m_Fd);
+      if (::linkat(AT_FDCWD, procPath.c_str(), AT_FDCWD, m_Target.c_str(), AT_SYMLINK_FOLLOW) != 0) {
+        if (errno != EEXIST) {
+          return false;
+        }
+        constexpr unsigned maxAttempts = 16;
+        std::filesystem::path path;
+        bool linked = false;
+        for (unsigned attempt = 0; !linked && attempt < maxAttempts; ++attempt) {
+          path = temporary_path(m_Target, attempt);
+          linked = ::linkat(AT_FDCWD, procPath.c_str(), AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == 0;
+          if (!linked && errno != EEXIST) {
+            return false;
+          }
+        }
+        if (!linked) {
+          return false;
+        }
+        if (::rename(path.c_str(), m_Target.c_str()) != 0) {
+          const int error = errno;
+          ::unlink(path.c_str());
+          errno = error;
+          return false;
+        }
+      }
+    }
+    else if (::rename(m_TemporaryPath.c_str(), m_Target.c_str()) != 0) {
+      return false;
+    }
+    m_Path = m_Target;
 #endif
+
+    m_Temporary = false;
+    m_TemporaryPath.clear();
+    return true;
+  }
+
+  void FileOut::Discard() noexcept {
+    if (!m_Temporary) {
+      return;
+    }
+    Close();
+    if (!m_TemporaryPath.empty()) {
+      std::error_code ec;
+      std::filesystem::remove(m_TemporaryPath, ec);
+    }
+    m_Temporary = false;
+    m_TemporaryPath.clear();
   }
 
   bool FileOut::SetTime(const FILETIME* cTime, const FILETIME* aTime, const FILETIME* mTime) noexcept {
 #ifdef _WIN32
     return BOOLToBool(::SetFileTime(m_Handle, cTime, aTime, mTime));
 #else
-    std::cerr << "FIXME: Not implemented FileOut::SetTime" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
-    return true;
+    timespec times[2] = { to_timespec(aTime), to_timespec(mTime) };
+    return ::futimens(m_Fd, times) == 0;
 #endif
   }
   bool FileOut::SetMTime(const FILETIME* mTime) noexcept {
     return SetTime(NULL, NULL, mTime);
   }
+
+#ifndef _WIN32
+  bool FileOut::SetAttributes(UInt32 attributes, mode_t umask) noexcept {
+    struct stat st;
+    if (!(attributes & kUnixExtension)) {
+      if (!(attributes & kReadOnly)) {
+        return true;
+      }
+      if (::fstat(m_Fd, &st) != 0) {
+        return false;
+      }
+    }
+    return ::fchmod(m_Fd, to_mode(attributes, st.st_mode, umask)) == 0;
+  }
+
+  bool set_mtime(std::filesystem::path const& path, const FILETIME* mTime) noexcept {
+    timespec times[2] = { to_timespec(nullptr), to_timespec(mTime) };
+    return ::utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+  }
+
+  bool set_attributes(std::filesystem::path const& path, UInt32 attributes, mode_t umask) noexcept {
+    struct stat st;
+    if (!(attributes & kUnixExtension)) {
+      if (!(attributes & kReadOnly)) {
+        return true;
+      }
+      if (::stat(path.c_str(), &st) != 0) {
+        return false;
+      }
+    }
+    return ::chmod(path.c_str(), to_mode(attributes, st.st_mode, umask)) == 0;
+  }
+
+  mode_t current_umask() noexcept {
+    const mode_t mask = ::umask(0);
+    ::umask(mask);
+    return mask;
+  }
+#endif
+
+  bool disk_space(std::filesystem::path const& path, UInt64& available, UInt64& blockSize) noexcept {
+#ifdef _WIN32
+    ULARGE_INTEGER freeBytes;
+    if (!::GetDiskFreeSpaceExW(path.c_str(), &freeBytes, nullptr, nullptr)) {
+      return false;
+    }
+    available = freeBytes.QuadPart;
+    // Default NTFS cluster size, the exact value does not matter much for estimates:
+    blockSize = 4096;
+    return true;
+#else
+    struct statvfs st;
+    if (::statvfs(path.c_str(), &st) != 0) {
+      return false;
+    }
+    blockSize = st.f_frsize;
+    available = static_cast<UInt64>(st.f_bavail) * st.f_frsize;
+    return true;
+#endif
+  }
+
+  bool prefetch_file(std::filesystem::path const& path, std::stop_token stop) noexcept {
+#ifdef _WIN32
+    FileIn file;
+    if (!file.Open(path, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN)) {
+      return false;
+    }
+    // The data is only read to get it cached:
+    std::vector<unsigned char> buffer(1 << 20);
+    UInt32 read = 0;
+    do {
+      if (!file.Read(buffer.data(), static_cast<UInt32>(buffer.size()), read)) {
+        return false;
+      }
+    } while (read > 0 && !stop.stop_requested());
+    return true;
+#else
+    if (stop.stop_requested()) {
+      return true;
+    }
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+    const int res = ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    ::close(fd);
+    if (res != 0) {
+      errno = res;
+      return false;
+    }
+    return true;
+#endif
+  }
+
+  bool sync_directory(std::filesystem::path const& path) noexcept {
+#ifdef _WIN32
+    return true;
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+    int res;
+    do {
+      res = ::fsync(fd);
+    } while (res == -1 && errno == EINTR);
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    return res == 0;
+#endif
+  }
+
+#ifdef __linux__
+  bool sync_filesystem(std::filesystem::path const& path) noexcept {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+    const int res = ::syncfs(fd);
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    return res == 0;
+  }
+#endif
+
   bool FileOut::Write(const void* data, UInt32 size, UInt32& processedSize) noexcept {
     processedSize = 0;
     do
@@ -266,20 +757,165 @@ namespace IO {
 #ifdef _WIN32
     return BOOLToBool(::SetEndOfFile(m_Handle));
 #else
-    if (!m_Stream.is_open() || !(m_OpenMode & std::ios::out))
-      return false;
-    m_Stream.flush();
-    if (!m_Stream.good())
-      return false;
     UInt64 pos;
     if (!GetPosition(pos))
       return false;
-    std::error_code ec;
-    std::filesystem::resize_file(m_Path, pos, ec);
-    return !ec;
+    return ::ftruncate(m_Fd, pos) == 0;
+#endif
+  }
+
+#ifdef __linux__
+  bool FileOut::Allocate(UInt64 length) noexcept {
+    int res;
+    do {
+      res = ::fallocate(m_Fd, 0, 0, static_cast<off_t>(length));
+    } while (res == -1 && errno == EINTR);
+    return res == 0;
+  }
+#endif
+
+  void FileOut::ReleaseCache(UInt64 position) noexcept {
+#ifndef _WIN32
+    if ((!m_CacheBypass && !m_Writeback) || m_Fd == -1)
+      return;
+    while (position - m_CacheWindowStart >= kCacheWindowSize) {
+      ::sync_file_range(m_Fd, m_CacheWindowStart, kCacheWindowSize, SYNC_FILE_RANGE_WRITE);
+      if (m_CacheBypass && m_CacheWindowStart >= kCacheWindowSize) {
+        const UInt64 previous = m_CacheWindowStart - kCacheWindowSize;
+        ::sync_file_range(m_Fd, previous, kCacheWindowSize,
+          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        ::posix_fadvise(m_Fd, previous, kCacheWindowSize, POSIX_FADV_DONTNEED);
+      }
+      m_CacheWindowStart += kCacheWindowSize;
+    }
+#endif
+  }
+
+  void FileOut::ReleaseCache() noexcept {
+#ifndef _WIN32
+    if ((!m_CacheBypass && !m_Writeback) || m_Fd == -1)
+      return;
+    if (!m_CacheBypass) {
+      ::sync_file_range(m_Fd, m_CacheWindowStart, 0, SYNC_FILE_RANGE_WRITE);
+      m_CacheWindowStart = 0;
+      return;
+    }
+    ::sync_file_range(m_Fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    ::posix_fadvise(m_Fd, 0, 0, POSIX_FADV_DONTNEED);
+    m_CacheWindowStart = 0;
 #endif
   }
 
+  bool FileOut::Sync() noexcept {
+#ifdef _WIN32
+    return BOOLToBool(::FlushFileBuffers(m_Handle));
+#else
+    int res;
+    do {
+      res = ::fsync(m_Fd);
+    } while (res == -1 && errno == EINTR);
+    return res == 0;
+#endif
+  }
+
+#ifndef _WIN32
+  bool FileOut::CopyFrom(FileIn const& source, UInt64 offset, UInt64 size, CopyState* state) noexcept {
+#ifdef __linux__
+    if (state && state->Clone && !clone(source, offset, size, *state)) {
+      return false;
+    }
+    bool useCopyFileRange = true;
+#endif
+    const UInt64 copySize = size;
+    while (size > 0) {
+      const std::size_t chunk = static_cast<std::size_t>(std::min<UInt64>(size, kChunkSizeMax));
+      ssize_t copied;
+#ifdef __linux__
+      if (useCopyFileRange) {
+        loff_t inOffset = offset;
+        copied = ::copy_file_range(source.Descriptor(), &inOffset, m_Fd, nullptr, chunk, 0);
+        if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+          useCopyFileRange = false;
+          continue;
+        }
+      }
+      else {
+        off_t inOffset = offset;
+        copied = ::sendfile(m_Fd, source.Descriptor(), &inOffset, chunk);
+      }
+#else
+      std::vector<unsigned char> buffer(chunk);
+      copied = ::pread(source.Descriptor(), buffer.data(), chunk, offset);
+      if (copied > 0) {
+        UInt32 processedSize;
+        if (!Write(buffer.data(), static_cast<UInt32>(copied), processedSize)) {
+          return false;
+        }
+      }
+#endif
+      if (copied == -1 && errno == EINTR) {
+        continue;
+      }
+      if (copied <= 0) {
+        // The source is shorter than expected:
+        if (copied == 0) {
+          errno = EIO;
+        }
+        return false;
+      }
+      offset += copied;
+      size -= copied;
+    }
+    if (state) {
+      state->Copied += copySize;
+    }
+    return true;
+  }
+#endif
+
+#ifdef __linux__
+  bool FileOut::clone(FileIn const& source, UInt64& offset, UInt64& size, CopyState& state) noexcept {
+    // Clones are made of blocks of the destination filesystem:
+    struct statvfs vfs;
+    struct stat st;
+    UInt64 position;
+    if (::fstatvfs(m_Fd, &vfs) != 0 || vfs.f_bsize == 0 || ::fstat(source.Descriptor(), &st) != 0
+        || !GetPosition(position)) {
+      return true;
+    }
+
+    // Both ends must be aligned, and the length too unless it goes to the end of the source:
+    const UInt64 block = vfs.f_bsize;
+    const bool toEnd = offset + size == static_cast<UInt64>(st.st_size);
+    const UInt64 length = toEnd ? size : size / block * block;
+    if (offset % block != 0 || position % block != 0 || length == 0) {
+      return true;
+    }
+
+    file_clone_range range{};
+    range.src_fd = source.Descriptor();
+    range.src_offset = offset;
+    range.src_length = length;
+    range.dest_offset = position;
+    if (::ioctl(m_Fd, FICLONERANGE, &range) != 0) {
+      if (errno == EOPNOTSUPP || errno == EXDEV || errno == ENOTTY || errno == EBADF) {
+        state.Clone = false;
+      }
+      return true;
+    }
+
+    // Cloning does not move the file pointer:
+    UInt64 newPosition;
+    if (!Seek(position + length, newPosition)) {
+      return false;
+    }
+    state.Cloned += length;
+    offset += length;
+    size -= length;
+    return true;
+  }
+#endif
+
   bool FileOut::WritePart(const void* data, UInt32 size, UInt32& processedSize) noexcept {
     if (size > kChunkSizeMax)
       size = kChunkSizeMax;
@@ -289,11 +925,12 @@ namespace IO {
     processedSize = (UInt32)processedLoc;
     return res;
 #else
-    if (!m_Stream.is_open() || !(m_OpenMode & std::ios::out))
-      return false;
-    m_Stream.write((char*)data, size);
-    processedSize = size;
-    return !m_Stream.bad();
+    ssize_t processedLoc;
+    do {
+      processedLoc = ::write(m_Fd, data, size);
+    } while (processedLoc == -1 && errno == EINTR);
+    processedSize = processedLoc > 0 ? (UInt32)processedLoc : 0;
+    return processedLoc != -1;
 #endif
   }
 
@@ -29,15 +29,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <cassert> // UNUSED
 #include <iostream> // UNUSED
+#include <cerrno>
 #include <filesystem>
+#include <stop_token>
 #include <string>
-#ifndef _WIN32
-#include <fstream>
-#endif
+#include <system_error>
+#include <utility>
 
 #include "pathstr.h"
 
 #ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #define FILE_BEGIN 0
 #define FILE_CURRENT 1
 #define FILE_END 2
@@ -52,13 +56,13 @@ namespace IO {
   class FileInfo {
   public:
 
-    FileInfo() : m_Valid{ false } {};
+    FileInfo() : m_Valid{ false }, m_FileInfo{} {};
 #ifdef _WIN32
     FileInfo(std::filesystem::path const& path, BY_HANDLE_FILE_INFORMATION fileInfo) :
       m_Valid{ true }, m_Path(path), m_FileInfo{ fileInfo } { }
 #else
-    FileInfo(std::filesystem::path const& path) :
-      m_Valid{ true }, m_Path(path), m_FileInfo{ std::filesystem::status(path) } { }
+    FileInfo(std::filesystem::path const& path, struct stat const& fileInfo) :
+      m_Valid{ true }, m_Path(path), m_FileInfo{ fileInfo } { }
 #endif
 
     bool isValid() const { return m_Valid; }
@@ -88,27 +92,18 @@ namespace IO {
     bool isSystem() const { return MatchesMask(FILE_ATTRIBUTE_SYSTEM); }
     bool isTemporary() const { return MatchesMask(FILE_ATTRIBUTE_TEMPORARY); }
 #else
-//    UInt32 fileAttributes() const { return m_FileInfo.dwFileAttributes; }
-//    FILETIME creationTime() const { return m_FileInfo.ftCreationTime; }
-//    FILETIME lastAccessTime() const { return m_FileInfo.ftLastAccessTime; }
-//    FILETIME lastWriteTime() const { return m_FileInfo.ftLastWriteTime; }
-//    UInt32 volumeSerialNumber() const { return m_FileInfo.dwVolumeSerialNumber; }
-    UInt64 fileSize() const { return std::filesystem::file_size(m_Path); }
-//    UInt32 numberOfLinks() const { return m_FileInfo.nNumberOfLinks; }
-//    UInt64 fileInfex() const { return ((UInt64)m_FileInfo.nFileIndexHigh) << 32 | m_FileInfo.nFileIndexLow; }
-//
-//    bool isArchived() const { return MatchesMask(FILE_ATTRIBUTE_ARCHIVE); }
-//    bool isCompressed() const { return MatchesMask(FILE_ATTRIBUTE_COMPRESSED); }
-    bool isDir() const { return std::filesystem::is_directory(m_FileInfo); }
-//    bool isEncrypted() const { return MatchesMask(FILE_ATTRIBUTE_ENCRYPTED); }
-//    bool isHidden() const { return MatchesMask(FILE_ATTRIBUTE_HIDDEN); }
-//    bool isNormal() const { return MatchesMask(FILE_ATTRIBUTE_NORMAL); }
-//    bool isOffline() const { return MatchesMask(FILE_ATTRIBUTE_OFFLINE); }
-//    bool isReadOnly() const { return MatchesMask(FILE_ATTRIBUTE_READONLY); }
-//    bool iasReparsePoint() const { return MatchesMask(FILE_ATTRIBUTE_REPARSE_POINT); }
-//    bool isSparse() const { return MatchesMask(FILE_ATTRIBUTE_SPARSE_FILE); }
-//    bool isSystem() const { return MatchesMask(FILE_ATTRIBUTE_SYSTEM); }
-//    bool isTemporary() const { return MatchesMask(FILE_ATTRIBUTE_TEMPORARY); }
+    // Unix permissions and file type in the upper 16 bits (FILE_ATTRIBUTE_UNIX_EXTENSION), as
+    // stored by 7z:
+    UInt32 fileAttributes() const;
+    // Time of the last status change, there is no creation time:
+    FILETIME creationTime() const;
+    FILETIME lastAccessTime() const;
+    FILETIME lastWriteTime() const;
+    UInt64 fileSize() const { return static_cast<UInt64>(m_FileInfo.st_size); }
+    UInt32 numberOfLinks() const { return static_cast<UInt32>(m_FileInfo.st_nlink); }
+
+    bool isDir() const { return S_ISDIR(m_FileInfo.st_mode); }
+    bool isReadOnly() const { return (m_FileInfo.st_mode & 0222) == 0; }
 #endif
 
   private:
@@ -120,28 +115,92 @@ namespace IO {
 #ifdef _WIN32
     BY_HANDLE_FILE_INFORMATION m_FileInfo;
 #else
-    std::filesystem::file_status m_FileInfo;
+    struct stat m_FileInfo;
 #endif
   };
 
+#ifndef _WIN32
+  /**
+   * Open directory, used to resolve paths relative to it (openat(), mkdirat(), ...) so the
+   * kernel does not walk the full path of each file that is created in it.
+   */
+  class Directory {
+  public:
+
+    Directory() noexcept : m_Fd{ -1 } { }
+
+    Directory(Directory&& other) noexcept :
+        m_Fd{ std::exchange(other.m_Fd, -1) },
+        m_Path{ std::move(other.m_Path) } { }
+
+    ~Directory() noexcept {
+      Close();
+    }
+
+    Directory(Directory const&) = delete;
+    Directory& operator=(Directory const&) = delete;
+    Directory& operator=(Directory&&) = delete;
+
+    bool Open(std::filesystem::path const& path) noexcept;
+
+    /**
+     * @brief Open the given subdirectory of parent.
+     *
+     * @param name Name of the subdirectory, relative to parent.
+     * @param create If true, the subdirectory is created if it does not exist.
+     */
+    bool Open(Directory const& parent, std::filesystem::path const& name, bool create) noexcept;
+
+    bool Close() noexcept;
+
+    /**
+     * @brief Retrieve the status of the given entry, without following symbolic links.
+     */
+    bool Stat(std::filesystem::path const& name, struct stat& st) const noexcept;
+
+    /**
+     * @brief Remove the given entry, which must be a file or an empty directory.
+     */
+    bool Remove(std::filesystem::path const& name) const noexcept;
+
+    /**
+     * @brief Create a symbolic link named name pointing to target, which is stored as-is.
+     */
+    bool Symlink(std::filesystem::path const& target, std::filesystem::path const& name) const noexcept;
+
+    /**
+     * @brief Set the modification time of the given entry, without following symbolic links.
+     */
+    bool SetTime(std::filesystem::path const& name, const FILETIME* mTime) const noexcept;
+
+    int Descriptor() const noexcept { return m_Fd; }
+    const std::filesystem::path& Path() const noexcept { return m_Path; }
+
+  private:
+    int m_Fd;
+    std::filesystem::path m_Path;
+  };
+#endif
+
   class FileBase {
   public: // Constructors, destructor, assignment.
 
 #ifdef _WIN32
     FileBase() noexcept : m_Handle{ INVALID_HANDLE_VALUE } { }
 
-    FileBase(FileBase&& other) noexcept : m_Handle{ other.m_Handle } {
+    FileBase(FileBase&& other) noexcept :
+        m_Handle{ other.m_Handle },
+        m_Path{ std::move(other.m_Path) } {
       other.m_Handle = INVALID_HANDLE_VALUE;
+      other.m_Path = std::filesystem::path();
     }
 #else
-    FileBase() noexcept : m_OpenMode{} { }
+    FileBase() noexcept : m_Fd{ -1 } { }
 
     FileBase(FileBase&& other) noexcept :
-        m_Stream{ std::move(other.m_Stream) },
-        m_OpenMode{ std::move(other.m_OpenMode) },
+        m_Fd{ other.m_Fd },
         m_Path{ std::move(other.m_Path) } {
-      other.m_Stream = std::fstream();
-      other.m_OpenMode = std::ios_base::openmode();
+      other.m_Fd = -1;
       other.m_Path = std::filesystem::path();
     }
 #endif
@@ -166,6 +225,29 @@ namespace IO {
     bool SeekToBegin() noexcept;
     bool SeekToEnd(UInt64& newPosition) noexcept;
 
+#ifndef _WIN32
+    /**
+     * @return the underlying file descriptor, or -1 if the file is not open.
+     */
+    int Descriptor() const noexcept { return m_Fd; }
+
+    /**
+     * @brief Release ownership of the underlying file descriptor without closing it.
+     *
+     * @return the file descriptor, or -1 if the file was not open.
+     */
+    int Detach() noexcept {
+      int fd = m_Fd;
+      m_Fd = -1;
+      return fd;
+    }
+#endif
+
+    /**
+     * @return the path this file was opened with.
+     */
+    const std::filesystem::path& Path() const noexcept { return m_Path; }
+
     // Note: Only the static version (unlike in 7z) because I want FileInfo to hold the
     // path to the file, and the non-static version is never used (except by the static
     // version).
@@ -176,7 +258,12 @@ namespace IO {
 #ifdef _WIN32
     bool Create(std::filesystem::path const& path, DWORD desiredAccess, DWORD shareMode, DWORD creationDisposition, DWORD flagsAndAttributes) noexcept;
 #else
-    bool Create(std::filesystem::path const& path, std::ios::openmode openMode) noexcept;
+    bool Create(std::filesystem::path const& path, int flags, mode_t mode = 0666) noexcept;
+
+    // Create relative to the given directory descriptor (or AT_FDCWD), fullPath is only
+    // used for Path():
+    bool Create(int directory, std::filesystem::path const& name, std::filesystem::path const& fullPath,
+                int flags, mode_t mode = 0666) noexcept;
 #endif
 
   protected:
@@ -186,10 +273,9 @@ namespace IO {
 #ifdef _WIN32
     HANDLE m_Handle;
 #else
-    mutable std::fstream m_Stream;
-    std::ios::openmode m_OpenMode;
-    std::filesystem::path m_Path;
+    int m_Fd;
 #endif
+    std::filesystem::path m_Path;
 
   };
 
@@ -207,15 +293,59 @@ namespace IO {
 
     bool Read(void* data, UInt32 size, UInt32& processedSize) noexcept;
 
+    /**
+     * @brief Read at the given offset, without using the file position, so the same file
+     *   can be read from several threads.
+     *
+     * This reads until size bytes are read or the end of the file is reached. The file
+     * position is left untouched on POSIX, but Windows moves it after the bytes read, so
+     * this should not be mixed with Read() and Seek() on the same file.
+     */
+    bool ReadAt(UInt64 offset, void* data, UInt32 size, UInt32& processedSize) const noexcept;
+
+    /**
+     * @brief Tell the system if the file is read sequentially, so it reads ahead more
+     *   aggressively (posix_fadvise). This is a no-op on Windows.
+     */
+    void AdviseSequential(bool sequential) const noexcept;
+
   protected:
     bool Read1(void* data, UInt32 size, UInt32& processedSize) noexcept;
     bool ReadPart(void* data, UInt32 size, UInt32& processedSize) noexcept;
   };
 
+#ifndef _WIN32
+  /**
+   * Options and statistics of FileOut::CopyFrom().
+   */
+  struct CopyState {
+    // Clone block-aligned data instead of copying it. This is reset once the filesystem
+    // reports that it does not support cloning.
+    bool Clone = false;
+
+    UInt64 Cloned = 0;
+    UInt64 Copied = 0;
+  };
+#endif
+
   class FileOut : public FileBase {
   public:
     using FileBase::FileBase;
 
+    FileOut(FileOut&& other) noexcept :
+        FileBase(std::move(other)),
+        m_CacheBypass{ other.m_CacheBypass },
+        m_Writeback{ other.m_Writeback },
+        m_CacheWindowStart{ other.m_CacheWindowStart },
+        m_Temporary{ std::exchange(other.m_Temporary, false) },
+        m_Target{ std::move(other.m_Target) },
+        m_TemporaryPath{ std::move(other.m_TemporaryPath) } { }
+
+    // Temporary files that were not published are removed.
+    ~FileOut() noexcept {
+      Discard();
+    }
+
   public: // Operations:
 
 #ifdef _WIN32
@@ -223,17 +353,160 @@ namespace IO {
 #endif
     bool Open(std::filesystem::path const& fileName) noexcept;
 
+    /**
+     * @brief Create the given file, failing if it already exists.
+     */
+    bool OpenNew(std::filesystem::path const& fileName) noexcept;
+
+    /**
+     * @brief Create a temporary file that will replace the given file once published.
+     *
+     * On Linux, this uses an anonymous O_TMPFILE file in the directory of fileName, so nothing is
+     * visible until Publish() is called. Elsewhere, or if the filesystem does not support
+     * O_TMPFILE, a hidden temporary file is created next to fileName instead.
+     */
+    bool OpenTemporary(std::filesystem::path const& fileName) noexcept;
+
+#ifndef _WIN32
+    // Same as above, with fileName relative to the given directory:
+    bool Open(Directory const& directory, std::filesystem::path const& fileName) noexcept;
+    bool OpenNew(Directory const& directory, std::filesystem::path const& fileName) noexcept;
+    bool OpenTemporary(Directory const& directory, std::filesystem::path const& fileName) noexcept;
+
+    /**
+     * @brief Open an existing file for writing, keeping its content and allocation.
+     */
+    bool OpenExisting(Directory const& directory, std::filesystem::path const& fileName) noexcept;
+#endif
+
+    /**
+     * @brief Atomically move a temporary file to its final path, replacing any existing file.
+     *
+     * This does nothing for files that were not opened with OpenTemporary(). The file may be
+     * closed by this call, but Close() must still be called.
+     */
+    bool Publish() noexcept;
+
+    /**
+     * @brief Close a temporary file without publishing it, and remove it.
+     *
+     * This does nothing for files that were not opened with OpenTemporary().
+     */
+    void Discard() noexcept;
+
+    // Note: On Linux, the creation time cannot be set and is ignored.
     bool SetTime(const FILETIME* cTime, const FILETIME* aTime, const FILETIME* mTime) noexcept;
     bool SetMTime(const FILETIME* mTime) noexcept;
+
+#ifndef _WIN32
+    /**
+     * @brief Set the permissions of this file from 7z attributes.
+     *
+     * If the attributes contain POSIX permissions (FILE_ATTRIBUTE_UNIX_EXTENSION), these are
+     * used without the setuid, setgid and sticky bits and with the given umask applied,
+     * otherwise only FILE_ATTRIBUTE_READONLY is taken into account.
+     *
+     * @param umask The umask of the process, see current_umask().
+     */
+    bool SetAttributes(UInt32 attributes, mode_t umask) noexcept;
+#endif
     bool Write(const void* data, UInt32 size, UInt32& processedSize) noexcept;
 
 
     bool SetLength(UInt64 length) noexcept;
     bool SetEndOfFile() noexcept;
 
+#ifdef __linux__
+    /**
+     * @brief Allocate the disk blocks of the first length bytes of the file (fallocate),
+     *   extending it if needed.
+     */
+    bool Allocate(UInt64 length) noexcept;
+#endif
+
+    /**
+     * @brief Keep the content of this file out of the page cache.
+     *
+     * When enabled, ReleaseCache() flushes written data to disk in windows of kCacheWindowSize
+     * bytes and drops the flushed pages from the cache. This is a no-op on Windows.
+     */
+    void SetCacheBypass(bool enabled) noexcept { m_CacheBypass = enabled; }
+    bool CacheBypass() const noexcept { return m_CacheBypass; }
+
+    /**
+     * @brief Start writing data back to disk while the file is being written.
+     *
+     * When enabled, ReleaseCache() starts writeback (without waiting for it) for each full
+     * window of kCacheWindowSize bytes, and for the rest of the file at the end, so a later sync
+     * has less to wait for. This is a no-op on Windows.
+     */
+    void SetWriteback(bool enabled) noexcept { m_Writeback = enabled; }
+
+    /**
+     * @brief Flush the content and metadata of this file to disk (fsync).
+     */
+    bool Sync() noexcept;
+
+#ifndef _WIN32
+    /**
+     * @brief Copy a range of the given file at the current position of this file, without
+     *   going through user space.
+     *
+     * On Linux, this uses copy_file_range() (which may share the data on filesystems that
+     * support it) and falls back to sendfile() when the files cannot be used with it, e.g. on
+     * older kernels when they are on different filesystems.
+     *
+     * @param state If not null, the block-aligned part of the range is cloned (FICLONERANGE)
+     *   if state->Clone is set, and the number of cloned and copied bytes are added to state.
+     */
+    bool CopyFrom(FileIn const& source, UInt64 offset, UInt64 size, CopyState* state = nullptr) noexcept;
+#endif
+
+    /**
+     * @brief Release the cached pages of the data written before the given position.
+     *
+     * Writeback is started for every full window before position, and the pages of the window
+     * before that are waited for and dropped, so this only blocks on data written a while ago.
+     *
+     * @param position End of the data written so far.
+     */
+    void ReleaseCache(UInt64 position) noexcept;
+
+    /**
+     * @brief Flush the whole file and drop all its pages from the cache.
+     *
+     * If only writeback is enabled, this starts writeback of the rest of the file instead.
+     */
+    void ReleaseCache() noexcept;
+
   protected: // Protected Operations:
 
+#ifndef _WIN32
+    bool OpenTemporary(int directory, std::filesystem::path const& directoryPath,
+                       std::filesystem::path const& fileName) noexcept;
+#endif
+
+#ifdef __linux__
+    // Clone the block-aligned start of the given range (all of it if it ends at the end of
+    // the source) at the current position, and update the range to what remains to be
+    // copied. Returns false on hard errors only:
+    bool clone(FileIn const& source, UInt64& offset, UInt64& size, CopyState& state) noexcept;
+#endif
+
     bool WritePart(const void* data, UInt32 size, UInt32& processedSize) noexcept;
+
+  private:
+
+    static constexpr UInt64 kCacheWindowSize = 8 << 20;
+
+    bool m_CacheBypass = false;
+    bool m_Writeback = false;
+    UInt64 m_CacheWindowStart = 0;
+
+    // Temporary file state, m_TemporaryPath is empty for anonymous temporary files:
+    bool m_Temporary = false;
+    std::filesystem::path m_Target;
+    std::filesystem::path m_TemporaryPath;
   };
 
   /**
@@ -289,6 +562,66 @@ namespace IO {
 #endif
   }
 
+#ifndef _WIN32
+  /**
+   * @brief Set the modification time of the given path (file or directory).
+   */
+  bool set_mtime(std::filesystem::path const& path, const FILETIME* mTime) noexcept;
+
+  /**
+   * @brief Set the permissions of the given path (file or directory) from 7z attributes,
+   *   see FileOut::SetAttributes().
+   */
+  bool set_attributes(std::filesystem::path const& path, UInt32 attributes, mode_t umask) noexcept;
+
+  /**
+   * @brief Retrieve the umask of the process.
+   *
+   * The umask can only be read by changing it, so it is briefly 0 for the whole process: this
+   * should be called once, e.g. per extraction, rather than for each file.
+   */
+  mode_t current_umask() noexcept;
+#endif
+
+  /**
+   * @brief Retrieve the space available (to the current user) on the filesystem containing
+   *   the given path, and the allocation unit of that filesystem.
+   */
+  bool disk_space(std::filesystem::path const& path, UInt64& available, UInt64& blockSize) noexcept;
+
+  /**
+   * @brief Load the given file into the system cache, so that reading it later on does
+   *   not wait for the disk.
+   *
+   * On Linux, the reads are only scheduled (posix_fadvise) and this returns immediately.
+   * Elsewhere, the file is read until its end or until a stop is requested, so this should
+   * be called from a background thread.
+   */
+  bool prefetch_file(std::filesystem::path const& path, std::stop_token stop = {}) noexcept;
+
+  /**
+   * @brief Flush the entries of the given directory to disk. This is a no-op on Windows.
+   */
+  bool sync_directory(std::filesystem::path const& path) noexcept;
+
+#ifdef __linux__
+  /**
+   * @brief Flush all the pending data of the filesystem containing the given path (syncfs).
+   */
+  bool sync_filesystem(std::filesystem::path const& path) noexcept;
+#endif
+
+  /**
+   * @return the last system error of the calling thread.
+   */
+  inline std::error_code last_error() {
+#ifdef _WIN32
+    return std::error_code(::GetLastError(), std::system_category());
+#else
+    return std::error_code(errno, std::system_category());
+#endif
+  }
+
 }
 
 #endif
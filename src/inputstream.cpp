@@ -20,6 +20,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 //#include <Unknwn.h>
 #include "inputstream.h"
+#include "formatter.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 static inline HRESULT ConvertBoolToHRESULT(bool result)
 {
@@ -79,3 +90,420 @@ STDMETHODIMP InputStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosit
   }
   return ConvertBoolToHRESULT(result);
 }
+
+static inline HRESULT readError()
+{
+#ifdef _WIN32
+  return HRESULT_FROM_WIN32(::GetLastError());
+#else
+  return E_FAIL;
+#endif
+}
+
+PositionalInputStream::PositionalInputStream()
+  : m_Position(0), m_BufferOffset(0), m_BufferSize(0),
+    m_Window(kMinWindow), m_NextRead(0), m_Sequential(false)
+{}
+
+PositionalInputStream::~PositionalInputStream() { }
+
+bool PositionalInputStream::Open(std::filesystem::path const& filename)
+{
+  m_Position = 0;
+  m_BufferSize = 0;
+  return m_File.Open(filename);
+}
+
+void PositionalInputStream::adapt(UInt64 position)
+{
+  if (position == m_NextRead) {
+    m_Window = std::min(m_Window * 2, kMaxWindow);
+  }
+  else {
+    m_Window = std::max(m_Window / 2, kMinWindow);
+  }
+
+  // Let the system read ahead as well once the access is clearly sequential:
+  const bool sequential = m_Window == kMaxWindow;
+  if (sequential != m_Sequential) {
+    m_File.AdviseSequential(sequential);
+    m_Sequential = sequential;
+  }
+}
+
+STDMETHODIMP PositionalInputStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+{
+  auto bytes = static_cast<unsigned char*>(data);
+  UInt32 done = 0;
+
+  if (m_Position >= m_BufferOffset && m_Position < m_BufferOffset + m_BufferSize) {
+    done = static_cast<UInt32>(std::min<UInt64>(size, m_BufferOffset + m_BufferSize - m_Position));
+    std::memcpy(bytes, m_Buffer.data() + (m_Position - m_BufferOffset), done);
+    m_Position += done;
+  }
+
+  if (done < size) {
+    adapt(m_Position);
+
+    UInt32 read;
+    const UInt32 remaining = size - done;
+    if (remaining >= m_Window) {
+      // Large reads go straight to the caller:
+      if (!m_File.ReadAt(m_Position, bytes + done, remaining, read)) {
+        return readError();
+      }
+      m_NextRead = m_Position + read;
+    }
+    else {
+      m_Buffer.resize(m_Window);
+      if (!m_File.ReadAt(m_Position, m_Buffer.data(), m_Window, m_BufferSize)) {
+        m_BufferSize = 0;
+        return readError();
+      }
+      m_BufferOffset = m_Position;
+      read = std::min(remaining, m_BufferSize);
+      std::memcpy(bytes + done, m_Buffer.data(), read);
+      m_NextRead = m_Position + m_BufferSize;
+    }
+    done += read;
+    m_Position += read;
+  }
+
+  if (processedSize != nullptr) {
+    *processedSize = done;
+  }
+  return S_OK;
+}
+
+STDMETHODIMP PositionalInputStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+{
+  Int64 base;
+  switch (seekOrigin) {
+  case STREAM_SEEK_SET:
+    base = 0;
+    break;
+  case STREAM_SEEK_CUR:
+    base = static_cast<Int64>(m_Position);
+    break;
+  case STREAM_SEEK_END: {
+    UInt64 size;
+    if (!m_File.GetLength(size)) {
+      return readError();
+    }
+    base = static_cast<Int64>(size);
+  } break;
+  default:
+    return STG_E_INVALIDFUNCTION;
+  }
+
+  if (offset < -base) {
+    return STG_E_INVALIDFUNCTION;
+  }
+  m_Position = static_cast<UInt64>(base + offset);
+
+  if (newPosition) {
+    *newPosition = m_Position;
+  }
+  return S_OK;
+}
+
+STDMETHODIMP PositionalInputStream::GetSize(UInt64 *size)
+{
+  return m_File.GetLength(*size) ? S_OK : readError();
+}
+
+MemoryInputStream::MemoryInputStream(const void *data, UInt64 size, std::shared_ptr<const void> owner)
+  : m_Data(static_cast<const unsigned char*>(data)), m_Size(size), m_Position(0), m_Owner(std::move(owner))
+{}
+
+MemoryInputStream::~MemoryInputStream() { }
+
+STDMETHODIMP MemoryInputStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+{
+  UInt32 read = 0;
+  if (m_Position < m_Size) {
+    read = static_cast<UInt32>(std::min<UInt64>(size, m_Size - m_Position));
+    std::memcpy(data, m_Data + m_Position, read);
+    m_Position += read;
+  }
+
+  if (processedSize != nullptr) {
+    *processedSize = read;
+  }
+  return S_OK;
+}
+
+STDMETHODIMP MemoryInputStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+{
+  Int64 base;
+  switch (seekOrigin) {
+  case STREAM_SEEK_SET:
+    base = 0;
+    break;
+  case STREAM_SEEK_CUR:
+    base = static_cast<Int64>(m_Position);
+    break;
+  case STREAM_SEEK_END:
+    base = static_cast<Int64>(m_Size);
+    break;
+  default:
+    return STG_E_INVALIDFUNCTION;
+  }
+
+  // Seeking past the end is allowed, reads there return nothing:
+  if (offset < -base) {
+    return STG_E_INVALIDFUNCTION;
+  }
+  m_Position = static_cast<UInt64>(base + offset);
+
+  if (newPosition) {
+    *newPosition = m_Position;
+  }
+  return S_OK;
+}
+
+STDMETHODIMP MemoryInputStream::GetSize(UInt64 *size)
+{
+  *size = m_Size;
+  return S_OK;
+}
+
+#ifndef _WIN32
+MappedInputStream::MappedInputStream()
+{}
+
+MappedInputStream::~MappedInputStream()
+{
+  close();
+}
+
+void MappedInputStream::close()
+{
+  if (m_Data != nullptr) {
+    ::munmap(const_cast<unsigned char*>(m_Data), m_Size);
+  }
+  m_Data = nullptr;
+  m_Size = 0;
+  m_Position = 0;
+}
+
+bool MappedInputStream::Open(std::filesystem::path const& filename)
+{
+  close();
+
+  const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+
+  // The mapping remains valid once the descriptor is closed:
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  const int error = errno;
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    errno = error;
+    return false;
+  }
+
+  m_Data = static_cast<const unsigned char*>(data);
+  m_Size = st.st_size;
+
+  // Entries are mostly read in order, but the headers are usually at the end:
+  ::madvise(data, m_Size, MADV_SEQUENTIAL);
+  const UInt64 tail = m_Size - std::min(m_Size, kTailPrefetchSize);
+  const UInt64 pageSize = ::sysconf(_SC_PAGESIZE);
+  const UInt64 tailStart = tail / pageSize * pageSize;
+  ::madvise(static_cast<char*>(data) + tailStart, m_Size - tailStart, MADV_WILLNEED);
+
+  return true;
+}
+#endif
+
+VolumeInputStream::VolumeInputStream(CMyComPtr<IInStream> stream, UInt64 size, std::filesystem::path next)
+  : m_Stream(stream)
+  , m_Size(size)
+  , m_Position(0)
+  , m_Next(std::move(next))
+{}
+
+VolumeInputStream::~VolumeInputStream()
+{}
+
+STDMETHODIMP VolumeInputStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+{
+  UInt32 read = 0;
+  const HRESULT result = m_Stream->Read(data, size, &read);
+  m_Position += read;
+  if (processedSize != nullptr) {
+    *processedSize = read;
+  }
+
+  // Only once, prefetching errors are ignored since the handler reports missing volumes:
+  if (!m_Next.empty() && m_Position >= m_Size / 256 * kPrefetchFraction) {
+    m_Prefetch = std::jthread([next = std::move(m_Next)](std::stop_token stop) {
+      IO::prefetch_file(next, stop);
+    });
+    m_Next.clear();
+  }
+  return result;
+}
+
+STDMETHODIMP VolumeInputStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+{
+  UInt64 position = 0;
+  RINOK(m_Stream->Seek(offset, seekOrigin, &position));
+  m_Position = position;
+  if (newPosition != nullptr) {
+    *newPosition = position;
+  }
+  return S_OK;
+}
+
+STDMETHODIMP VolumeInputStream::GetSize(UInt64 *size)
+{
+  *size = m_Size;
+  return S_OK;
+}
+
+HashingInputStream::HashingInputStream(CMyComPtr<IInStream> stream)
+  : m_Stream(stream)
+  , m_Position(0)
+  , m_Hashed(0)
+  , m_Filled(0)
+{}
+
+HashingInputStream::~HashingInputStream()
+{}
+
+STDMETHODIMP HashingInputStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+{
+  UInt32 read = 0;
+  const HRESULT result = m_Stream->Read(data, size, &read);
+
+  // Only the data continuing the hashed prefix can be hashed:
+  if (!m_Digest && m_Position <= m_Hashed && m_Hashed < m_Position + read) {
+    const UInt64 hashed = m_Hashed - m_Position;
+    m_Hash.Update(static_cast<const unsigned char*>(data) + hashed, read - hashed);
+    m_Hashed = m_Position + read;
+  }
+  m_Position += read;
+
+  if (processedSize != nullptr) {
+    *processedSize = read;
+  }
+  return result;
+}
+
+STDMETHODIMP HashingInputStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+{
+  UInt64 position = 0;
+  RINOK(m_Stream->Seek(offset, seekOrigin, &position));
+  m_Position = position;
+  if (newPosition != nullptr) {
+    *newPosition = position;
+  }
+  return S_OK;
+}
+
+STDMETHODIMP HashingInputStream::GetSize(UInt64 *size)
+{
+  CMyComPtr<IStreamGetSize> getSize;
+  if (m_Stream.QueryInterface(IID_IStreamGetSize, &getSize) == S_OK && getSize) {
+    return getSize->GetSize(size);
+  }
+  RINOK(m_Stream->Seek(0, STREAM_SEEK_END, size));
+  return m_Stream->Seek(m_Position, STREAM_SEEK_SET, nullptr);
+}
+
+HRESULT HashingInputStream::Digest(Checksum::Sha256::Digest &digest)
+{
+  if (!m_Digest) {
+    RINOK(m_Stream->Seek(m_Hashed, STREAM_SEEK_SET, nullptr));
+    std::vector<unsigned char> buffer(1 << 20);
+    UInt32 read = 0;
+    do {
+      RINOK(m_Stream->Read(buffer.data(), static_cast<UInt32>(buffer.size()), &read));
+      m_Hash.Update(buffer.data(), read);
+      m_Hashed += read;
+      m_Filled += read;
+    } while (read > 0);
+    RINOK(m_Stream->Seek(m_Position, STREAM_SEEK_SET, nullptr));
+    m_Digest = m_Hash.Final();
+  }
+  digest = *m_Digest;
+  return S_OK;
+}
+
+std::filesystem::path nextVolumePath(std::filesystem::path const &filename)
+{
+  auto isDigit = [](PathChar c) { return c >= '0' && c <= '9'; };
+
+  const PathStr name = filename.filename().native();
+  const std::size_t lastDot = name.rfind('.');
+  if (lastDot == PathStr::npos || lastDot == 0) {
+    return {};
+  }
+
+  // The number is the last extension (.001), or follows a single letter (.r00, .z01):
+  std::size_t begin = name.size();
+  std::size_t end = name.size();
+  while (begin > lastDot + 1 && isDigit(name[begin - 1])) {
+    --begin;
+  }
+  if (begin == end || begin > lastDot + 2) {
+    // Or it is in a .partN extension before the last one (.part1.rar):
+    const std::size_t partDot = name.rfind('.', lastDot - 1);
+    if (partDot == PathStr::npos) {
+      return {};
+    }
+    const PathStr part = ArchiveStrings::towlower(name.substr(partDot + 1, lastDot - partDot - 1));
+    if (part.size() <= 4 || !part.starts_with(ALOGSTR"part")
+        || !std::all_of(part.begin() + 4, part.end(), isDigit)) {
+      return {};
+    }
+    begin = partDot + 5;
+    end = lastDot;
+  }
+
+  // Increment the number, keeping its width (.009 -> .010):
+  PathStr next = name;
+  for (std::size_t i = end; i > begin; --i) {
+    if (next[i - 1] != '9') {
+      ++next[i - 1];
+      return filename.parent_path() / next;
+    }
+    next[i - 1] = '0';
+  }
+  next.insert(begin, 1, '1');
+  return filename.parent_path() / next;
+}
+
+CMyComPtr<IInStream> openInputStream(std::filesystem::path const &filename, Archive::InputEngine engine)
+{
+#ifndef _WIN32
+  if (engine == Archive::InputEngine::MEMORY_MAP) {
+    CMyComPtr<MappedInputStream> mapped(new MappedInputStream);
+    if (mapped->Open(filename)) {
+      return CMyComPtr<IInStream>(mapped);
+    }
+  }
+#endif
+
+  if (engine == Archive::InputEngine::POSITIONAL) {
+    CMyComPtr<PositionalInputStream> file(new PositionalInputStream);
+    if (!file->Open(filename)) {
+      return nullptr;
+    }
+    return CMyComPtr<IInStream>(file);
+  }
+
+  CMyComPtr<InputStream> file(new InputStream);
+  if (!file->Open(filename)) {
+    return nullptr;
+  }
+  return CMyComPtr<IInStream>(file);
+}
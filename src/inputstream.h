@@ -23,9 +23,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 
 #include "7zip/IStream.h"
+#include "Common/MyCom.h"
 
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
 
+#include "archive.h"
+#include "checksum.h"
 #include "fileio.h"
 #include "unknown_impl.h"
 
@@ -53,4 +60,209 @@ private:
   IO::FileIn m_File;
 };
 
+/** This class implements an input stream reading the archive file at explicit
+ * offsets, through a readahead buffer whose size grows while the file is read
+ * sequentially and shrinks when the handler jumps around.
+ */
+class PositionalInputStream :
+    public IInStream,
+    public IStreamGetSize
+{
+
+  UNKNOWN_2_INTERFACE(IInStream, IStreamGetSize);
+
+public:
+  PositionalInputStream();
+
+  virtual ~PositionalInputStream();
+
+  bool Open(std::filesystem::path const &filename);
+
+  STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
+  STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+
+  // IStreamGetSize
+  STDMETHOD(GetSize)(UInt64 *size);
+
+private:
+  // Adapt the readahead window to a read from the file at the given position:
+  void adapt(UInt64 position);
+
+  static constexpr UInt32 kMinWindow = 4 << 10;
+  static constexpr UInt32 kMaxWindow = 1 << 20;
+
+  IO::FileIn m_File;
+  UInt64 m_Position;
+
+  // Readahead buffer, holding m_BufferSize bytes of the file from m_BufferOffset:
+  std::vector<unsigned char> m_Buffer;
+  UInt64 m_BufferOffset;
+  UInt32 m_BufferSize;
+
+  // Current readahead size, and end of the last read from the file:
+  UInt32 m_Window;
+  UInt64 m_NextRead;
+  bool m_Sequential;
+};
+
+/** This class implements an input stream over an archive held in memory, reads
+ * are plain copies and seeks do not involve the system.
+ */
+class MemoryInputStream :
+    public IInStream,
+    public IStreamGetSize
+{
+
+  UNKNOWN_2_INTERFACE(IInStream, IStreamGetSize);
+
+public:
+  /** The data is not copied, it must remain valid as long as the stream is used,
+   * unless owner keeps it alive.
+   */
+  MemoryInputStream(const void *data = nullptr, UInt64 size = 0, std::shared_ptr<const void> owner = {});
+
+  virtual ~MemoryInputStream();
+
+  STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
+  STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+
+  // IStreamGetSize
+  STDMETHOD(GetSize)(UInt64 *size);
+
+protected:
+  const unsigned char* m_Data;
+  UInt64 m_Size;
+  UInt64 m_Position;
+  std::shared_ptr<const void> m_Owner;
+};
+
+#ifndef _WIN32
+/** This class implements an input stream over a read-only memory mapping of the
+ * archive file.
+ *
+ * The file must not be truncated while it is mapped.
+ */
+class MappedInputStream :
+    public MemoryInputStream
+{
+public:
+  MappedInputStream();
+
+  virtual ~MappedInputStream();
+
+  bool Open(std::filesystem::path const &filename);
+
+private:
+  void close();
+
+  // Size of the end of the file prefetched on open, since most formats keep
+  // their headers there:
+  static constexpr UInt64 kTailPrefetchSize = 1 << 16;
+};
+#endif
+
+/** This class implements an input stream over one volume of a multi-volume
+ * archive, forwarding to the stream of the volume.
+ *
+ * Once the handler has read most of the volume, the next one is loaded into
+ * the system cache in the background, so that the decoder does not wait for
+ * the disk when it moves on to it.
+ */
+class VolumeInputStream :
+    public IInStream,
+    public IStreamGetSize
+{
+
+  UNKNOWN_2_INTERFACE(IInStream, IStreamGetSize);
+
+public:
+  /** next is the path of the next volume, or empty if there is none.
+   */
+  VolumeInputStream(CMyComPtr<IInStream> stream, UInt64 size, std::filesystem::path next);
+
+  virtual ~VolumeInputStream();
+
+  STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
+  STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+
+  // IStreamGetSize
+  STDMETHOD(GetSize)(UInt64 *size);
+
+private:
+  // Fraction of the volume (in 1/256th) read before the next one is prefetched, the
+  // headers read when opening the archive are usually at the start of the volumes:
+  static constexpr UInt64 kPrefetchFraction = 192;
+
+  CMyComPtr<IInStream> m_Stream;
+  UInt64 m_Size;
+  UInt64 m_Position;
+
+  std::filesystem::path m_Next;
+  std::jthread m_Prefetch;
+};
+
+/** This class implements an input stream hashing the data read from another
+ * stream (SHA-256), so the digest of an archive is computed while the handler
+ * reads it instead of in a separate pass.
+ *
+ * The data is hashed while it is read in order from the start. The ranges the
+ * handler skipped, or read out of order, are read again by Digest().
+ */
+class HashingInputStream :
+    public IInStream,
+    public IStreamGetSize
+{
+
+  UNKNOWN_2_INTERFACE(IInStream, IStreamGetSize);
+
+public:
+  explicit HashingInputStream(CMyComPtr<IInStream> stream);
+
+  virtual ~HashingInputStream();
+
+  /** Complete the hash with the data that was not read in order, the position
+   * of the stream is preserved. The digest is computed once, later calls return
+   * the same digest.
+   */
+  HRESULT Digest(Checksum::Sha256::Digest &digest);
+
+  /** Number of bytes read again by Digest().
+   */
+  UInt64 FilledSize() const { return m_Filled; }
+
+  STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
+  STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+
+  // IStreamGetSize
+  STDMETHOD(GetSize)(UInt64 *size);
+
+private:
+  CMyComPtr<IInStream> m_Stream;
+  UInt64 m_Position;
+
+  // Everything before m_Hashed has been hashed:
+  Checksum::Sha256 m_Hash;
+  UInt64 m_Hashed;
+
+  std::optional<Checksum::Sha256::Digest> m_Digest;
+  UInt64 m_Filled;
+};
+
+/** Path of the volume following the given one in a multi-volume archive, i.e.
+ * with the volume number incremented (archive.7z.001, archive.part1.rar,
+ * archive.r00, archive.z01).
+ *
+ * @return the path, or an empty path if the given one is not a volume.
+ */
+std::filesystem::path nextVolumePath(std::filesystem::path const &filename);
+
+/** Open an input stream on the given archive file.
+ *
+ * With InputEngine::MEMORY_MAP, files that cannot be mapped (or on Windows) are
+ * read through InputStream instead.
+ *
+ * @return the stream, or nullptr if the file could not be opened.
+ */
+CMyComPtr<IInStream> openInputStream(std::filesystem::path const &filename, Archive::InputEngine engine);
+
 #endif // INPUTSTREAM_H
@@ -0,0 +1,77 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "memscan.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MEMSCAN_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define MEMSCAN_NEON
+#include <arm_neon.h>
+#endif
+
+namespace MemScan {
+
+  bool isZero(const void* data, std::size_t size) noexcept {
+    auto bytes = static_cast<const unsigned char*>(data);
+
+#if defined(MEMSCAN_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; size >= 64; bytes += 64, size -= 64) {
+      __m128i acc = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes)),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 16))),
+        _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 32)),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 48))));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) {
+        return false;
+      }
+    }
+#elif defined(MEMSCAN_NEON)
+    for (; size >= 64; bytes += 64, size -= 64) {
+      uint8x16_t acc = vorrq_u8(
+        vorrq_u8(vld1q_u8(bytes), vld1q_u8(bytes + 16)),
+        vorrq_u8(vld1q_u8(bytes + 32), vld1q_u8(bytes + 48)));
+      if (vmaxvq_u8(acc) != 0) {
+        return false;
+      }
+    }
+#endif
+
+    for (; size >= sizeof(std::uint64_t); bytes += sizeof(std::uint64_t), size -= sizeof(std::uint64_t)) {
+      std::uint64_t word;
+      std::memcpy(&word, bytes, sizeof(word));
+      if (word != 0) {
+        return false;
+      }
+    }
+    for (; size > 0; ++bytes, --size) {
+      if (*bytes != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+}
@@ -0,0 +1,37 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ARCHIVE_MEMSCAN_H
+#define ARCHIVE_MEMSCAN_H
+
+#include <cstddef>
+
+namespace MemScan {
+
+  /**
+   * @brief Check if the given memory only contains zero bytes.
+   *
+   * This uses SIMD instructions when available (SSE2 or AArch64 NEON), 64 bytes at a time.
+   */
+  bool isZero(const void* data, std::size_t size) noexcept;
+
+}
+
+#endif
@@ -20,56 +20,303 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 //#include <Unknwn.h>
 #include "multioutputstream.h"
+#include "memscan.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <limits>
+#include <type_traits>
 
 #include <fcntl.h>
 //#include <io.h>
 
 static inline HRESULT ConvertBoolToHRESULT(bool result)
 {
-//  if (result) {
-//    return S_OK;
-//  }
-//  DWORD lastError = ::GetLastError();
-//  if (lastError == 0) {
-//    return E_FAIL;
-//  }
-//  return HRESULT_FROM_WIN32(lastError);
-  std::cerr << "FIXME: Not implemented" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n"; assert(false && "Not implemented");
-  return 0;
+#ifdef _WIN32
+  if (result) {
+    return S_OK;
+  }
+  DWORD lastError = ::GetLastError();
+  if (lastError == 0) {
+    return E_FAIL;
+  }
+  return HRESULT_FROM_WIN32(lastError);
+#else
+  return result ? S_OK : E_FAIL;
+#endif
 }
 
 //////////////////////////
 // MultiOutputStream
 
-MultiOutputStream::MultiOutputStream(WriteCallback callback) :
-  m_WriteCallback(callback) {}
+MultiOutputStream::MultiOutputStream(WriteCallback callback, IO::UringQueue* uring, IO::CloseQueue* closeQueue) :
+  m_WriteCallback(callback), m_ProcessedSize(0), m_Uring(uring), m_CloseQueue(closeQueue), m_Position(0),
+  m_Durability(Archive::Durability::NONE), m_SyncTimes(nullptr), m_BufferPool(nullptr),
+  m_SparseThreshold(0), m_SparseEnd(0), m_HashEnd(0) {}
 
-MultiOutputStream::~MultiOutputStream() { }
+MultiOutputStream::~MultiOutputStream()
+{
+  // Files with queued writes must not be closed behind the back of the queue:
+  if (m_Uring) {
+    Close(false);
+  }
+  releaseBuffer();
+}
 
-HRESULT MultiOutputStream::Close()
+IO::CloseQueue::Finalizer MultiOutputStream::finalizer(bool success, Buffer content) const
 {
+  const bool sync = success && m_Durability == Archive::Durability::STRICT;
+#ifndef _WIN32
+  const mode_t umask = m_Umask;
+#endif
+  return [mtime = m_MTime, attributes = m_Attributes, sync, times = m_SyncTimes, success,
+#ifndef _WIN32
+          umask,
+#endif
+          content = std::move(content)](IO::FileOut& file) {
+    // Incomplete files are discarded, keeping the error:
+    auto fail = [&file] {
+      const int error = errno;
+      file.Discard();
+      errno = error;
+      return false;
+    };
+    if (content && success) {
+      auto data = content->data();
+      for (std::size_t remaining = content->size(); remaining > 0;) {
+        const auto size = static_cast<UInt32>(std::min<std::size_t>(remaining, std::numeric_limits<UInt32>::max()));
+        UInt32 processedSize;
+        if (!file.Write(data, size, processedSize) || processedSize == 0) {
+          return fail();
+        }
+        data += processedSize;
+        remaining -= processedSize;
+      }
+    }
+    if (mtime) {
+      file.SetMTime(&*mtime);
+    }
+#ifndef _WIN32
+    if (attributes && !file.SetAttributes(*attributes, umask)) {
+      return fail();
+    }
+#endif
+    if (sync) {
+      const auto start = std::chrono::steady_clock::now();
+      const bool synced = file.Sync();
+      if (times) {
+        times->FileSync += std::chrono::nanoseconds(std::chrono::steady_clock::now() - start).count();
+      }
+      if (!synced) {
+        return fail();
+      }
+    }
+    file.ReleaseCache();
+    if (!success) {
+      file.Discard();
+      return true;
+    }
+    return file.Publish() || fail();
+  };
+}
+
+HRESULT MultiOutputStream::Close(bool success)
+{
+  // Buffered content is written in one go, and shared between all the files and the
+  // queues (it goes back to the pool once everything is written):
+  Buffer content;
+  if (m_BufferPool) {
+    content = m_BufferPool->Share(std::move(m_Buffer));
+    m_BufferPool = nullptr;
+  }
+
+  // Zeros skipped at the end of sparse files are not part of the files yet:
+  bool extended = true;
+  if (m_SparseThreshold > 0 && success) {
+    for (auto& file: m_Files) {
+      UInt64 length;
+      if (file.GetLength(length) && length < m_SparseEnd) {
+        extended = file.SetLength(m_SparseEnd) && extended;
+      }
+    }
+  }
+  m_SparseThreshold = 0;
+
+  // Files that could not be extended are incomplete, so they are not published:
+  const bool complete = success && extended;
+
+  if (m_Uring || m_CloseQueue) {
+    for (auto& file: m_Files) {
+      if (m_Uring) {
+        if (content && complete && !content->empty()) {
+          m_Uring->Write(file, 0, content);
+        }
+        m_Uring->Close(std::move(file), finalizer(complete));
+      }
+      else {
+        m_CloseQueue->Close(std::move(file), finalizer(complete, content));
+      }
+    }
+    m_Files.clear();
+    return ConvertBoolToHRESULT(extended);
+  }
+
+  bool result = extended;
+  const auto finalize = finalizer(complete, std::move(content));
   for (auto& file: m_Files) {
+    result = finalize(file) && result;
     file.Close();
   }
-  return S_OK;
+  return ConvertBoolToHRESULT(result);
+}
+
+bool MultiOutputStream::Open(std::vector<std::filesystem::path> const& filepaths,
+                             OpenMode mode,
+                             std::vector<std::filesystem::path> *skipped)
+{
+  return open(filepaths, mode, skipped, [&](IO::FileOut& file, std::size_t i) {
+    switch (mode) {
+    case OpenMode::CREATE_NEW:
+    case OpenMode::CREATE_NEW_OR_SKIP:
+      return file.OpenNew(filepaths[i]);
+    case OpenMode::TEMPORARY:
+      return file.OpenTemporary(filepaths[i]);
+    default:
+      return file.Open(filepaths[i]);
+    }
+  });
 }
 
-bool MultiOutputStream::Open(std::vector<std::filesystem::path> const& filepaths)
+#ifndef _WIN32
+bool MultiOutputStream::Open(std::vector<std::filesystem::path> const& filepaths,
+                             std::vector<IO::Directory const*> const& directories,
+                             OpenMode mode,
+                             std::vector<std::filesystem::path> *skipped)
+{
+  return open(filepaths, mode, skipped, [&](IO::FileOut& file, std::size_t i) {
+    auto const& directory = *directories[i];
+    auto const name = filepaths[i].filename();
+    switch (mode) {
+    case OpenMode::CREATE_NEW:
+    case OpenMode::CREATE_NEW_OR_SKIP:
+      return file.OpenNew(directory, name);
+    case OpenMode::TEMPORARY:
+      return file.OpenTemporary(directory, name);
+    case OpenMode::PREALLOCATED:
+      return file.OpenExisting(directory, name);
+    default:
+      return file.Open(directory, name);
+    }
+  });
+}
+#endif
+
+bool MultiOutputStream::open(std::vector<std::filesystem::path> const& filepaths,
+                             OpenMode mode,
+                             std::vector<std::filesystem::path> *skipped,
+                             std::function<bool(IO::FileOut&, std::size_t)> const& openFile)
 {
   m_ProcessedSize = 0;
-  bool ok = true;
+  m_Position = 0;
+  m_MTime.reset();
+  m_Attributes.reset();
+  m_Durability = Archive::Durability::NONE;
+  m_SyncTimes = nullptr;
+  m_SparseThreshold = 0;
+  m_SparseEnd = 0;
+  m_Hash = std::monostate{};
+  m_CRC.reset();
+  m_HashEnd = 0;
+  releaseBuffer();
   m_Files.clear();
-  for (auto &path: filepaths) {
-    m_Files.emplace_back();
-    if (!m_Files.back().Open(path.native())) {
-      ok = false;
+  for (std::size_t i = 0; i < filepaths.size(); ++i) {
+    IO::FileOut file;
+    if (!openFile(file, i)) {
+      if (mode == OpenMode::CREATE_NEW_OR_SKIP && IO::last_error() == std::errc::file_exists) {
+        if (skipped) {
+          skipped->push_back(filepaths[i]);
+        }
+        continue;
+      }
+      return false;
     }
+    m_Files.push_back(std::move(file));
+  }
+  return true;
+}
+
+void MultiOutputStream::releaseCache()
+{
+  // Only the writeback started for durability is timed, this is also used to bypass
+  // the cache:
+  const bool timed = m_SyncTimes && m_Durability == Archive::Durability::BATCHED;
+  const auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+  for (auto &file : m_Files) {
+    file.ReleaseCache(m_Position);
+  }
+  if (timed) {
+    m_SyncTimes->Writeback += std::chrono::nanoseconds(std::chrono::steady_clock::now() - start).count();
   }
-  return ok;
 }
 
 STDMETHODIMP MultiOutputStream::Write(const void *data, UInt32 size, UInt32 *processedSize)
 {
+  hash(data, size);
+
+  if (m_BufferPool) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    if (m_Buffer.size() < m_Position + size) {
+      m_Buffer.resize(m_Position + size);
+    }
+    std::copy(bytes, bytes + size, m_Buffer.begin() + m_Position);
+    m_Position += size;
+    m_ProcessedSize += size;
+    if (m_WriteCallback) {
+      m_WriteCallback(size, m_ProcessedSize);
+    }
+    if (processedSize != nullptr) {
+      *processedSize = size;
+    }
+    return S_OK;
+  }
+
+  if (m_Uring) {
+    // The data only remains valid during this call, so it is copied once and shared
+    // between all the queued writes:
+    auto bytes = static_cast<const unsigned char*>(data);
+    auto buffer = std::make_shared<const std::vector<unsigned char>>(bytes, bytes + size);
+    for (auto &file : m_Files) {
+      if (!m_Uring->Write(file, m_Position, buffer)) {
+        return E_FAIL;
+      }
+    }
+    m_Position += size;
+    m_ProcessedSize += size;
+    if (m_WriteCallback) {
+      m_WriteCallback(size, m_ProcessedSize);
+    }
+    if (processedSize != nullptr) {
+      *processedSize = size;
+    }
+    releaseCache();
+    return S_OK;
+  }
+
+  if (m_SparseThreshold > 0) {
+    RINOK(writeSparse(static_cast<const unsigned char*>(data), size));
+    m_Position += size;
+    m_SparseEnd = std::max(m_SparseEnd, m_Position);
+    m_ProcessedSize += size;
+    if (m_WriteCallback) {
+      m_WriteCallback(size, m_ProcessedSize);
+    }
+    if (processedSize != nullptr) {
+      *processedSize = size;
+    }
+    releaseCache();
+    return S_OK;
+  }
+
   bool update_processed(true);
   for (auto &file : m_Files) {
     UInt32 realProcessedSize;
@@ -87,6 +334,8 @@ STDMETHODIMP MultiOutputStream::Write(const void *data, UInt32 size, UInt32 *pro
       *processedSize = realProcessedSize;
     }
   }
+  m_Position += size;
+  releaseCache();
   return S_OK;
 }
 
@@ -95,20 +344,47 @@ STDMETHODIMP MultiOutputStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64* ne
   if (seekOrigin >= 3)
     return STG_E_INVALIDFUNCTION;
 
+  if (m_Uring || m_BufferPool) {
+    UInt64 base = 0;
+    if (seekOrigin == STREAM_SEEK_CUR) {
+      base = m_Position;
+    }
+    else if (seekOrigin == STREAM_SEEK_END) {
+      RINOK(GetSize(&base));
+    }
+    if (offset < 0 && static_cast<UInt64>(-offset) > base)
+      return STG_E_INVALIDFUNCTION;
+    m_Position = base + offset;
+    if (newPosition)
+      *newPosition = m_Position;
+    return S_OK;
+  }
+
   bool result = true;
   for (auto& file : m_Files) {
     UInt64 realNewPosition;
     bool result = file.Seek(offset, seekOrigin, realNewPosition);
     if (newPosition)
       *newPosition = realNewPosition;
+    m_Position = realNewPosition;
   }
   return ConvertBoolToHRESULT(result);
 }
 
 STDMETHODIMP MultiOutputStream::SetSize(UInt64 newSize)
 {
+  if (m_BufferPool) {
+    m_Buffer.resize(newSize);
+    return S_OK;
+  }
+
   bool result = true;
   for (auto& file : m_Files) {
+    if (m_Uring) {
+      // Writes are positional, so there is no file pointer to restore:
+      result = result && m_Uring->Wait(file) && file.SetLength(newSize);
+      continue;
+    }
     UInt64 currentPos;
     if (!file.Seek(0, FILE_CURRENT, currentPos))
       return E_FAIL;
@@ -124,13 +400,239 @@ HRESULT MultiOutputStream::GetSize(UInt64* size)
   if (m_Files.empty()) {
     return ConvertBoolToHRESULT(false);
   }
+  if (m_BufferPool) {
+    *size = m_Buffer.size();
+    return S_OK;
+  }
+  if (m_Uring && !m_Uring->Wait(m_Files[0])) {
+    return E_FAIL;
+  }
   return ConvertBoolToHRESULT(m_Files[0].GetLength(*size));
 }
 
+void MultiOutputStream::SetCacheBypass(bool enabled)
+{
+  for (auto &file : m_Files) {
+    file.SetCacheBypass(enabled);
+  }
+}
+
+void MultiOutputStream::SetBuffered(IO::BufferPool* pool)
+{
+  releaseBuffer();
+  m_BufferPool = pool;
+  if (m_BufferPool) {
+    m_Buffer = m_BufferPool->Acquire();
+  }
+}
+
+#ifndef _WIN32
+HRESULT MultiOutputStream::CopyFrom(IO::FileIn& source, UInt64 offset, UInt64 size, IO::CopyState* state)
+{
+  if (m_Uring || m_BufferPool || !std::holds_alternative<std::monostate>(m_Hash) || m_CRC) {
+    std::vector<unsigned char> buffer(static_cast<std::size_t>(std::min(size, kCopyChunkSize)));
+    UInt64 position;
+    if (!source.Seek(offset, position)) {
+      return E_FAIL;
+    }
+    while (size > 0) {
+      UInt32 read;
+      if (!source.Read(buffer.data(), static_cast<UInt32>(std::min<UInt64>(size, buffer.size())), read) || read == 0) {
+        return E_FAIL;
+      }
+      RINOK(Write(buffer.data(), read, nullptr));
+      size -= read;
+      if (state) {
+        state->Copied += read;
+      }
+    }
+    return S_OK;
+  }
+
+  while (size > 0) {
+    const UInt64 chunk = std::min(size, kCopyChunkSize);
+    for (auto &file : m_Files) {
+      if (!file.CopyFrom(source, offset, chunk, state)) {
+        return E_FAIL;
+      }
+    }
+    offset += chunk;
+    size -= chunk;
+    m_Position += chunk;
+    m_ProcessedSize += chunk;
+    if (m_WriteCallback) {
+      m_WriteCallback(static_cast<UInt32>(chunk), m_ProcessedSize);
+    }
+    releaseCache();
+  }
+  return S_OK;
+}
+#endif
+
+HRESULT MultiOutputStream::writeSparse(const unsigned char* data, UInt32 size)
+{
+  auto blockLength = [&](UInt32 offset) {
+    return static_cast<UInt32>(std::min<UInt64>(size - offset, kSparseBlockSize - (m_Position + offset) % kSparseBlockSize));
+  };
+
+  // Data is written in runs, only interrupted by runs of (aligned) zero blocks long enough
+  // to be skipped:
+  UInt32 start = 0;
+  UInt32 offset = 0;
+  while (offset < size) {
+    UInt32 zeroEnd = offset;
+    while (zeroEnd < size) {
+      const UInt32 length = blockLength(zeroEnd);
+      if (length != kSparseBlockSize || !MemScan::isZero(data + zeroEnd, length)) {
+        break;
+      }
+      zeroEnd += length;
+    }
+
+    if (zeroEnd - offset < m_SparseThreshold) {
+      offset = zeroEnd > offset ? zeroEnd : offset + blockLength(offset);
+      continue;
+    }
+
+    for (auto &file : m_Files) {
+      UInt32 processedSize;
+      UInt64 newPosition;
+      if ((offset > start && !file.Write(data + start, offset - start, processedSize))
+          || !file.Seek(zeroEnd - offset, FILE_CURRENT, newPosition)) {
+        return ConvertBoolToHRESULT(false);
+      }
+    }
+    start = offset = zeroEnd;
+  }
+
+  for (auto &file : m_Files) {
+    UInt32 processedSize;
+    if (size > start && !file.Write(data + start, size - start, processedSize)) {
+      return ConvertBoolToHRESULT(false);
+    }
+  }
+  return S_OK;
+}
+
+void MultiOutputStream::SetSparse(UInt64 threshold)
+{
+  // Only whole blocks can be skipped:
+  m_SparseThreshold = threshold > 0 ? std::max(threshold, kSparseBlockSize) : 0;
+  m_SparseEnd = m_Position;
+}
+
+void MultiOutputStream::SetHash(Archive::HashAlgorithm algorithm)
+{
+  switch (algorithm) {
+  case Archive::HashAlgorithm::XXH64:
+    m_Hash = Checksum::Xxh64{};
+    break;
+  case Archive::HashAlgorithm::SHA256:
+    m_Hash = Checksum::Sha256{};
+    break;
+  default:
+    m_Hash = std::monostate{};
+    break;
+  }
+  m_HashEnd = m_Position;
+}
+
+std::string MultiOutputStream::Digest() const
+{
+  if (auto xxh64 = std::get_if<Checksum::Xxh64>(&m_Hash)) {
+    // Canonical (big-endian) representation:
+    const UInt64 value = xxh64->Final();
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; ++i) {
+      bytes[i] = static_cast<unsigned char>(value >> (56 - 8 * i));
+    }
+    return Checksum::to_hex(bytes, sizeof(bytes));
+  }
+  if (auto sha256 = std::get_if<Checksum::Sha256>(&m_Hash)) {
+    // Finalize a copy, the content may still be extended:
+    const auto digest = Checksum::Sha256(*sha256).Final();
+    return Checksum::to_hex(digest.data(), digest.size());
+  }
+  return {};
+}
+
+void MultiOutputStream::SetCRC(bool enabled)
+{
+  m_CRC = enabled ? std::optional<UInt32>(0) : std::nullopt;
+  m_HashEnd = m_Position;
+}
+
+std::optional<UInt32> MultiOutputStream::CRC() const
+{
+  return m_CRC;
+}
+
+void MultiOutputStream::hash(const void* data, UInt32 size)
+{
+  if (std::holds_alternative<std::monostate>(m_Hash) && !m_CRC) {
+    return;
+  }
+  if (m_Position != m_HashEnd) {
+    m_Hash = std::monostate{};
+    m_CRC.reset();
+    return;
+  }
+  std::visit([data, size](auto& hash) {
+    if constexpr (!std::is_same_v<std::decay_t<decltype(hash)>, std::monostate>) {
+      hash.Update(data, size);
+    }
+  }, m_Hash);
+  if (m_CRC) {
+    m_CRC = Checksum::crc32(*m_CRC, data, size);
+  }
+  m_HashEnd += size;
+}
+
+void MultiOutputStream::releaseBuffer()
+{
+  if (m_BufferPool) {
+    m_BufferPool->Release(std::move(m_Buffer));
+    m_BufferPool = nullptr;
+  }
+  m_Buffer = {};
+}
+
+void MultiOutputStream::SetDurability(Archive::Durability durability, SyncTimes* times)
+{
+  m_Durability = durability;
+  m_SyncTimes = times;
+  for (auto &file : m_Files) {
+    file.SetWriteback(durability == Archive::Durability::BATCHED);
+  }
+}
+
 bool MultiOutputStream::SetMTime(FILETIME const *mTime)
 {
+  // Applied when the files are closed, after the last write (for sparse files, after the
+  // skipped zeros are added, since extending the files updates their modification time):
+  if (m_Uring || m_BufferPool || m_SparseThreshold > 0) {
+    m_MTime = *mTime;
+    return true;
+  }
   for (auto &file : m_Files) {
     file.SetMTime(mTime);
   }
   return true;
 }
+
+#ifndef _WIN32
+bool MultiOutputStream::SetAttributes(UInt32 attributes, mode_t umask)
+{
+  m_Umask = umask;
+  if (m_Uring || m_BufferPool || m_SparseThreshold > 0) {
+    m_Attributes = attributes;
+    return true;
+  }
+  for (auto &file : m_Files) {
+    if (!file.SetAttributes(attributes, umask)) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
@@ -21,21 +21,36 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #ifndef MULTIOUTPUTSTREAM_H
 #define MULTIOUTPUTSTREAM_H
 
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <string>
+#include <variant>
 #include <vector>
 
 #include "7zip/IStream.h"
 
 #include "unknown_impl.h"
+#include "archive.h"
+#include "bufferpool.h"
+#include "checksum.h"
+#include "closequeue.h"
 #include "fileio.h"
+#include "uring.h"
 
 /** This class allows you to open and output to multiple file handles at a time.
  * It implements the ISequentalOutputStream interface and has some extra functions
  * which are used by the CArchiveExtractCallback class to basically open and
  * set the timestamp on all the files.
  *
+ * If an io_uring queue is given, writes and closes are handed to the queue instead
+ * of being done synchronously, and errors are only reported when the queue is
+ * drained. Similarly, if a close queue is given, the files are closed in the
+ * background and errors are only reported when the queue is drained.
+ *
  * Note that the handling on errors could be better.
  */
 class MultiOutputStream :
@@ -51,21 +66,71 @@ public:
   // in total.
   using WriteCallback = std::function<void(UInt32, UInt64)>;
 
-  MultiOutputStream(WriteCallback callback = {});
+  // How the files are created by Open():
+  enum class OpenMode {
+
+    // Create the files, truncating existing ones.
+    TRUNCATE,
+
+    // Create the files, failing if any of them already exists.
+    CREATE_NEW,
+
+    // Create the files, skipping the ones that already exist.
+    CREATE_NEW_OR_SKIP,
+
+    // Write to temporary files that replace the target files when closed
+    // successfully.
+    TEMPORARY,
+
+    // Write to existing files, allocated beforehand, without truncating them (only
+    // supported when opening relative to directories).
+    PREALLOCATED
+  };
+
+  // Time spent making files durable, shared between the streams of an extraction.
+  // This is updated from the closing threads when files are closed in the background.
+  struct SyncTimes {
+    std::atomic<std::chrono::nanoseconds::rep> Writeback{ 0 };
+    std::atomic<std::chrono::nanoseconds::rep> FileSync{ 0 };
+  };
+
+  MultiOutputStream(WriteCallback callback = {}, IO::UringQueue* uring = nullptr,
+                    IO::CloseQueue* closeQueue = nullptr);
 
   virtual ~MultiOutputStream();
 
   /** Opens the supplied files.
+   *
+   * @param mode How to create the files.
+   * @param skipped If not null, receives the files skipped because they already
+   *   exist (CREATE_NEW_OR_SKIP only).
    *
    * @returns true if all went OK, false if any file failed to open
    */
-  bool Open(std::vector<std::filesystem::path> const &fileNames);
+  bool Open(std::vector<std::filesystem::path> const &fileNames,
+            OpenMode mode = OpenMode::TRUNCATE,
+            std::vector<std::filesystem::path> *skipped = nullptr);
+
+#ifndef _WIN32
+  /** Opens the supplied files relative to already opened directories
+   *
+   * Each file is created by name in the directory at the same index, which must be
+   * its parent, so the kernel does not resolve the full path again.
+   */
+  bool Open(std::vector<std::filesystem::path> const &fileNames,
+            std::vector<IO::Directory const*> const &directories,
+            OpenMode mode = OpenMode::TRUNCATE,
+            std::vector<std::filesystem::path> *skipped = nullptr);
+#endif
 
   /** Closes all the files opened by the last open
+   *
+   * @param success If false, temporary files are discarded instead of
+   *   replacing their target.
    *
    * Note if there are any errors, the code will merely report the last one.
    */
-  HRESULT Close();
+  HRESULT Close(bool success = true);
 
   /** Sets the modification time on the open files
    *
@@ -74,6 +139,97 @@ public:
    */
   bool SetMTime(FILETIME const *mTime);
 
+#ifndef _WIN32
+  /** Sets the permissions of the open files from 7z attributes
+   *
+   * This is done on the open descriptors, so it must be called before Close().
+   *
+   * @param umask The umask of the process, see IO::FileOut::SetAttributes().
+   *
+   * @returns true if all files had their permissions set succesfully, false otherwise
+   */
+  bool SetAttributes(UInt32 attributes, mode_t umask);
+#endif
+
+  /** Keep the content of the open files out of the page cache
+   *
+   * Data is flushed and dropped from the cache progressively while it is written.
+   * This must be called after Open().
+   */
+  void SetCacheBypass(bool enabled);
+
+  /** Set how the open files are made durable
+   *
+   * With Durability::BATCHED, writeback is started while the data is written, with
+   * Durability::STRICT, each file is synced before being closed. Nothing is synced
+   * at the filesystem level, this is left to the caller.
+   * This must be called after Open().
+   *
+   * @param times If not null, receives the time spent syncing.
+   */
+  void SetDurability(Archive::Durability durability, SyncTimes* times);
+
+  /** Buffer the whole content in memory instead of writing it as it comes
+   *
+   * This is meant for small entries: the content is written to each file in a single
+   * call when the files are closed, together with the modification time and attributes.
+   * The files are still created by Open(). This must be called after Open() and before
+   * any write.
+   *
+   * @param pool Pool the buffer is taken from, or nullptr to write the content directly.
+   *   The pool must outlive the queues this stream hands its files to.
+   */
+  void SetBuffered(IO::BufferPool* pool);
+
+  /** Skip runs of zeros instead of writing them
+   *
+   * Runs of zero blocks (aligned in the files) of at least the given size are not
+   * written, the files are extended to their full size when closed, so the skipped
+   * ranges are holes (on Windows, the files are not sparse but the zeros are still
+   * not written). This only applies to synchronous unbuffered writes, and must be
+   * called after Open().
+   *
+   * @param threshold Minimum size of the zero runs to skip, or 0 to write everything.
+   */
+  void SetSparse(UInt64 threshold);
+
+  /** Hash the content while it is written, see Digest()
+   *
+   * The data is hashed once, whatever the number of files, as it is handed to Write().
+   * This must be called after Open() and before any write.
+   */
+  void SetHash(Archive::HashAlgorithm algorithm);
+
+  /** Retrieve the digest of the content written so far, see SetHash()
+   *
+   * @returns the digest in lowercase hexadecimal, or an empty string if the content is not
+   * hashed or was not written in order (e.g. after a seek).
+   */
+  std::string Digest() const;
+
+  /** Compute the CRC32 of the content while it is written, see CRC()
+   *
+   * Like SetHash(), this must be called after Open() and before any write.
+   */
+  void SetCRC(bool enabled);
+
+  /** Retrieve the CRC32 of the content written so far, see SetCRC()
+   *
+   * @returns the CRC, or nothing if it is not computed or the content was not written in
+   * order (e.g. after a seek).
+   */
+  std::optional<UInt32> CRC() const;
+
+#ifndef _WIN32
+  /** Write a range of the given file to all the streams
+   *
+   * When writing synchronously without hashing or CRC, the data is copied by the kernel from
+   * the source to the files (see IO::FileOut::CopyFrom() for state). Otherwise it is
+   * read and goes through Write().
+   */
+  HRESULT CopyFrom(IO::FileIn& source, UInt64 offset, UInt64 size, IO::CopyState* state = nullptr);
+#endif
+
   // ISequentialOutStream interface
 
   /** Write data to all the streams
@@ -91,6 +247,36 @@ public:
 
 private:
 
+  bool open(std::vector<std::filesystem::path> const &fileNames,
+            OpenMode mode,
+            std::vector<std::filesystem::path> *skipped,
+            std::function<bool(IO::FileOut&, std::size_t)> const &openFile);
+
+  using Buffer = IO::UringQueue::Buffer;
+
+  // Build the function writing the buffered content, applying the deferred metadata and
+  // publishing (or discarding) a file before it is closed:
+  IO::CloseQueue::Finalizer finalizer(bool success, Buffer content = {}) const;
+
+  // Write the given data to all the files, skipping long runs of zero blocks:
+  HRESULT writeSparse(const unsigned char* data, UInt32 size);
+
+  // Add the given data to the hash and CRC, or drop them if the data is not written at
+  // their end:
+  void hash(const void* data, UInt32 size);
+
+  // Give the buffer back to its pool, if any, and leave buffered mode:
+  void releaseBuffer();
+
+  // Size of the chunks used by CopyFrom(), progress is reported after each:
+  static constexpr UInt64 kCopyChunkSize = 16 << 20;
+
+  // Granularity of the zero detection for sparse files:
+  static constexpr UInt64 kSparseBlockSize = 4096;
+
+  // Release the cache (or start the writeback) of the data written so far:
+  void releaseCache();
+
   WriteCallback m_WriteCallback;
 
   /** This is the amount of data written to *any one* file.
@@ -105,6 +291,50 @@ private:
    */
   std::vector<IO::FileOut> m_Files;
 
+  /** Queue used to batch output operations, or nullptr for synchronous output.
+   *
+   * When a queue is used, writes do not move the file pointers, and the
+   * modification time and attributes are only applied once all the writes to a file have
+   * completed.
+   */
+  IO::UringQueue* m_Uring;
+
+  /** Queue used to close files in the background, or nullptr to close them
+   * synchronously. Not used if m_Uring is set.
+   */
+  IO::CloseQueue* m_CloseQueue;
+
+  /** Current position in the files.
+   */
+  UInt64 m_Position;
+  std::optional<FILETIME> m_MTime;
+  std::optional<UInt32> m_Attributes;
+#ifndef _WIN32
+  mode_t m_Umask = 0;
+#endif
+
+  Archive::Durability m_Durability;
+  SyncTimes* m_SyncTimes;
+
+  /** Pool of the buffer holding the whole content, or nullptr if the content is
+   * written to the files directly.
+   */
+  IO::BufferPool* m_BufferPool;
+  IO::BufferPool::Buffer m_Buffer;
+
+  /** Minimum size of the zero runs to skip, 0 if the files are not sparse, and
+   * end of the data (including skipped zeros).
+   */
+  UInt64 m_SparseThreshold;
+  UInt64 m_SparseEnd;
+
+  /** Hash and CRC of the content, empty if they are not computed, and end of the hashed
+   * content.
+   */
+  std::variant<std::monostate, Checksum::Xxh64, Checksum::Sha256> m_Hash;
+  std::optional<UInt32> m_CRC;
+  UInt64 m_HashEnd;
+
 };
 
 #endif // MULTIOUTPUTSTREAM_H
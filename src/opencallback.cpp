@@ -44,20 +44,56 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 CArchiveOpenCallback::CArchiveOpenCallback(
   Archive::PasswordCallback passwordCallback,
   Archive::LogCallback logCallback,
-  std::filesystem::path const& filepath)
+  std::filesystem::path const& filepath,
+  Archive::InputEngine inputEngine,
+  bool inMemory)
   : m_PasswordCallback(passwordCallback)
   , m_LogCallback(logCallback)
   , m_Path(filepath)
+  , m_InputEngine(inputEngine)
+  , m_InMemory(inMemory)
   , m_SubArchiveMode(false)
 {
-  if (!exists(filepath)) {
-    throw std::runtime_error("invalid archive path");
+  if (!inMemory && !IO::FileBase::GetFileInformation(filepath, &m_FileInfo)) {
+    throw std::runtime_error("failed to retrieve file information");
   }
+}
+
+HRESULT CArchiveOpenCallback::OpenVolume(std::filesystem::path const& path, IInStream **inStream)
+{
+  *inStream = nullptr;
 
-//  if (!IO::FileBase::GetFileInformation(filepath, &m_FileInfo)) {
-//    throw std::runtime_error("failed to retrieve file information");
-//  }
-  std::cerr << "FIXME: get m_FileInfo" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
+  auto it = m_Volumes.find(path.native());
+  if (it != m_Volumes.end()) {
+    RINOK(it->second.Stream->Seek(0, STREAM_SEEK_SET, nullptr));
+  }
+  else {
+    IO::FileInfo info;
+    if (!IO::FileBase::GetFileInformation(path, &info) || info.isDir()) {
+      return S_FALSE;
+    }
+
+    CMyComPtr<IInStream> file = openInputStream(path, m_InputEngine);
+    if (!file) {
+#ifdef _WIN32
+      return HRESULT_FROM_WIN32(::GetLastError());
+#else
+      return E_FAIL;
+#endif
+    }
+
+    // Volumes followed by another one prefetch it while they are read:
+    const auto next = nextVolumePath(path);
+    if (!next.empty()) {
+      file = new VolumeInputStream(file, info.fileSize(), next);
+    }
+    it = m_Volumes.emplace(path.native(), Volume{ info, file }).first;
+  }
+
+  m_FileInfo = it->second.Info;
+  CMyComPtr<IInStream> stream(it->second.Stream);
+  *inStream = stream.Detach();
+  return S_OK;
 }
 
 /* -------------------- IArchiveOpenCallback -------------------- */
@@ -116,58 +152,29 @@ STDMETHODIMP CArchiveOpenCallback::GetProperty(PROPID propID, PROPVARIANT *value
 
     case kpidIsDir:  prop = m_FileInfo.isDir(); break;
     case kpidSize:   prop = m_FileInfo.fileSize(); break;
-//    case kpidAttrib: prop = m_FileInfo.fileAttributes(); break;
-//    case kpidCTime:  prop = m_FileInfo.creationTime(); break;
-//    case kpidATime:  prop = m_FileInfo.lastAccessTime(); break;
-//    case kpidMTime:  prop = m_FileInfo.lastWriteTime(); break;
-    case kpidAttrib:
-    case kpidCTime:
-    case kpidATime:
-    case kpidMTime:
-      std::cerr << "FIXME: GetProperty '" + std::to_string(propID) + "'" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n"; assert(false && "Not implemented");
-      break;
+    case kpidAttrib: prop = m_FileInfo.fileAttributes(); break;
+    case kpidCTime:  prop = m_FileInfo.creationTime(); break;
+    case kpidATime:  prop = m_FileInfo.lastAccessTime(); break;
+    case kpidMTime:  prop = m_FileInfo.lastWriteTime(); break;
 
     default: m_LogCallback(Archive::LogLevel::Warning, fmt::format(ALOGSTR"Unexpected property {}.", propID));
   }
-  std::cerr << "FIXME: GetProperty '" + std::to_string(propID) + "'" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
   return S_OK;
 }
 
 STDMETHODIMP CArchiveOpenCallback::GetStream(const wchar_t *name, IInStream **inStream)
 {
-  std::cerr << "FIXME: CArchiveOpenCallback::GetStream" + std::string(" \e]8;;eclsrc://") + __FILE__ + ":" + std::to_string(__LINE__) + "\a" + __FILE__ + ":" + std::to_string(__LINE__) + "\e]8;;\a\n";
   *inStream = nullptr;
 
   // this function will be called repeatedly for split archives, `name` will
   // have increasing numbers in the extension and S_FALSE must be returned
   // when a filename doesn't exist so the search stops
 
-  if (!name) {
+  if (!name || m_InMemory) {
     return S_FALSE;
   }
 
   // `name` is just the filename, so build a path from the directory that
   // contained the last file
-  const auto path = m_Path.parent_path() / name;
-
-  if (!exists(m_FileInfo.path()) || m_FileInfo.isDir()) {
-    return S_FALSE;
-  }
-
-  if (!IO::FileBase::GetFileInformation(path, &m_FileInfo)) {
-    return S_FALSE;
-  }
-
-  CMyComPtr<InputStream> inFile(new InputStream);
-
-  if (!inFile->Open(m_FileInfo.path())) {
-#ifdef _WIN32
-    return ::GetLastError();
-#else
-  return E_FAIL;
-#endif
-  }
-
-  *inStream = inFile.Detach();
-  return S_OK;
+  return OpenVolume(m_Path.parent_path() / name, inStream);
 }
@@ -23,9 +23,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <filesystem>
 #include <string>
+#include <unordered_map>
 
 #include "7zip/Archive/IArchive.h"
 #include "7zip/IPassword.h"
+#include "Common/MyCom.h"
 
 #include "archive.h"
 #include "fileio.h"
@@ -45,12 +47,29 @@ class CArchiveOpenCallback: public IArchiveOpenCallback,
 
 public:
 
-  CArchiveOpenCallback(Archive::PasswordCallback passwordCallback, Archive::LogCallback logCallback, std::filesystem::path const &filepath);
+  /**
+   * @param filepath Path of the archive, or only its name for archives held in memory.
+   * @param inMemory True if the archive is held in memory, it then has no other volumes.
+   */
+  CArchiveOpenCallback(Archive::PasswordCallback passwordCallback, Archive::LogCallback logCallback,
+                       std::filesystem::path const &filepath, Archive::InputEngine inputEngine,
+                       bool inMemory = false);
 
   ~CArchiveOpenCallback() { }
 
   const std::wstring& GetPassword() const { return m_Password; }
 
+  /**
+   * @brief Open the given volume of the archive (or the archive itself), each volume is
+   *   only opened once and its stream reused by later calls.
+   *
+   * @param path Path to the volume.
+   * @param inStream Set to the stream of the volume, positioned at its start.
+   *
+   * @return S_OK if the volume was opened, S_FALSE if it does not exist, an error otherwise.
+   */
+  HRESULT OpenVolume(std::filesystem::path const& path, IInStream **inStream);
+
   INTERFACE_IArchiveOpenCallback(;)
   INTERFACE_IArchiveOpenVolumeCallback(;)
 
@@ -68,8 +87,19 @@ private:
   std::wstring m_Password;
 
   std::filesystem::path m_Path;
+  Archive::InputEngine m_InputEngine;
+  bool m_InMemory;
+
+  // Information of the last volume opened, for GetProperty():
   IO::FileInfo m_FileInfo;
 
+  // Volumes opened so far, by path:
+  struct Volume {
+    IO::FileInfo Info;
+    CMyComPtr<IInStream> Stream;
+  };
+  std::unordered_map<PathStr, Volume> m_Volumes;
+
   bool m_SubArchiveMode;
   std::wstring m_SubArchiveName;
 
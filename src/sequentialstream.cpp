@@ -0,0 +1,319 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "sequentialstream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+#include "fileio.h"
+
+namespace {
+
+// End of a StreamPipe read by a handler:
+class PipeReader :
+    public ISequentialInStream
+{
+
+  UNKNOWN_1_INTERFACE(ISequentialInStream);
+
+public:
+  explicit PipeReader(std::shared_ptr<StreamPipe> pipe) : m_Pipe(std::move(pipe)) { }
+
+  STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize)
+  {
+    const std::size_t read = m_Pipe->Read(data, size);
+    if (processedSize != nullptr) {
+      *processedSize = static_cast<UInt32>(read);
+    }
+    return S_OK;
+  }
+
+private:
+  std::shared_ptr<StreamPipe> m_Pipe;
+};
+
+// End of a StreamPipe written by a handler:
+class PipeWriter :
+    public ISequentialOutStream
+{
+
+  UNKNOWN_1_INTERFACE(ISequentialOutStream);
+
+public:
+  explicit PipeWriter(std::shared_ptr<StreamPipe> pipe) : m_Pipe(std::move(pipe)) { }
+
+  STDMETHOD(Write)(const void *data, UInt32 size, UInt32 *processedSize)
+  {
+    if (processedSize != nullptr) {
+      *processedSize = 0;
+    }
+    if (!m_Pipe->Write(data, size)) {
+      return E_ABORT;
+    }
+    if (processedSize != nullptr) {
+      *processedSize = size;
+    }
+    return S_OK;
+  }
+
+private:
+  std::shared_ptr<StreamPipe> m_Pipe;
+};
+
+// Extract callback sending the first item of a compressed stream to a pipe:
+class PipeExtractCallback :
+    public IArchiveExtractCallback
+{
+
+  UNKNOWN_2_INTERFACE(IArchiveExtractCallback, IProgress);
+
+public:
+  explicit PipeExtractCallback(CMyComPtr<ISequentialOutStream> writer)
+    : m_Writer(std::move(writer)), m_Result(NArchive::NExtract::NOperationResult::kOK) { }
+
+  Int32 Result() const { return m_Result; }
+
+  STDMETHOD(SetTotal)(UInt64) { return S_OK; }
+  STDMETHOD(SetCompleted)(const UInt64*) { return S_OK; }
+
+  STDMETHOD(GetStream)(UInt32 index, ISequentialOutStream **outStream, Int32 askExtractMode)
+  {
+    *outStream = nullptr;
+    if (index == 0 && askExtractMode == NArchive::NExtract::NAskMode::kExtract) {
+      CMyComPtr<ISequentialOutStream> writer(m_Writer);
+      *outStream = writer.Detach();
+    }
+    return S_OK;
+  }
+
+  STDMETHOD(PrepareOperation)(Int32) { return S_OK; }
+
+  STDMETHOD(SetOperationResult)(Int32 operationResult)
+  {
+    if (m_Result == NArchive::NExtract::NOperationResult::kOK) {
+      m_Result = operationResult;
+    }
+    return S_OK;
+  }
+
+private:
+  CMyComPtr<ISequentialOutStream> m_Writer;
+  Int32 m_Result;
+};
+
+// Wait between two reads at the end of a growing file:
+constexpr auto kGrowingFilePollInterval = std::chrono::milliseconds(50);
+
+}
+
+SequentialInputStream::SequentialInputStream(Archive::ReadCallback reader, std::stop_token stop)
+  : m_Reader(std::move(reader))
+  , m_Stop(std::move(stop))
+  , m_PeekedOffset(0)
+  , m_End(false)
+{}
+
+SequentialInputStream::~SequentialInputStream()
+{}
+
+std::string SequentialInputStream::Peek(std::size_t size)
+{
+  // The reader may return fewer bytes than asked, even before the end:
+  while (!m_End && m_Peeked.size() < size) {
+    const std::size_t offset = m_Peeked.size();
+    m_Peeked.resize(size);
+    std::size_t read = 0;
+    if (!m_Reader(reinterpret_cast<std::byte*>(m_Peeked.data() + offset), size - offset, read, m_Stop)) {
+      read = 0;
+    }
+    m_Peeked.resize(offset + read);
+    m_End = read == 0;
+  }
+  return m_Peeked.substr(0, size);
+}
+
+STDMETHODIMP SequentialInputStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+{
+  if (processedSize != nullptr) {
+    *processedSize = 0;
+  }
+  if (size == 0) {
+    return S_OK;
+  }
+
+  if (m_PeekedOffset < m_Peeked.size()) {
+    const std::size_t read = std::min<std::size_t>(size, m_Peeked.size() - m_PeekedOffset);
+    std::memcpy(data, m_Peeked.data() + m_PeekedOffset, read);
+    m_PeekedOffset += read;
+    if (m_PeekedOffset == m_Peeked.size()) {
+      m_Peeked = {};
+      m_PeekedOffset = 0;
+    }
+    if (processedSize != nullptr) {
+      *processedSize = static_cast<UInt32>(read);
+    }
+    return S_OK;
+  }
+  if (m_End) {
+    return S_OK;
+  }
+
+  if (m_Stop.stop_requested()) {
+    return E_ABORT;
+  }
+  std::size_t read = 0;
+  if (!m_Reader(static_cast<std::byte*>(data), size, read, m_Stop)) {
+    return m_Stop.stop_requested() ? E_ABORT : E_FAIL;
+  }
+  m_End = read == 0;
+  if (processedSize != nullptr) {
+    *processedSize = static_cast<UInt32>(read);
+  }
+  return S_OK;
+}
+
+StreamPipe::StreamPipe(std::size_t capacity)
+  : m_Buffer(capacity)
+  , m_Head(0)
+  , m_Size(0)
+  , m_ReaderClosed(false)
+  , m_WriterClosed(false)
+{}
+
+CMyComPtr<ISequentialInStream> StreamPipe::Reader()
+{
+  return CMyComPtr<ISequentialInStream>(new PipeReader(shared_from_this()));
+}
+
+CMyComPtr<ISequentialOutStream> StreamPipe::Writer()
+{
+  return CMyComPtr<ISequentialOutStream>(new PipeWriter(shared_from_this()));
+}
+
+std::size_t StreamPipe::Read(void *data, std::size_t size)
+{
+  std::unique_lock lock(m_Mutex);
+  m_CanRead.wait(lock, [this] { return m_Size > 0 || m_WriterClosed || m_ReaderClosed; });
+  if (m_ReaderClosed) {
+    return 0;
+  }
+
+  // At most up to the end of the ring, the handler asks again for the rest:
+  const std::size_t read = std::min({ size, m_Size, m_Buffer.size() - m_Head });
+  std::memcpy(data, m_Buffer.data() + m_Head, read);
+  m_Head = (m_Head + read) % m_Buffer.size();
+  m_Size -= read;
+  lock.unlock();
+  m_CanWrite.notify_one();
+  return read;
+}
+
+bool StreamPipe::Write(const void *data, std::size_t size)
+{
+  auto bytes = static_cast<const unsigned char*>(data);
+  while (size > 0) {
+    std::unique_lock lock(m_Mutex);
+    m_CanWrite.wait(lock, [this] { return m_Size < m_Buffer.size() || m_ReaderClosed; });
+    if (m_ReaderClosed) {
+      return false;
+    }
+
+    const std::size_t tail = (m_Head + m_Size) % m_Buffer.size();
+    const std::size_t written = std::min(size, std::min(m_Buffer.size() - m_Size, m_Buffer.size() - tail));
+    std::memcpy(m_Buffer.data() + tail, bytes, written);
+    m_Size += written;
+    bytes += written;
+    size -= written;
+    lock.unlock();
+    m_CanRead.notify_one();
+  }
+  return true;
+}
+
+void StreamPipe::CloseReader()
+{
+  {
+    std::lock_guard lock(m_Mutex);
+    m_ReaderClosed = true;
+  }
+  m_CanWrite.notify_all();
+  m_CanRead.notify_all();
+}
+
+void StreamPipe::CloseWriter()
+{
+  {
+    std::lock_guard lock(m_Mutex);
+    m_WriterClosed = true;
+  }
+  m_CanRead.notify_all();
+}
+
+HRESULT StreamPipe::Fill(IInArchive *archive)
+{
+  CMyComPtr<PipeExtractCallback> callback(new PipeExtractCallback(Writer()));
+  HRESULT result = archive->Extract(nullptr, static_cast<UInt32>(-1), false, callback);
+  if (result == S_OK && callback->Result() != NArchive::NExtract::NOperationResult::kOK) {
+    result = E_FAIL;
+  }
+  CloseWriter();
+  return result;
+}
+
+Archive::ReadCallback CreateGrowingFileReader(PathStr const& path, std::function<bool()> complete)
+{
+  auto file = std::make_shared<IO::FileIn>();
+#ifdef _WIN32
+  // The file is still being written by another process:
+  if (!file->OpenShared(IO::make_path(path), true)) {
+#else
+  if (!file->Open(IO::make_path(path))) {
+#endif
+    return {};
+  }
+
+  auto offset = std::make_shared<UInt64>(0);
+  return [file, offset, complete = std::move(complete)](std::byte* buffer, std::size_t size, std::size_t& read,
+                                                       std::stop_token stop) {
+    read = 0;
+    const UInt32 chunk = static_cast<UInt32>(std::min<std::size_t>(size, std::numeric_limits<UInt32>::max()));
+    for (;;) {
+      if (stop.stop_requested()) {
+        return false;
+      }
+      // Checked before reading, so the data written right before completion is not missed:
+      const bool done = !complete || complete();
+      UInt32 processed = 0;
+      if (!file->ReadAt(*offset, buffer, chunk, processed)) {
+        return false;
+      }
+      if (processed > 0 || done) {
+        *offset += processed;
+        read = processed;
+        return true;
+      }
+      std::this_thread::sleep_for(kGrowingFilePollInterval);
+    }
+  };
+}
@@ -0,0 +1,128 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef SEQUENTIALSTREAM_H
+#define SEQUENTIALSTREAM_H
+
+
+#include "7zip/Archive/IArchive.h"
+#include "7zip/IStream.h"
+#include "Common/MyCom.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+#include "unknown_impl.h"
+
+/** This class implements an input stream over an Archive::ReadCallback, for
+ * archives that are decoded as they arrive (pipes, downloads in progress).
+ *
+ * The first bytes can be peeked to detect the format without being consumed.
+ */
+class SequentialInputStream :
+    public ISequentialInStream
+{
+
+  UNKNOWN_1_INTERFACE(ISequentialInStream);
+
+public:
+  /** @param stop Passed to the reader, reads fail with E_ABORT once stop is requested.
+   */
+  SequentialInputStream(Archive::ReadCallback reader, std::stop_token stop);
+
+  virtual ~SequentialInputStream();
+
+  /** Read (at most) the given number of bytes from the start of the input,
+   * without consuming them. This must be called before the first Read().
+   */
+  std::string Peek(std::size_t size);
+
+  STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
+
+private:
+  Archive::ReadCallback m_Reader;
+  std::stop_token m_Stop;
+
+  // Bytes read by Peek() that have not been consumed yet:
+  std::string m_Peeked;
+  std::size_t m_PeekedOffset;
+  bool m_End;
+};
+
+/** This class implements a bounded pipe between a thread decoding an outer
+ * layer (e.g. the gzip compression of a .tar.gz) and the handler reading its
+ * output.
+ *
+ * Both ends can be closed early: the reader then sees the end of the stream,
+ * and the writer an aborted write.
+ */
+class StreamPipe :
+    public std::enable_shared_from_this<StreamPipe>
+{
+public:
+  explicit StreamPipe(std::size_t capacity = kDefaultCapacity);
+
+  /** Create the COM ends of the pipe, each keeps the pipe alive.
+   */
+  CMyComPtr<ISequentialInStream> Reader();
+  CMyComPtr<ISequentialOutStream> Writer();
+
+  /** Block until there is data (or the writer is closed), read some of it.
+   *
+   * @return the number of bytes read, 0 at the end of the stream.
+   */
+  std::size_t Read(void *data, std::size_t size);
+
+  /** Block until all the data is in the pipe.
+   *
+   * @return false if the reader was closed, the data is then dropped.
+   */
+  bool Write(const void *data, std::size_t size);
+
+  void CloseReader();
+  void CloseWriter();
+
+  /** Extract the only item of the given archive (a compressed stream) into
+   * the pipe, and close the writer end.
+   */
+  HRESULT Fill(IInArchive *archive);
+
+private:
+  static constexpr std::size_t kDefaultCapacity = 1 << 20;
+
+  std::mutex m_Mutex;
+  std::condition_variable m_CanRead;
+  std::condition_variable m_CanWrite;
+
+  // Ring buffer, holding m_Size bytes from m_Head:
+  std::vector<unsigned char> m_Buffer;
+  std::size_t m_Head;
+  std::size_t m_Size;
+
+  bool m_ReaderClosed;
+  bool m_WriterClosed;
+};
+
+#endif // SEQUENTIALSTREAM_H
@@ -0,0 +1,268 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "storedentries.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "checksum.h"
+#include "propertyvariant.h"
+
+namespace StoredEntries {
+
+  namespace {
+
+    bool readAt(IO::FileIn& file, UInt64 offset, void* data, UInt32 size) {
+      UInt64 position;
+      UInt32 processedSize;
+      return file.Seek(offset, position) && position == offset
+        && file.Read(data, size, processedSize) && processedSize == size;
+    }
+
+    template <typename T>
+    std::optional<T> getProperty(IInArchive* archive, UInt32 index, PROPID property) {
+      PropertyVariant prop;
+      if (archive->GetProperty(index, property, &prop) != S_OK || prop.is_empty()) {
+        return {};
+      }
+      try {
+        return static_cast<T>(prop);
+      }
+      catch (std::exception const&) {
+        return {};
+      }
+    }
+
+    UInt32 readLE(const unsigned char* data, int size) {
+      UInt32 value = 0;
+      for (int i = size - 1; i >= 0; --i) {
+        value = (value << 8) | data[i];
+      }
+      return value;
+    }
+
+    // Zip local file header:
+    constexpr UInt32 kZipLocalSignature = 0x04034B50;
+    constexpr UInt32 kZipLocalHeaderSize = 30;
+    constexpr UInt32 kZipFlagEncrypted = 0x1;
+    constexpr UInt32 kZipMethodStore = 0;
+
+    // Tar header:
+    constexpr UInt64 kTarBlockSize = 512;
+
+    struct TarMember {
+      UInt64 Offset;
+      UInt64 Size;
+      bool Regular;
+    };
+
+    // Parse a numeric field, octal or base-256 (GNU extension for large values):
+    std::optional<UInt64> parseTarNumber(const unsigned char* field, std::size_t size) {
+      if (field[0] & 0x80) {
+        UInt64 value = field[0] & 0x7F;
+        for (std::size_t i = 1; i < size; ++i) {
+          if (value >> 56) {
+            return {};
+          }
+          value = (value << 8) | field[i];
+        }
+        return value;
+      }
+      UInt64 value = 0;
+      std::size_t i = 0;
+      while (i < size && field[i] == ' ') {
+        ++i;
+      }
+      for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = (value << 3) | (field[i] - '0');
+      }
+      return value;
+    }
+
+    bool checkTarHeader(const unsigned char* header) {
+      auto expected = parseTarNumber(header + 148, 8);
+      UInt64 sum = 0;
+      for (std::size_t i = 0; i < kTarBlockSize; ++i) {
+        sum += (i >= 148 && i < 156) ? ' ' : header[i];
+      }
+      return expected && *expected == sum;
+    }
+
+    // Retrieve the size from pax extended header records ("<length> <key>=<value>\n"):
+    std::optional<UInt64> parsePaxSize(std::string_view records) {
+      while (!records.empty()) {
+        const auto space = records.find(' ');
+        if (space == std::string_view::npos) {
+          break;
+        }
+        const auto length = std::strtoull(std::string(records.substr(0, space)).c_str(), nullptr, 10);
+        if (length <= space || length > records.size()) {
+          break;
+        }
+        const auto record = records.substr(space + 1, length - space - 2);
+        if (record.starts_with("size=")) {
+          return std::strtoull(std::string(record.substr(5)).c_str(), nullptr, 10);
+        }
+        records.remove_prefix(length);
+      }
+      return {};
+    }
+
+    // Walk the headers of a tar archive. Extended headers (pax, GNU long names) are merged
+    // with the member that follows them, like the 7z handler does.
+    std::optional<std::vector<TarMember>> walkTar(IO::FileIn& file, UInt64 length) {
+      std::vector<TarMember> members;
+      std::optional<UInt64> paxSize;
+      std::array<unsigned char, kTarBlockSize> header;
+      for (UInt64 offset = 0; offset + kTarBlockSize <= length;) {
+        if (!readAt(file, offset, header.data(), kTarBlockSize)) {
+          return {};
+        }
+        if (std::all_of(header.begin(), header.end(), [](auto c) { return c == 0; })) {
+          break;
+        }
+        if (!checkTarHeader(header.data())) {
+          return {};
+        }
+
+        auto size = parseTarNumber(header.data() + 124, 12);
+        if (!size) {
+          return {};
+        }
+        const char type = static_cast<char>(header[156]);
+        const UInt64 dataOffset = offset + kTarBlockSize;
+        UInt64 dataSize = *size;
+
+        if (type == 'x' || type == 'X') {
+          if (dataSize > (1 << 20)) {
+            return {};
+          }
+          std::string records(dataSize, '\0');
+          if (!readAt(file, dataOffset, records.data(), static_cast<UInt32>(dataSize))) {
+            return {};
+          }
+          paxSize = parsePaxSize(records);
+        }
+        else if (type != 'L' && type != 'K' && type != 'g') {
+          if (paxSize) {
+            dataSize = *paxSize;
+            paxSize.reset();
+          }
+          const bool regular = type == '0' || type == '\0' || type == '7';
+          members.push_back({ dataOffset, regular ? dataSize : 0, regular });
+          // Links, devices, directories and FIFOs have no data whatever their size says:
+          if (type >= '1' && type <= '6') {
+            dataSize = 0;
+          }
+        }
+
+        offset = dataOffset + (dataSize + kTarBlockSize - 1) / kTarBlockSize * kTarBlockSize;
+        if (offset > length) {
+          return {};
+        }
+      }
+      return members;
+    }
+
+  }
+
+  Locations locateZip(IInArchive* archive, IO::FileIn& file, std::vector<UInt32> const& indices) {
+    Locations locations;
+    UInt64 length;
+    if (!file.GetLength(length)) {
+      return locations;
+    }
+    for (UInt32 index : indices) {
+      const auto offset = getProperty<UInt64>(archive, index, kpidOffset);
+      const auto size = getProperty<UInt64>(archive, index, kpidSize);
+      const auto packSize = getProperty<UInt64>(archive, index, kpidPackSize);
+      const auto volume = getProperty<UInt32>(archive, index, kpidVolumeIndex);
+      if (!offset || !size || !packSize || *size != *packSize || *size == 0 || (volume && *volume != 0)) {
+        continue;
+      }
+
+      std::array<unsigned char, kZipLocalHeaderSize> header;
+      if (!readAt(file, *offset, header.data(), kZipLocalHeaderSize)
+          || readLE(header.data(), 4) != kZipLocalSignature
+          || (readLE(header.data() + 6, 2) & kZipFlagEncrypted)
+          || readLE(header.data() + 8, 2) != kZipMethodStore) {
+        continue;
+      }
+
+      const UInt64 dataOffset = *offset + kZipLocalHeaderSize
+        + readLE(header.data() + 26, 2) + readLE(header.data() + 28, 2);
+      if (dataOffset + *size > length) {
+        continue;
+      }
+      locations.emplace(index, Location{ dataOffset, *size });
+    }
+    return locations;
+  }
+
+  Locations locateTar(IInArchive* archive, IO::FileIn& file, std::vector<UInt32> const& indices) {
+    Locations locations;
+    UInt64 length;
+    UInt32 numItems;
+    if (!file.GetLength(length) || archive->GetNumberOfItems(&numItems) != S_OK) {
+      return locations;
+    }
+
+    auto members = walkTar(file, length);
+    if (!members || members->size() != numItems) {
+      return locations;
+    }
+    for (UInt32 i = 0; i < numItems; ++i) {
+      auto const& member = (*members)[i];
+      const auto size = getProperty<UInt64>(archive, i, kpidSize).value_or(0);
+      if (member.Regular && member.Size != size) {
+        return locations;
+      }
+    }
+
+    for (UInt32 index : indices) {
+      auto const& member = (*members)[index];
+      if (member.Regular && member.Size > 0) {
+        locations.emplace(index, Location{ member.Offset, member.Size });
+      }
+    }
+    return locations;
+  }
+
+  std::optional<UInt32> crc32(IO::FileIn& file, Location const& location) {
+    constexpr UInt64 kBufferSize = 1 << 20;
+    std::vector<unsigned char> buffer(static_cast<std::size_t>(std::min(location.Size, kBufferSize)));
+    UInt32 crc = 0;
+    for (UInt64 offset = 0; offset < location.Size;) {
+      const auto size = static_cast<UInt32>(std::min(location.Size - offset, kBufferSize));
+      if (!readAt(file, location.Offset + offset, buffer.data(), size)) {
+        return {};
+      }
+      crc = Checksum::crc32(crc, buffer.data(), size);
+      offset += size;
+    }
+    return crc;
+  }
+
+}
@@ -0,0 +1,84 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ARCHIVE_STOREDENTRIES_H
+#define ARCHIVE_STOREDENTRIES_H
+
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "7zip/Archive/IArchive.h"
+
+#include "fileio.h"
+
+/**
+ * Helpers to locate the data of entries that are stored as-is in their archive, so
+ * it can be copied directly from the archive file instead of going through the
+ * decoder.
+ */
+namespace StoredEntries {
+
+  struct Location {
+    UInt64 Offset;
+    UInt64 Size;
+  };
+
+  using Locations = std::unordered_map<UInt32, Location>;
+
+  /**
+   * @brief Locate the entries of a zip archive that are stored without compression
+   *   nor encryption.
+   *
+   * This relies on the offset of the local headers reported by the handler (kpidOffset),
+   * which are checked against the archive file.
+   *
+   * @param archive The handler the archive was opened with.
+   * @param file The archive file.
+   * @param indices Indices of the entries to locate.
+   *
+   * @return the location of the data of the stored entries, by index.
+   */
+  Locations locateZip(IInArchive* archive, IO::FileIn& file, std::vector<UInt32> const& indices);
+
+  /**
+   * @brief Locate the regular members of a tar archive.
+   *
+   * The handler does not report data offsets, so the tar headers are walked again. Nothing is
+   * located unless the members found match the ones of the handler (count and sizes).
+   *
+   * @param archive The handler the archive was opened with.
+   * @param file The archive file.
+   * @param indices Indices of the entries to locate.
+   *
+   * @return the location of the data of the members, by index.
+   */
+  Locations locateTar(IInArchive* archive, IO::FileIn& file, std::vector<UInt32> const& indices);
+
+  /**
+   * @brief Compute the CRC32 of the data at the given location.
+   *
+   * @return the CRC, or nothing if the data could not be read.
+   */
+  std::optional<UInt32> crc32(IO::FileIn& file, Location const& location);
+
+}
+
+#endif
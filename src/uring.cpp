@@ -0,0 +1,512 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "uring.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// liburing is not available everywhere, so this talks to the kernel directly. Only the
+// small subset of the interface needed for output files is implemented.
+
+namespace IO {
+
+  namespace {
+
+    int uring_setup(unsigned entries, io_uring_params* params) {
+      return (int) ::syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+      return (int) ::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+    int uring_register(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+      return (int) ::syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+    }
+
+    unsigned load_acquire(unsigned* p) {
+      return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+    }
+
+    void store_release(unsigned* p, unsigned value) {
+      std::atomic_ref<unsigned>(*p).store(value, std::memory_order_release);
+    }
+
+  }
+
+  struct UringQueue::Impl {
+
+    // Maximum amount of data held in write buffers before we start waiting for
+    // completions:
+    static constexpr std::size_t kMaxBufferedBytes = 64 << 20;
+
+    struct Operation {
+      bool IsClose;
+      int Fd;
+      std::filesystem::path Path;
+      Buffer Data;
+      std::size_t Done;
+      UInt64 Offset;
+    };
+
+    struct FileState {
+      unsigned Pending = 0;
+      bool Failed = false;
+      std::optional<FileOut> Closing;
+      Finalizer Finalize;
+    };
+
+    ~Impl() {
+      if (SqesPtr) ::munmap(SqesPtr, SqesSize);
+      if (CqPtr && CqPtr != SqPtr) ::munmap(CqPtr, CqSize);
+      if (SqPtr) ::munmap(SqPtr, SqSize);
+      if (RingFd != -1) ::close(RingFd);
+    }
+
+    bool Setup(unsigned entries) {
+      io_uring_params params;
+      std::memset(&params, 0, sizeof(params));
+      RingFd = uring_setup(entries, &params);
+      if (RingFd < 0) {
+        RingFd = -1;
+        return false;
+      }
+
+      SqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      CqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+      if (singleMmap) {
+        SqSize = CqSize = std::max(SqSize, CqSize);
+      }
+
+      SqPtr = ::mmap(nullptr, SqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQ_RING);
+      if (SqPtr == MAP_FAILED) {
+        SqPtr = nullptr;
+        return false;
+      }
+
+      if (singleMmap) {
+        CqPtr = SqPtr;
+      }
+      else {
+        CqPtr = ::mmap(nullptr, CqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_CQ_RING);
+        if (CqPtr == MAP_FAILED) {
+          CqPtr = nullptr;
+          return false;
+        }
+      }
+
+      SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+      SqesPtr = ::mmap(nullptr, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQES);
+      if (SqesPtr == MAP_FAILED) {
+        SqesPtr = nullptr;
+        return false;
+      }
+
+      auto* sq = static_cast<unsigned char*>(SqPtr);
+      SqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+      SqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+      SqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+      SqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+      SqEntries = params.sq_entries;
+      Sqes = static_cast<io_uring_sqe*>(SqesPtr);
+      LocalTail = *SqTail;
+
+      auto* cq = static_cast<unsigned char*>(CqPtr);
+      CqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+      CqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+      CqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+      CqEntries = params.cq_entries;
+      Cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+      return true;
+    }
+
+    bool Probe() {
+      constexpr unsigned nOps = 256;
+      std::vector<unsigned char> storage(sizeof(io_uring_probe) + nOps * sizeof(io_uring_probe_op));
+      auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+      if (uring_register(RingFd, IORING_REGISTER_PROBE, probe, nOps) < 0) {
+        return false;
+      }
+      for (unsigned op : { IORING_OP_WRITE, IORING_OP_CLOSE }) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Submit the pending entries and wait for at least minComplete completions, then
+    // process all the available completions.
+    void Enter(unsigned minComplete) {
+      store_release(SqTail, LocalTail);
+      while (true) {
+        const unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int res = uring_enter(RingFd, ToSubmit, minComplete, flags);
+        if (res >= 0) {
+          ToSubmit -= std::min<unsigned>(res, ToSubmit);
+          break;
+        }
+        const int error = errno;
+        if (error == EINTR) {
+          continue;
+        }
+        // EBUSY / EAGAIN: the completion queue is full, so reap it before trying again.
+        if ((error == EBUSY || error == EAGAIN) && Reap() > 0) {
+          continue;
+        }
+        Abort(error);
+        break;
+      }
+      Reap();
+    }
+
+    // Fail all the entries that have not been submitted yet.
+    void Abort(int error) {
+      const unsigned first = LocalTail - ToSubmit;
+      std::vector<Operation*> ops;
+      for (unsigned i = first; i != LocalTail; ++i) {
+        ops.push_back(reinterpret_cast<Operation*>(Sqes[SqArray[i & SqMask]].user_data));
+      }
+      LocalTail = first;
+      ToSubmit = 0;
+      Inflight -= static_cast<unsigned>(ops.size());
+      store_release(SqTail, LocalTail);
+
+      // Closes are done directly instead, and complete with their own result:
+      for (auto* op : ops) {
+        if (op->IsClose) {
+          Complete(op, ::close(op->Fd) == 0 ? 0 : -errno);
+        }
+        else {
+          Complete(op, -error);
+        }
+      }
+    }
+
+    io_uring_sqe* GetSqe() {
+      if (LocalTail - load_acquire(SqHead) >= SqEntries) {
+        Enter(0);
+      }
+      const unsigned index = LocalTail & SqMask;
+      SqArray[index] = index;
+      io_uring_sqe* sqe = &Sqes[index];
+      std::memset(sqe, 0, sizeof(*sqe));
+      ++LocalTail;
+      ++ToSubmit;
+      ++Inflight;
+      return sqe;
+    }
+
+    void Prepare(Operation* op) {
+      io_uring_sqe* sqe = GetSqe();
+      sqe->fd = op->Fd;
+      sqe->user_data = reinterpret_cast<UInt64>(op);
+      if (op->IsClose) {
+        sqe->opcode = IORING_OP_CLOSE;
+      }
+      else {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = reinterpret_cast<UInt64>(op->Data->data() + op->Done);
+        sqe->len = static_cast<UInt32>(op->Data->size() - op->Done);
+        sqe->off = op->Offset + op->Done;
+      }
+    }
+
+    unsigned Reap() {
+      unsigned count = 0;
+      while (true) {
+        // Completing an operation may reap recursively, so the head must be re-read
+        // on each iteration:
+        const unsigned head = *CqHead;
+        if (head == load_acquire(CqTail)) {
+          break;
+        }
+        const io_uring_cqe cqe = Cqes[head & CqMask];
+        store_release(CqHead, head + 1);
+        --Inflight;
+        ++count;
+        Complete(reinterpret_cast<Operation*>(cqe.user_data), cqe.res);
+      }
+      return count;
+    }
+
+    void Complete(Operation* op, int res) {
+      std::unique_ptr<Operation> guard(op);
+
+      if (op->IsClose) {
+        if (res < 0) {
+          Failures.push_back({ op->Path, std::error_code(-res, std::system_category()) });
+        }
+        return;
+      }
+
+      if (res == -EINTR) {
+        Prepare(guard.release());
+        return;
+      }
+      if (res > 0 && op->Done + res < op->Data->size()) {
+        // Short write, queue the remaining part:
+        op->Done += res;
+        Prepare(guard.release());
+        return;
+      }
+
+      BufferedBytes -= op->Data->size();
+
+      auto it = Files.find(op->Fd);
+      if (res <= 0) {
+        Failures.push_back({ op->Path, std::error_code(res < 0 ? -res : EIO, std::system_category()) });
+        it->second.Failed = true;
+      }
+      if (--it->second.Pending == 0 && it->second.Closing) {
+        ReadyToClose.push_back(op->Fd);
+      }
+    }
+
+    // Finalize and close the files whose writes have all completed.
+    void ProcessClosing() {
+      while (!ReadyToClose.empty()) {
+        const int fd = ReadyToClose.back();
+        ReadyToClose.pop_back();
+
+        auto it = Files.find(fd);
+        FileOut file = std::move(*it->second.Closing);
+        Finalizer finalize = std::move(it->second.Finalize);
+        const bool failed = it->second.Failed;
+        Files.erase(it);
+
+        QueueClose(std::move(file), finalize, failed);
+      }
+    }
+
+    // Files whose writes failed are discarded instead of being finalized, so an incomplete
+    // temporary file never replaces its target:
+    void QueueClose(FileOut&& file, Finalizer const& finalize, bool failed) {
+      if (failed) {
+        file.Discard();
+      }
+      else if (finalize && !finalize(file)) {
+        Failures.push_back({ file.Path(), std::error_code(errno, std::system_category()) });
+      }
+      // The finalizer may have closed the file already:
+      if (file.Descriptor() == -1) {
+        return;
+      }
+      auto op = std::make_unique<Operation>();
+      op->IsClose = true;
+      op->Path = file.Path();
+      op->Fd = file.Detach();
+      Throttle(0);
+      Prepare(op.release());
+    }
+
+    // Wait for completions until we are below the limits for in-flight operations and
+    // buffered data.
+    void Throttle(std::size_t extraBytes) {
+      while (Inflight >= CqEntries || (Inflight > 0 && BufferedBytes + extraBytes > kMaxBufferedBytes)) {
+        Enter(1);
+      }
+    }
+
+    int RingFd = -1;
+
+    void* SqPtr = nullptr;
+    std::size_t SqSize = 0;
+    void* CqPtr = nullptr;
+    std::size_t CqSize = 0;
+    void* SqesPtr = nullptr;
+    std::size_t SqesSize = 0;
+
+    unsigned* SqHead = nullptr;
+    unsigned* SqTail = nullptr;
+    unsigned* SqArray = nullptr;
+    unsigned SqMask = 0;
+    unsigned SqEntries = 0;
+    io_uring_sqe* Sqes = nullptr;
+
+    unsigned* CqHead = nullptr;
+    unsigned* CqTail = nullptr;
+    unsigned CqMask = 0;
+    unsigned CqEntries = 0;
+    io_uring_cqe* Cqes = nullptr;
+
+    unsigned LocalTail = 0;
+    unsigned ToSubmit = 0;
+    unsigned Inflight = 0;
+    std::size_t BufferedBytes = 0;
+
+    std::unordered_map<int, FileState> Files;
+    std::vector<int> ReadyToClose;
+    std::vector<Failure> Failures;
+  };
+
+  bool UringQueue::IsSupported() noexcept {
+    static const bool supported = [] {
+      Impl impl;
+      return impl.Setup(4) && impl.Probe();
+    }();
+    return supported;
+  }
+
+  UringQueue::UringQueue(unsigned entries) noexcept {
+    if (!IsSupported()) {
+      return;
+    }
+    auto impl = std::make_unique<Impl>();
+    if (impl->Setup(entries)) {
+      m_Impl = std::move(impl);
+    }
+  }
+
+  UringQueue::~UringQueue() noexcept {
+    if (m_Impl) {
+      Drain();
+    }
+  }
+
+  bool UringQueue::Write(FileOut& file, UInt64 offset, Buffer buffer) {
+    if (!m_Impl || file.Descriptor() == -1) {
+      return false;
+    }
+    if (buffer->empty()) {
+      return true;
+    }
+
+    m_Impl->Throttle(buffer->size());
+
+    auto op = std::make_unique<Impl::Operation>();
+    op->IsClose = false;
+    op->Fd = file.Descriptor();
+    op->Path = file.Path();
+    op->Data = std::move(buffer);
+    op->Done = 0;
+    op->Offset = offset;
+
+    m_Impl->Files[op->Fd].Pending++;
+    m_Impl->BufferedBytes += op->Data->size();
+    m_Impl->Prepare(op.release());
+
+    // Submit as soon as a reasonable batch has been gathered, so the kernel can start
+    // working while we decode the next chunk:
+    if (m_Impl->ToSubmit >= m_Impl->SqEntries / 2) {
+      m_Impl->Enter(0);
+    }
+    m_Impl->ProcessClosing();
+    return true;
+  }
+
+  bool UringQueue::Wait(FileOut const& file) {
+    if (!m_Impl) {
+      return false;
+    }
+    const int fd = file.Descriptor();
+    while (true) {
+      auto it = m_Impl->Files.find(fd);
+      if (it == m_Impl->Files.end()) {
+        return true;
+      }
+      if (it->second.Pending == 0) {
+        return !it->second.Failed;
+      }
+      m_Impl->Enter(1);
+    }
+  }
+
+  void UringQueue::Close(FileOut&& file, Finalizer finalizer) {
+    if (!m_Impl || file.Descriptor() == -1) {
+      if (finalizer) {
+        finalizer(file);
+      }
+      file.Close();
+      return;
+    }
+
+    auto it = m_Impl->Files.find(file.Descriptor());
+    if (it == m_Impl->Files.end() || it->second.Pending == 0) {
+      bool failed = false;
+      if (it != m_Impl->Files.end()) {
+        failed = it->second.Failed;
+        m_Impl->Files.erase(it);
+      }
+      m_Impl->QueueClose(std::move(file), finalizer, failed);
+    }
+    else {
+      it->second.Closing.emplace(std::move(file));
+      it->second.Finalize = std::move(finalizer);
+    }
+    m_Impl->ProcessClosing();
+  }
+
+  std::vector<UringQueue::Failure> UringQueue::Drain() {
+    if (!m_Impl) {
+      return {};
+    }
+    while (true) {
+      m_Impl->ProcessClosing();
+      if (m_Impl->Inflight == 0 && m_Impl->ReadyToClose.empty()) {
+        break;
+      }
+      m_Impl->Enter(1);
+    }
+    std::vector<Failure> failures;
+    failures.swap(m_Impl->Failures);
+    return failures;
+  }
+
+}
+
+#else
+
+namespace IO {
+
+  struct UringQueue::Impl { };
+
+  bool UringQueue::IsSupported() noexcept { return false; }
+
+  UringQueue::UringQueue(unsigned) noexcept { }
+  UringQueue::~UringQueue() noexcept { }
+
+  bool UringQueue::Write(FileOut&, UInt64, Buffer) { return false; }
+  bool UringQueue::Wait(FileOut const&) { return false; }
+  void UringQueue::Close(FileOut&& file, Finalizer finalizer) {
+    if (finalizer) {
+      finalizer(file);
+    }
+    file.Close();
+  }
+  std::vector<UringQueue::Failure> UringQueue::Drain() { return {}; }
+
+}
+
+#endif
@@ -0,0 +1,124 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ARCHIVE_URING_H
+#define ARCHIVE_URING_H
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#include "fileio.h"
+
+namespace IO {
+
+  /**
+   * Output queue backed by a Linux io_uring instance.
+   *
+   * Writes are copied into buffers owned by the queue and submitted in batches at
+   * explicit offsets, so the caller does not wait for the kernel. Closing a file is
+   * deferred until all its writes have completed, at which point an optional finalizer
+   * is run on the file (e.g. to set its modification time) before the close itself is
+   * queued.
+   *
+   * Errors are not reported by Write() or Close() but collected and returned by Drain().
+   *
+   * This class is not thread-safe. On platforms other than Linux, IsSupported() always
+   * returns false and the queue is never open.
+   */
+  class UringQueue {
+  public:
+
+    using Buffer = std::shared_ptr<const std::vector<unsigned char>>;
+    // Finalizers return false on failure, with the error in errno.
+    using Finalizer = std::function<bool(FileOut&)>;
+
+    struct Failure {
+      std::filesystem::path Path;
+      std::error_code Error;
+    };
+
+    /**
+     * @brief Check if the running kernel supports the operations used by this queue.
+     *
+     * The probe is only done once, the result is cached for subsequent calls.
+     *
+     * @return true if an io_uring queue can be used, false otherwise.
+     */
+    static bool IsSupported() noexcept;
+
+    /**
+     * @param entries Number of submission queue entries.
+     */
+    explicit UringQueue(unsigned entries = 256) noexcept;
+    ~UringQueue() noexcept;
+
+    UringQueue(UringQueue const&) = delete;
+    UringQueue& operator=(UringQueue const&) = delete;
+
+    /**
+     * @return true if the ring was set up properly, false otherwise.
+     */
+    bool IsOpen() const noexcept { return m_Impl != nullptr; }
+
+    /**
+     * @brief Queue a write of the given buffer at the given offset in the file.
+     *
+     * @return true if the write was queued, false otherwise.
+     */
+    bool Write(FileOut& file, UInt64 offset, Buffer buffer);
+
+    /**
+     * @brief Wait for all the queued writes on the given file to complete.
+     *
+     * @return true if all the writes succeeded, false otherwise.
+     */
+    bool Wait(FileOut const& file);
+
+    /**
+     * @brief Take ownership of the given file and close it once all its pending
+     *   writes have completed.
+     *
+     * @param file The file to close.
+     * @param finalizer Function called on the file right before it is closed. Failures of the
+     *   finalizer are reported by Drain(). If a write to the file failed, the finalizer is not
+     *   called and the file is discarded instead (see FileOut::Discard()).
+     */
+    void Close(FileOut&& file, Finalizer finalizer = {});
+
+    /**
+     * @brief Submit all the queued operations and wait for them to complete.
+     *
+     * @return the list of failures since the last call to Drain().
+     */
+    std::vector<Failure> Drain();
+
+  private:
+
+    struct Impl;
+    std::unique_ptr<Impl> m_Impl;
+
+  };
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2012 Sebastian Herbord, 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "verifycallback.h"
+#include "extractcallback.h"
+
+CArchiveVerifyCallback::CArchiveVerifyCallback(Archive::EntryResult* const* results, Password& password,
+                                               std::atomic<bool> const& canceled)
+  : m_Results(results)
+  , m_Password(password)
+  , m_Canceled(canceled)
+  , m_Index(0) { }
+
+STDMETHODIMP CArchiveVerifyCallback::SetTotal(UInt64)
+{
+  return S_OK;
+}
+
+STDMETHODIMP CArchiveVerifyCallback::SetCompleted(const UInt64*)
+{
+  return m_Canceled ? E_ABORT : S_OK;
+}
+
+STDMETHODIMP CArchiveVerifyCallback::GetStream(UInt32 index, ISequentialOutStream **outStream, Int32)
+{
+  // The handler checks the data without writing it anywhere:
+  *outStream = nullptr;
+  m_Index = index;
+  return S_OK;
+}
+
+STDMETHODIMP CArchiveVerifyCallback::PrepareOperation(Int32)
+{
+  return m_Canceled ? E_ABORT : S_OK;
+}
+
+STDMETHODIMP CArchiveVerifyCallback::SetOperationResult(Int32 operationResult)
+{
+  if (m_Results[m_Index]) {
+    m_Results[m_Index]->Status = operationResultToStatus(operationResult);
+  }
+  return S_OK;
+}
+
+STDMETHODIMP CArchiveVerifyCallback::CryptoGetTextPassword(BSTR *passwordOut)
+{
+  std::scoped_lock lock(m_Password.Mutex);
+
+  // if we've already got a password or asked for it, don't ask again (and again...)
+  if (!m_Password.Asked && m_Password.Value->empty() && m_Password.Callback) {
+    *m_Password.Value = m_Password.Callback();
+    m_Password.Asked = true;
+  }
+
+  *passwordOut = ::SysAllocString(m_Password.Value->c_str());
+  return *passwordOut != 0 ? S_OK : E_OUTOFMEMORY;
+}
@@ -0,0 +1,85 @@
+/*
+Mod Organizer archive handling
+
+Copyright (C) 2012 Sebastian Herbord, 2020 MO2 Team. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef VERIFYCALLBACK_H
+#define VERIFYCALLBACK_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "7zip/Archive/IArchive.h"
+#include "7zip/IPassword.h"
+#include "Common/MyCom.h"
+
+#include "archive.h"
+#include "unknown_impl.h"
+
+/**
+ * Extraction callback for Archive::verify(): the entries are decoded in test mode, without
+ * output stream, and only the result of each entry is recorded.
+ *
+ * Several callbacks may verify parts of the same archive in parallel, each with its own
+ * handler, they then share the password and the cancellation flag.
+ */
+class CArchiveVerifyCallback: public IArchiveExtractCallback,
+                              public ICryptoGetTextPassword
+{
+
+  UNKNOWN_3_INTERFACE(IArchiveExtractCallback,
+                      ICryptoGetTextPassword,
+                      IProgress);
+
+public:
+
+  // Password of the archive, asked at most once whatever the number of callbacks, even
+  // if the answer is empty:
+  struct Password {
+    std::mutex Mutex;
+    std::wstring* Value;
+    Archive::PasswordCallback Callback;
+    bool Asked = false;
+  };
+
+  /**
+   * @param results Result of each entry, by index, or nullptr for the entries that are not
+   *   verified. Each callback must be given distinct entries.
+   * @param canceled Checked during the verification, which is aborted once it is set.
+   */
+  CArchiveVerifyCallback(Archive::EntryResult* const* results, Password& password,
+                         std::atomic<bool> const& canceled);
+
+  INTERFACE_IArchiveExtractCallback(;)
+
+  // ICryptoGetTextPassword
+  STDMETHOD(CryptoGetTextPassword)(BSTR *aPassword);
+
+private:
+
+  Archive::EntryResult* const* m_Results;
+  Password& m_Password;
+  std::atomic<bool> const& m_Canceled;
+
+  // Index of the entry being verified:
+  UInt32 m_Index;
+
+};
+
+#endif // VERIFYCALLBACK_H